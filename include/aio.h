@@ -0,0 +1,67 @@
+// aio.h - Asynchronous fs requests through submission/completion rings
+//
+// Each task gets a pair of rings on first use. The task prepares
+// requests (aio_prep), publishes a whole batch with one aio_submit, and
+// reaps completions later (aio_reap). The secondary cores execute the
+// requests between timer polls, so fs work runs in parallel with the
+// submitting task on core 0.
+//
+// Requests in a batch may run concurrently on different cores and
+// complete in any order; submit dependent operations in separate
+// batches. Buffers passed to aio_prep must stay valid until the
+// matching completion is reaped.
+
+#ifndef AIO_H
+#define AIO_H
+
+#include "fs.h"
+#include "task.h"
+
+#define AIO_RING_SIZE   16      // Entries per ring (power of two)
+
+// Operations
+#define AIO_READ        1       // pread(path, off, buf, len) -> bytes read
+#define AIO_WRITE       2       // pwrite(path, off, buf, len) -> bytes written (creates file)
+#define AIO_CREATE      3       // touch(path) -> 0
+#define AIO_UNLINK      4       // rm(path) -> 0
+#define AIO_STAT        5       // Fill the fs_dirent_t at buf -> 0
+
+typedef struct {
+    unsigned int op;
+    char path[FS_PATH_MAX];     // Absolute (aio_prep resolves against cwd)
+    void *buf;
+    unsigned long len;
+    unsigned long off;
+    unsigned long user_data;    // Returned untouched in the completion
+} aio_sqe_t;
+
+typedef struct {
+    unsigned long user_data;
+    long res;                   // Operation result, -1 on error
+    unsigned int core;          // Core that executed it
+} aio_cqe_t;
+
+// Queue one request (not yet visible to workers). Returns 0, or -1 if
+// the ring is full (too many requests in flight or unreaped) or the
+// path is too long.
+int aio_prep(unsigned int op, const char *path, void *buf, unsigned long len,
+             unsigned long off, unsigned long user_data);
+
+// Hand every prepared request to the workers. Returns how many.
+int aio_submit(void);
+
+// Copy up to max completions into out, first blocking until at least
+// min_wait are available (0 = don't block). Returns the number copied.
+int aio_reap(aio_cqe_t *out, int max, int min_wait);
+
+// Worker side: run at most one pending request. Called from the
+// secondary cores' loops. Returns 1 if it did work.
+int aio_worker_poll(unsigned int core);
+
+// Scheduler hooks: drop a dying task's unclaimed requests, and report
+// whether requests it submitted are still running (its slot and
+// buffers must not be reused until they finish).
+void aio_task_exit(task_t *task);
+int aio_busy(task_t *task);
+
+#endif // AIO_H
@@ -0,0 +1,99 @@
+// block.h - Block devices and the buffer cache
+//
+// A block device is a driver-provided table of 512-byte sectors with a
+// single transfer hook. Transfers are scatter-gather: the driver is
+// handed a run of cache buffers (BCACHE_BUF_SIZE bytes each) and moves
+// them in one multi-block command.
+//
+// Everything above the driver goes through the buffer cache, which
+// holds BCACHE_BUFS page-sized buffers in LRU order:
+//   - read-ahead: a miss right after the previous buffer of the same
+//     device reads the next BCACHE_READAHEAD buffers in the same command
+//   - write-behind: writes only dirty the buffer; dirty buffers reach
+//     the device when evicted, when too many are dirty, or on sync, with
+//     neighbouring dirty buffers merged into one command
+//
+// Large reads skip the cache where it doesn't hold the data: runs of
+// whole uncached buffers go straight into the caller's memory, up to
+// BLOCK_DIRECT_MAX buffers per command.
+
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "smp.h"
+
+#define BLOCK_SIZE          512         // Sector size
+#define BLOCK_NAME_MAX      8
+#define BLOCK_MAX_DEVS      4
+
+#define BCACHE_BUF_SIZE     4096        // Bytes per cache buffer (one page)
+#define BCACHE_BUF_SECTORS  (BCACHE_BUF_SIZE / BLOCK_SIZE)
+#define BCACHE_BUFS         64          // Buffers in the cache (256 KB)
+#define BCACHE_READAHEAD    8           // Buffers read per sequential miss
+#define BCACHE_MAX_RUN      16          // Buffers per merged write
+#define BCACHE_DIRTY_MAX    (BCACHE_BUFS / 2)   // Flush once this many are dirty
+#define BLOCK_DIRECT_MIN    2           // Buffers a read must span to bypass the cache
+#define BLOCK_DIRECT_MAX    32          // Buffers per direct command (128 KB)
+#define BLOCK_DIRECT_ALIGN  64          // Destination alignment (cache line, for DMA)
+
+typedef struct block_dev {
+    char name[BLOCK_NAME_MAX];
+    unsigned long nsectors;             // Device size
+    // Move count sectors starting at lba to (write) or from the device.
+    // segs[i] holds sectors i*BCACHE_BUF_SECTORS onward; the last
+    // segment may be partly used. Returns 0, or -1 on error.
+    int (*xfer)(struct block_dev *dev, int write, unsigned long lba,
+                unsigned int count, void *const *segs);
+    void *priv;                         // Driver state
+    unsigned long last_bno;             // Last buffer accessed (read-ahead)
+} block_dev_t;
+
+// Register a device (the driver owns dev). Returns 0, or -1 if full.
+int block_register(block_dev_t *dev);
+block_dev_t *block_get(const char *name);   // 0 if none
+block_dev_t *block_get_index(int i);        // For listing; 0 past the end
+
+// ---- Buffer cache ----
+
+#define BUF_VALID   0x1         // data holds the device contents
+#define BUF_DIRTY   0x2         // data is newer than the device
+
+typedef struct buf {
+    block_dev_t *dev;
+    unsigned long bno;                  // Buffer number (lba / BCACHE_BUF_SECTORS)
+    unsigned int flags;                 // BUF_*
+    unsigned int refs;                  // Holders (bcache_get .. bcache_put)
+    struct buf *lru_prev, *lru_next;    // Most recently used first
+    struct buf *hash_next;
+    unsigned char *data;
+} buf_t;
+
+// Pin the buffer holding bno, reading it in (plus read-ahead) on a miss.
+// Returns 0 on I/O error or if bno is past the end of the device.
+buf_t *bcache_get(block_dev_t *dev, unsigned long bno);
+void bcache_dirty(buf_t *b);            // Mark modified (written back later)
+void bcache_put(buf_t *b);              // Unpin
+
+// Write every dirty buffer of dev (0 = all devices). Returns 0, or -1 if
+// any write failed (those buffers stay dirty).
+int bcache_sync(block_dev_t *dev);
+
+// Byte-range I/O through the cache. Return bytes moved (short at the end
+// of the device), or -1 on error.
+long block_read(block_dev_t *dev, unsigned long off, void *buf, unsigned long len);
+long block_write(block_dev_t *dev, unsigned long off, const void *buf, unsigned long len);
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long readahead;            // Buffers brought in ahead of use
+    unsigned long direct;               // Buffers read around the cache
+    unsigned long writebacks;           // Buffers written to devices
+    unsigned long xfers;                // Driver commands issued
+    unsigned int cached;                // Buffers holding valid data
+    unsigned int dirty;
+} bcache_stats_t;
+
+void bcache_stats(bcache_stats_t *st);
+
+#endif // BLOCK_H
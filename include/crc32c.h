@@ -0,0 +1,34 @@
+// crc32c.h - CRC-32C (Castagnoli) checksums
+//
+// The polynomial of iSCSI, ext4 and btrfs metadata, and the one the
+// ARMv8 CRC32 extension computes in hardware (crc32c[bhwx]). With the
+// extension present, buffers are checksummed 8 bytes per instruction in
+// three interleaved streams, hiding the instruction's latency; without
+// it, table-driven, eight bytes per step.
+//
+// Checksums of pieces combine into the checksum of the whole: for
+// A followed by B, crc(AB) = shift_|B|(crc(A)) ^ crc(B), where the shift
+// is a linear map that depends only on |B|. A crc32c_shift_t holds it
+// for one length, so combining costs four table lookups.
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+// Continue a checksum over len more bytes: start with crc = 0, and pass
+// the previous result to checksum a buffer in pieces.
+unsigned int crc32c(unsigned int crc, const void *buf, unsigned long len);
+
+typedef struct {
+    unsigned int t[4][256];
+} crc32c_shift_t;
+
+// Build the operator that appends len bytes (4 KB of tables)
+void crc32c_shift_init(crc32c_shift_t *op, unsigned long len);
+
+// Checksum of A followed by B, from crc1 = crc(A) and crc2 = crc(B),
+// where op was built for B's length
+unsigned int crc32c_combine(const crc32c_shift_t *op, unsigned int crc1, unsigned int crc2);
+
+int crc32c_hw(void);                    // 1 if the CRC32 instructions are used
+
+#endif // CRC32C_H
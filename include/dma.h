@@ -0,0 +1,61 @@
+// dma.h - BCM2711 DMA controller (legacy channels)
+//
+// A channel works through a chain of 32-byte control blocks in RAM:
+// the CPU fills them in, points the channel at the first and carries
+// on; the channel raises its interrupt when a block with DMA_TI_INTEN
+// is done. Paced transfers to a peripheral wait for its DREQ line, one
+// word at a time, so the CPU is free while a slow device drains.
+//
+// Addresses in control blocks are bus addresses: RAM through
+// dma_bus_addr(), peripheral registers through dma_periph_addr().
+
+#ifndef DMA_H
+#define DMA_H
+
+#define DMA_CHANNELS        7           // Full legacy channels 0-6
+#define DMA_IRQ(ch)         (112 + (ch))    // GIC SPI 80 + ch
+
+// Transfer information (dma_cb_t.ti)
+#define DMA_TI_INTEN        (1 << 0)    // Interrupt when this block is done
+#define DMA_TI_WAIT_RESP    (1 << 3)    // Wait for each write to be acknowledged
+#define DMA_TI_DEST_DREQ    (1 << 6)    // Pace writes by the peripheral's DREQ
+#define DMA_TI_SRC_INC      (1 << 8)
+#define DMA_TI_PERMAP(n)    ((unsigned int)(n) << 16)  // DREQ line
+#define DMA_TI_NO_WIDE      (1 << 26)   // No 2-beat bursts
+
+// DREQ lines
+#define DMA_DREQ_UART0_TX   12
+
+typedef struct {
+    unsigned int ti;
+    unsigned int source_ad;
+    unsigned int dest_ad;
+    unsigned int txfr_len;              // Bytes
+    unsigned int stride;
+    unsigned int nextconbk;             // Next block's bus address, 0 = last
+    unsigned int reserved[2];
+} __attribute__((aligned(32))) dma_cb_t;
+
+// RAM (below 1 GB) as the legacy channels see it: the uncached alias
+unsigned int dma_bus_addr(const void *p);
+
+// A peripheral register (0xFE...... ARM address) as the channels see it
+unsigned int dma_periph_addr(unsigned long mmio);
+
+// Write back cached lines so the channel reads what the CPU wrote
+void dma_clean(const void *p, unsigned long len);
+
+// Reset ch and enable it in the controller
+void dma_init_channel(unsigned int ch);
+
+// Run the chain starting at cb (written back here). The channel must
+// be idle.
+void dma_start(unsigned int ch, dma_cb_t *cb);
+
+int dma_busy(unsigned int ch);          // Chain still running
+
+// Clear an idle ch's interrupt and end flags. Returns 0, or -1 if the
+// channel stopped on an error (its error state is cleared too).
+int dma_ack(unsigned int ch);
+
+#endif // DMA_H
@@ -0,0 +1,27 @@
+// fat.h - FAT32 filesystem (read-only), mounted into the ramfs tree
+//
+// A mounted volume shows up under an ordinary ramfs directory: each
+// FAT directory is read once, on first access, into ramfs nodes (which
+// the dentry cache then serves), and file reads go to the volume.
+//
+// Caching, beyond the buffer cache underneath:
+//   - the FAT itself, in page-sized windows per volume
+//   - each file's cluster chain, mapped once into runs of contiguous
+//     clusters, so a read seeks with a binary search instead of a walk
+//   - reads spanning contiguous clusters go to the device as one
+//     request (see block_read)
+//
+// Long file names are supported; names longer than FS_NAME_MAX - 1 fall
+// back to the 8.3 short name. Lookups are case-sensitive.
+
+#ifndef FAT_H
+#define FAT_H
+
+#include "block.h"
+
+// Mount the FAT32 volume on dev at path (an empty directory). The volume
+// is the first FAT32 partition of an MBR partition table or, if there
+// is no table, the whole device. Returns 0, or -1 (with a message).
+int fat_mount(block_dev_t *dev, const char *path);
+
+#endif // FAT_H
@@ -0,0 +1,64 @@
+// fd.h - File descriptors over the ramfs
+//
+// Each task has its own descriptor table. A descriptor refers to an
+// open file object that holds the resolved node and the current offset,
+// so the path is resolved once at open and streaming I/O after that
+// costs only the bytes moved. Data is (buf, len) — binary safe.
+// Descriptors on FIFOs and pipes stream through the node's pipe instead
+// (opening a FIFO waits until the other end has been opened too).
+
+#ifndef FD_H
+#define FD_H
+
+#include "fs.h"
+#include "task.h"
+
+#define FD_MAX_OPEN     64      // Open file objects, system-wide
+
+// fd_open flags
+#define O_RDONLY        0x000
+#define O_WRONLY        0x001
+#define O_RDWR          0x002
+#define O_ACCMODE       0x003
+#define O_CREAT         0x040   // Create the file if it doesn't exist
+#define O_TRUNC         0x200   // Truncate to zero length on open
+#define O_APPEND        0x400   // Every write goes to end of file
+
+// fd_lseek whence
+#define SEEK_SET        0
+#define SEEK_CUR        1
+#define SEEK_END        2
+
+typedef struct file {
+    fs_node_t *node;
+    unsigned long offset;
+    int flags;
+    int refs;                   // 0 = free slot
+} file_t;
+
+#define FD_EMFILE       (-2)    // fd_open: no free descriptor or file object
+
+// All calls act on the current task's table and return -1 on error
+// (fd_open also FD_EMFILE)
+int fd_open(const char *path, int flags);
+long fd_read(int fd, void *buf, unsigned long len);
+long fd_write(int fd, const void *buf, unsigned long len);
+long fd_lseek(int fd, long offset, int whence);
+int fd_close(int fd);
+
+// Anonymous pipe: fds[0] reads what fds[1] writes (see pipe.h for the
+// blocking rules). Returns 0, or -1 if out of descriptors or memory.
+int fd_pipe(int fds[2]);
+
+// Close every descriptor a task holds (task exit/kill)
+void fd_close_all(task_t *task);
+
+// Give a new task its creator's descriptors (task_create). Each is shared
+// with the creator, offset included, until one of them closes it.
+void fd_inherit(task_t *child, task_t *parent);
+
+// The node behind fd, pinned (release with fs_node_put), and the flags
+// it was opened with. 0 if fd isn't open.
+fs_node_t *fd_node_get(int fd, int *flags);
+
+#endif // FD_H
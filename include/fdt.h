@@ -0,0 +1,21 @@
+// fdt.h - Flattened device tree lookups
+//
+// Just enough of the FDT format to read the /chosen node the boot
+// loader (or QEMU with -dtb) fills in: the initrd location and the
+// kernel command line.
+
+#ifndef FDT_H
+#define FDT_H
+
+// Value of property name under /chosen, and its length in bytes.
+// Returns 0 if dtb is not a valid tree or there is no such property.
+const void *fdt_chosen(unsigned long dtb, const char *name, unsigned int *len);
+
+// A property value of one or two big-endian cells (len 4 or 8)
+unsigned long fdt_cell(const void *val, unsigned int len);
+
+// Numeric value of "key=N" in /chosen/bootargs. Returns 0 if the key
+// is missing or not a number.
+unsigned long fdt_bootarg_num(unsigned long dtb, const char *key);
+
+#endif // FDT_H
@@ -3,57 +3,279 @@
 // Simple tree-structured filesystem stored entirely in RAM.
 // Supports directories and files with read/write content.
 //
+// Files of up to FS_INLINE_MAX bytes are stored inside the node itself.
+// Larger file data lives in page-sized chunks reached through a two-level
+// radix index (index page -> chunk-pointer pages -> chunks), so writes
+// and appends cost O(bytes written) and unwritten ranges read as zeros.
+//
+// Concurrency: every node has a reader-writer lock. A directory's lock
+// guards its child list and hash table; a file's lock guards its data.
+// Lookups that hit the dentry cache take no lock at all. The working
+// directory is per task.
+//
+// Files (or whole directory subtrees) can be marked compressed: their
+// chunks are stored LZ4-compressed and unpacked on access, with a small
+// cache of decompressed chunks for reads. Identical compressed chunks
+// are stored once, found by their checksum.
+//
+// Every chunk's CRC-32C is kept beside it in the index. It is updated
+// lazily (on close, when packed, or when asked for) and can be checked
+// on every read (fs_set_verify).
+//
+// Execute-in-place (XIP) files instead point straight at bytes already in
+// memory — the kernel image's .rodata or the initrd — and are immutable.
+//
+// Other filesystems can be mounted on an empty directory (fs_mount).
+// Their directories are read in on first access and become ordinary
+// nodes in the tree — so path walks, the dentry cache and readdir cross
+// the mount point unchanged — while file reads go to the filesystem's
+// hooks. Mounted filesystems are read-only.
+//
 // Path format: /dir/subdir/file (absolute paths, '/' as root)
 
 #ifndef FS_H
 #define FS_H
 
+#include "smp.h"
+
 #define FS_NAME_MAX     32      // Max filename length
 #define FS_PATH_MAX     128     // Max path length
-#define FS_MAX_NODES    64      // Max total files + directories
-#define FS_MAX_DATA     4096    // Max file content size
+#define FS_MAX_NODES    262144  // Max live files + directories (pool grows on demand)
+#define FS_CHUNK_SIZE   4096    // Bytes per data chunk (one page)
+#define FS_CHUNK_SHIFT  12
+#define FS_INDEX_FANOUT 512     // Pointers per index page
+#define FS_MAX_FILE     ((unsigned long)FS_INDEX_FANOUT * FS_INDEX_FANOUT * FS_CHUNK_SIZE)  // 1 GB
+#define FS_HTAB_MIN     8       // Initial buckets in a directory hash table
+#define FS_INLINE_MAX   48      // Files up to this size live inside the node
 
 typedef enum {
     FS_FILE,
-    FS_DIR
+    FS_DIR,
+    FS_FIFO                         // Named pipe: data streams through node->pipe
 } fs_node_type_t;
 
+struct pipe;
+
+// fs_node_t.flags
+#define FS_NODE_XIP     0x1     // Content is node->xip, read-only, not owned
+#define FS_NODE_COMPRESS 0x2    // Chunks stored LZ4-compressed (dirs: new children inherit)
+#define FS_NODE_INLINE  0x4     // Content is node->idata (size <= FS_INLINE_MAX)
+#define FS_NODE_EXT     0x8     // From a mounted filesystem (node->ext), read-only
+#define FS_NODE_LOADED  0x10    // FS_NODE_EXT dir whose entries have been read in
+
+struct fs_node;
+
+// A mounted filesystem's hooks
+typedef struct fs_ops {
+    // Add dir's entries with fs_ext_add(). Called once, on first access,
+    // with dir write-locked. Returns 0, or -1 (retried on next access).
+    int (*populate)(struct fs_node *dir);
+    // Read file data; off + len is within the file. Called with the
+    // file read-locked, so concurrent calls must be safe.
+    long (*read)(struct fs_node *file, unsigned long off, void *buf, unsigned long len);
+    // Nonzero if files are made up as they are read and have no size
+    // (they show as empty): read is then called at any offset and
+    // returns 0 past the end.
+    int unsized;
+} fs_ops_t;
+
+// Per-node link to the mounted filesystem. Filesystems embed it first
+// in their own per-node struct.
+typedef struct fs_ext {
+    const fs_ops_t *ops;
+} fs_ext_t;
+
 typedef struct fs_node {
     char name[FS_NAME_MAX];
+    unsigned int hash;              // Precomputed hash of name
     fs_node_type_t type;
+    unsigned int flags;             // FS_NODE_*
     struct fs_node *parent;
-    // For directories: linked list of children
-    struct fs_node *children;
     struct fs_node *next_sibling;
-    // For files: content
-    char *data;
+    struct fs_node *hash_next;      // Chain link in parent's htab
+    unsigned long gen;              // Bumped on every add/remove (readdir cursors)
+    fs_ext_t *ext;                  // FS_NODE_EXT: the mounted filesystem's data
+    union {
+        struct {
+            // For directories: linked list of children (ordered iteration)
+            // and a hash index over them, grown with nchildren
+            struct fs_node *children;
+            struct fs_node **htab;
+            unsigned int htab_size; // Bucket count (power of two, 0 = none)
+            unsigned int nchildren;
+        };
+        struct {
+            // For files: content
+            void **index;           // Chunk index page (0 = no data yet)
+            const char *xip;        // FS_NODE_XIP: content in place
+        };
+        struct pipe *pipe;          // FS_FIFO: the ring readers and writers share
+        char idata[FS_INLINE_MAX];  // FS_NODE_INLINE: the content itself
+    };
     unsigned long size;
+    unsigned long stored;           // Bytes of chunk storage (raw pages + packed slots)
+    unsigned int refs;              // Open references (fs_node_get/put)
+    unsigned short maps;            // Mappings pinning the data (fs_node_map)
+    unsigned short wmaps;           // ...of which shared and writable
+    rwlock_t lock;                  // Children (dirs) or data (files)
 } fs_node_t;
 
+// One directory entry as returned by fs_readdir()
+typedef struct {
+    char name[FS_NAME_MAX];
+    fs_node_type_t type;
+    unsigned int flags;             // FS_NODE_*
+    unsigned long size;
+    unsigned long stored;           // Bytes of memory holding the data
+} fs_dirent_t;
+
+// Position in a directory listing. Zero it to start from the first entry.
+typedef struct {
+    unsigned long pos;              // Entries returned so far
+    unsigned long gen;              // dir->gen when next was saved
+    fs_node_t *next;                // Next entry, valid while gen matches
+} fs_dir_cursor_t;
+
 // Initialize filesystem with root directory
 void fs_init(void);
 
-// Navigation
+// Navigation (cwd is the current task's, and is held pinned)
 fs_node_t *fs_get_root(void);
 fs_node_t *fs_get_cwd(void);
 void fs_set_cwd(fs_node_t *dir);
 
+// Drop a task's cwd reference (task exit/kill)
+struct task;
+void fs_task_exit(struct task *task);
+
 // Path resolution: returns node at path, or 0 if not found
-// Supports absolute (/foo/bar) and relative (foo/bar) paths
+// Supports absolute (/foo/bar) and relative (foo/bar) paths.
+// The result is not pinned; use fs_resolve_get() to keep a node that
+// another task might remove meanwhile (release with fs_node_put()).
 fs_node_t *fs_resolve(const char *path);
+fs_node_t *fs_resolve_get(const char *path);
 
 // Directory operations
 fs_node_t *fs_mkdir(const char *path);          // Create directory
 int fs_rmdir(const char *path);                  // Remove empty directory
 
 // File operations
-fs_node_t *fs_touch(const char *path);           // Create empty file
-fs_node_t *fs_write(const char *path, const char *content);  // Write content
-const char *fs_read(const char *path, unsigned long *size);   // Read content
+fs_node_t *fs_touch(const char *path);           // Create empty file (0 if not a file)
+// Find path, creating an empty file if it doesn't exist, and return the
+// node pinned (release with fs_node_put()). An existing node may be of
+// any type.
+fs_node_t *fs_create_get(const char *path);
+fs_node_t *fs_write(const char *path, const char *content);  // Replace content
+fs_node_t *fs_create_static(const char *path, const void *data, unsigned long size);  // XIP file
 int fs_rm(const char *path);                     // Remove file
+fs_node_t *fs_mkfifo(const char *path);          // Create named pipe
+
+// Unnamed FIFO node for an anonymous pipe, returned with one reference
+// (see fs_node_get). It is in no directory and is freed on the last put.
+fs_node_t *fs_pipe_create(void);
+
+// Byte-range I/O. Writes create the file if needed and return bytes
+// written; reads return bytes read (0 at EOF). Both return -1 on error.
+// The file is pinned while it is copied, so these are safe to call
+// while another task removes it.
+long fs_pread(const char *path, unsigned long off, void *buf, unsigned long len);
+long fs_pwrite(const char *path, unsigned long off, const void *buf, unsigned long len);
+long fs_append(const char *path, const void *buf, unsigned long len);
+int fs_truncate(const char *path, unsigned long size);  // Shrink or zero-extend
+
+// Pin a node while it's in use (e.g. held by an open file). A node
+// removed while pinned is freed by the last fs_node_put().
+void fs_node_get(fs_node_t *node);
+void fs_node_put(fs_node_t *node);
+
+// Node pool stats: live nodes, and nodes the pool can hold without growing
+unsigned long fs_nodes_used(void);
+unsigned long fs_nodes_total(void);
+
+// Node-level I/O on an already-resolved file (used by the fd layer)
+long fs_node_pread(fs_node_t *file, unsigned long off, void *buf, unsigned long len);
+long fs_node_pwrite(fs_node_t *file, unsigned long off, const void *buf, unsigned long len);
+long fs_node_append(fs_node_t *file, const void *buf, unsigned long len);  // At EOF, atomically
+int fs_node_truncate(fs_node_t *file, unsigned long size);
+
+// Pack a compressed file's last chunk, which writes leave uncompressed
+// so appends don't recompress it every time. Called on close.
+void fs_node_flush(fs_node_t *file);
+
+// Pin pages pgoff..pgoff+npages-1 of a file for mapping (see mmap.h):
+// they become raw, page-sized chunks (holes filled, compressed ones
+// unpacked) that stay where they are until fs_node_unmap(). The range
+// must lie within the file's last page. XIP files can be mapped only
+// read-only and only if page-aligned; mounted files not at all.
+// shared_write says stores will go straight to the pages. Returns 0, or
+// -1 (with a message).
+int fs_node_map(fs_node_t *file, unsigned long pgoff, unsigned long npages, int shared_write);
+void *fs_node_page(fs_node_t *file, unsigned long idx);    // Address of a pinned page
+void fs_node_unmap(fs_node_t *file, int shared_write);
+
+// Turn compression on or off for a file (existing data is converted) or
+// a directory (applies to files and directories created in it later).
+int fs_set_compress(const char *path, int on);
+
+// Chunk storage totals across all files
+typedef struct {
+    unsigned long raw_chunks;       // Uncompressed chunk pages
+    unsigned long zchunks;          // Compressed chunks
+    unsigned long zbytes;           // Bytes of slots holding them
+    unsigned long zslabs;           // Slabs backing the slots (FS_ZSLAB_PAGES each)
+    unsigned long zshared;          // Chunks stored as a reference to an identical one
+} fs_data_stats_t;
+
+#define FS_ZSLAB_PAGES  4
+void fs_data_stats(fs_data_stats_t *st);
+
+// CRC-32C of a file's content. Whole chunks contribute the CRCs kept
+// with them, so only chunks written since their last checksum are read.
+// Returns 0, or -1 (with a message).
+int fs_checksum(const char *path, unsigned int *crc);
+
+// Check each chunk against its CRC as it is read (off by default). A
+// mismatch fails the read with a message.
+void fs_set_verify(int on);
+
+// Direct (zero-copy) view of file content. XIP files are always
+// contiguous; chunked files only if they fit in one chunk. Returns 0
+// otherwise (or if that chunk is compressed) — use fs_pread().
+const char *fs_read(const char *path, unsigned long *size);
+
+// Directory iteration: copy up to n entries starting at *cursor into
+// ents and advance the cursor. Returns the number filled (0 at the end),
+// or -1 if dir is not a directory. Entries added or removed between
+// calls may be missed or seen twice, as with getdents.
+int fs_readdir(fs_node_t *dir, fs_dir_cursor_t *cursor, fs_dirent_t *ents, int n);
+
+// Attributes of the node at path, in fs_dirent_t form. Returns -1 if
+// it doesn't exist.
+int fs_stat(const char *path, fs_dirent_t *st);
+
+// Mount a filesystem on path, which must be an empty directory: root
+// describes the filesystem's root directory. Returns 0 or -1.
+int fs_mount(const char *path, fs_ext_t *root);
+
+// For populate hooks: add an entry to a mounted directory (write-locked
+// by the caller). Returns the new or existing node, 0 if out of nodes.
+fs_node_t *fs_ext_add(fs_node_t *dir, const char *name, fs_node_type_t type,
+                      unsigned long size, fs_ext_t *ext);
+
+// Serialize the tree into buf (cap bytes): every directory, regular
+// file and FIFO, with file data LZ4-packed chunk by chunk. XIP files and
+// mounted filesystems are left out; they come back with the image or
+// volume they live on. Returns the image length and sets *nodes to the
+// node count, or -1 if it doesn't fit in cap.
+long fs_snapshot(void *buf, unsigned long cap, unsigned long *nodes);
+
+// Rebuild a tree saved by fs_snapshot() under an empty root (right after
+// fs_init), allocating all nodes at once. Returns 0, or -1 on a damaged
+// image or lack of memory (nodes restored up to that point are kept).
+int fs_restore(const void *img, unsigned long len, unsigned long nodes);
 
 // Listing
-void fs_ls(const char *path);                    // List directory contents
+void fs_ls(const char *path, int long_fmt);      // List directory (long: storage used)
 
 // Build full path string for a node
 void fs_get_path(fs_node_t *node, char *buf, int bufsize);
@@ -0,0 +1,30 @@
+// initramfs.h - Boot-time ramfs import from a newc cpio archive
+//
+// The archive is either linked into kernel8.img (`make initramfs`,
+// placed between __initramfs_start/__initramfs_end by linker.ld) or
+// loaded by QEMU with -initrd and found via the device tree /chosen node.
+
+#ifndef INITRAMFS_H
+#define INITRAMFS_H
+
+typedef struct {
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long bytes;
+    unsigned long skipped;      // Entries of unsupported type (links, devices)
+} initramfs_stats_t;
+
+// Unpack a newc ("070701") cpio archive into the ramfs.
+// Returns 0 on success, -1 on a malformed archive (entries before the
+// error are kept).
+int initramfs_load(const void *archive, unsigned long size, initramfs_stats_t *stats);
+
+// Find an initrd passed by the boot loader in the flattened device tree
+// (linux,initrd-start/end under /chosen). Returns 0 if there is none.
+const void *initramfs_find_initrd(unsigned long dtb, unsigned long *size);
+
+// Load the archive linked into the kernel image, then any -initrd blob.
+// Prints a one-line summary per archive.
+void initramfs_init(unsigned long dtb);
+
+#endif // INITRAMFS_H
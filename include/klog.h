@@ -0,0 +1,41 @@
+// klog.h - Kernel log: per-core lock-free rings, drained to the UART
+//
+// klog() stamps a message with the generic timer count and copies it
+// into the calling core's ring: no lock, no MMIO, IRQs masked only for
+// the copy. A drain task (klogd) merges the rings in timestamp order
+// and writes them out as
+//
+//   [    12.345678] 1: message
+//
+// (seconds since the counter started, then the core). A full ring drops
+// new messages and counts them, so logging never waits for the UART.
+
+#ifndef KLOG_H
+#define KLOG_H
+
+#define KLOG_RECORDS    64      // Records per core (power of two)
+#define KLOG_TEXT       108     // Message bytes per record (longer are cut)
+
+// Start the drain task (once the scheduler is up). Messages logged
+// before that wait in the rings.
+void klog_init(void);
+
+// Log one line (a trailing newline is optional). Callable from any
+// core and any context, IRQ handlers included.
+void klog(const char *msg);
+
+// Format (as kprintf) and log
+void klogf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Write out everything logged so far, from the caller (halt, reset)
+void klog_flush(void);
+
+typedef struct {
+    unsigned long logged;
+    unsigned long dropped;      // Ring full
+    unsigned int pending;       // Waiting for the drain
+} klog_stats_t;
+
+void klog_stats(unsigned int core, klog_stats_t *st);
+
+#endif // KLOG_H
@@ -0,0 +1,35 @@
+// kprintf.h - Formatted output
+//
+// printf-style formatting into a buffer; kprintf() then writes the
+// whole message to the UART in one uart_puts, so a line goes out in
+// one queueing pass instead of one call per piece.
+//
+// Conversions: %d %i %u %x %X %c %s %p %%
+//   flags      '-' left-justify, '0' zero-pad, '#' 0x before %x/%X
+//   width      digits, or '*' (an int argument)
+//   precision  %s only: at most that many characters ('.N' or '.*')
+//   length     'l' (long); 'll' and 'z' are accepted as the same
+// %p prints 0x and 16 hex digits, as uart_put_hex does.
+//
+// Decimal digits come two at a time from a table, with the divisions
+// by 100 done as a multiply by the reciprocal.
+
+#ifndef KPRINTF_H
+#define KPRINTF_H
+
+typedef __builtin_va_list va_list;
+#define va_start(ap, last)  __builtin_va_start(ap, last)
+#define va_arg(ap, type)    __builtin_va_arg(ap, type)
+#define va_end(ap)          __builtin_va_end(ap)
+
+// Format into buf (always NUL-terminated when size > 0). Return the
+// length the full output has, which is >= size if it was cut off.
+int ksnprintf(char *buf, unsigned long size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+int kvsnprintf(char *buf, unsigned long size, const char *fmt, va_list ap);
+
+// Format and write to the UART. Output longer than the internal buffer
+// goes out in buffer-sized pieces. Returns the length written.
+int kprintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif // KPRINTF_H
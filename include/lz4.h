@@ -0,0 +1,23 @@
+// lz4.h - LZ4 block compression
+//
+// Raw LZ4 blocks (no frame header or checksum), as used for compressed
+// ramfs chunks. Inputs are limited to 64 KB so match positions fit in
+// 16 bits.
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#define LZ4_MAX_INPUT   65535
+#define LZ4_HASH_BITS   12
+#define LZ4_WORK_SIZE   ((1 << LZ4_HASH_BITS) * 2)   // Bytes of scratch for lz4_compress
+
+// Compress len bytes of src into dst (cap bytes). work is LZ4_WORK_SIZE
+// bytes of caller scratch. Returns the compressed size, or 0 if the
+// result would not fit in cap (the data doesn't compress well enough).
+int lz4_compress(const void *src, int len, void *dst, int cap, void *work);
+
+// Decompress a block into dst (cap bytes). Returns the decompressed size,
+// or -1 if the block is malformed or would overflow dst.
+int lz4_decompress(const void *src, int len, void *dst, int cap);
+
+#endif // LZ4_H
@@ -36,5 +36,7 @@ void kfree(void *ptr);
 unsigned long memory_get_total_pages(void);
 unsigned long memory_get_free_pages(void);
 unsigned long memory_get_used_pages(void);
+unsigned long memory_get_heap_size(void);   // Bytes reserved for kmalloc
+unsigned long memory_get_heap_used(void);   // ...of which handed out so far
 
 #endif // MEMORY_H
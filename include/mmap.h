@@ -0,0 +1,50 @@
+// mmap.h - Memory-mapped ramfs files
+//
+// fs_mmap() maps a file's pages into the page-mapped window (see mmu.h)
+// with no copy:
+//   - MAP_SHARED: the mapping is the file. Stores through it are file
+//     writes, and writes through descriptors show up in it at once.
+//   - MAP_PRIVATE: reads see the file until a page is first stored to;
+//     that store faults and the page gets a private copy
+//     (copy-on-write), which the file never sees.
+//
+// A mapping covers whole pages and only pages the file has (mapping
+// doesn't extend it); bytes past EOF in the last page read as zero and
+// are dropped on unmap. While mapped, a file can't shrink. Mappings
+// belong to the task that made them and are removed when it exits.
+
+#ifndef MMAP_H
+#define MMAP_H
+
+#include "task.h"
+
+#define MMAP_MAX        32      // Mappings, system-wide
+
+// prot
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+
+// flags
+#define MAP_SHARED      0x1
+#define MAP_PRIVATE     0x2
+
+// Map len bytes of the file open on fd, from off (page-aligned). Shared
+// writable mappings need a descriptor opened O_RDWR. Returns the address,
+// or 0 (with a message).
+void *fs_mmap(int fd, unsigned long off, unsigned long len, int prot, int flags);
+
+// Remove the whole mapping at addr (len as passed to fs_mmap). Returns
+// 0, or -1 if addr isn't the start of a mapping.
+int fs_munmap(void *addr, unsigned long len);
+
+// Remove every mapping a task holds (task exit/kill)
+void mmap_task_exit(task_t *task);
+
+// Resolve a fault at far if it is a first store to a private page.
+// Returns 0 if the access can be retried, -1 if the fault isn't ours.
+int mmap_fault(unsigned long far, unsigned long esr);
+
+// Print the mappings (shell 'maps' command)
+void mmap_dump(void);
+
+#endif // MMAP_H
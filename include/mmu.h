@@ -1,7 +1,8 @@
 // mmu.h - Memory Management Unit
 //
 // AArch64 MMU with 4KB granule, 48-bit VA
-// Uses 2MB block mappings (L0 → L1 → L2 block descriptors)
+// Uses 2MB block mappings (L0 → L1 → L2 block descriptors), plus a
+// window mapped page by page (L2 → L3) for file mappings (see mmap.h)
 //
 // Memory attributes:
 //   - Normal (cacheable, write-back) for RAM
@@ -17,6 +18,24 @@ void mmu_init(void);
 // Query MMU state
 int mmu_is_enabled(void);
 
+// ---- Page-mapped window ----
+//
+// MMU_MAP_BASE.. is backed by 4KB pages mapped and unmapped at run time
+// (Normal memory, EL1 only, never executable). L3 tables are allocated
+// as the window fills. The tables are shared by all cores, and changes
+// are broadcast to their TLBs.
+
+#define MMU_MAP_BASE    0x40000000UL
+#define MMU_MAP_SIZE    0x40000000UL    // 1GB
+
+// Map the page at va (in the window) to pa, replacing any mapping.
+// Returns 0, or -1 if no page is free for a table.
+int mmu_map_page(unsigned long va, unsigned long pa, int writable);
+void mmu_unmap_page(unsigned long va);
+
+// Physical page behind va (0 if unmapped), and whether it is writable
+unsigned long mmu_lookup_page(unsigned long va, int *writable);
+
 // Print MMU configuration (for shell 'mmu' command)
 void mmu_dump_config(void);
 
@@ -0,0 +1,47 @@
+// pipe.h - Bounded byte pipes between tasks
+//
+// Backs both FIFO nodes in the ramfs (fs_mkfifo) and anonymous pipes
+// (fd_pipe). Data goes through a one-page ring; readers block while it
+// is empty, writers while it is full, each on its own wait queue.
+
+#ifndef PIPE_H
+#define PIPE_H
+
+#include "smp.h"
+#include "task.h"
+
+#define PIPE_SIZE       4096    // Ring capacity in bytes
+
+typedef struct pipe {
+    spinlock_t lock;
+    unsigned char *buf;
+    unsigned long head;             // Bytes ever written
+    unsigned long tail;             // Bytes ever read
+    unsigned int readers;           // Open read ends
+    unsigned int writers;           // Open write ends
+    unsigned int rd_opens;          // Read ends ever opened (open rendezvous)
+    unsigned int wr_opens;          // Write ends ever opened
+    wait_queue_t rd_wait;           // Readers waiting for data or a writer
+    wait_queue_t wr_wait;           // Writers waiting for space or a reader
+} pipe_t;
+
+pipe_t *pipe_create(void);          // 0 if out of memory
+void pipe_destroy(pipe_t *p);
+
+// Attach / detach one end. pipe_open() never blocks; it returns a token
+// for pipe_wait_peer(), which blocks (FIFO open semantics) until the
+// other side has been opened at least once since.
+unsigned int pipe_open(pipe_t *p, int writer);
+void pipe_wait_peer(pipe_t *p, int writer, unsigned int token);
+void pipe_close(pipe_t *p, int writer);
+
+// Read blocks while the pipe is empty and has writers; returns 0 at EOF
+// (empty, no writers). Write blocks while full and returns the bytes
+// written, or -1 if there are no readers left.
+long pipe_read(pipe_t *p, void *buf, unsigned long len);
+long pipe_write(pipe_t *p, const void *buf, unsigned long len);
+
+// Bytes currently buffered
+unsigned long pipe_used(pipe_t *p);
+
+#endif // PIPE_H
@@ -0,0 +1,24 @@
+// procfs.h - Live kernel statistics as files under /proc
+//
+// A mounted filesystem (see fs_ops_t) whose files are generated when
+// read, so tools can `cat` them and tasks can sample them with fd_read:
+//   /proc/tasks       per-task state, ticks and context switches
+//   /proc/cpus        per-core status, ticks and async requests served
+//   /proc/meminfo     page allocator, kmalloc heap and ramfs storage
+//   /proc/locks       per-core lock acquisitions and contention
+//   /proc/interrupts  per-core IRQs, timer ticks and faults
+//   /proc/klog        per-core kernel log records logged, dropped, pending
+//   /proc/uart        UART baud rate, DMA transfers and dropped input
+//   /proc/uptime      seconds and ticks since boot
+//
+// Every read generates the file afresh and returns its slice of that
+// one snapshot. A file read in several pieces can therefore mix
+// snapshots; read it whole (one page is enough) for a consistent view.
+
+#ifndef PROCFS_H
+#define PROCFS_H
+
+// Create /proc and mount the statistics files on it. Returns 0 or -1.
+int procfs_init(void);
+
+#endif // PROCFS_H
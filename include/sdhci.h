@@ -0,0 +1,19 @@
+// sdhci.h - SD card through the BCM2711 EMMC2 controller
+//
+// EMMC2 is a standard SD Host Controller (SDHCI v3). The driver brings
+// the card up at boot, then moves data with multi-block commands
+// (CMD18/CMD25 with auto CMD12). When the controller advertises ADMA2
+// the data goes by descriptor-list DMA straight into the cache buffers;
+// otherwise through the data port.
+//
+// The card is registered as block device "sd0". Under QEMU, attach an
+// image with `make run SD=disk.img`.
+
+#ifndef SDHCI_H
+#define SDHCI_H
+
+// Probe and initialize the card. Returns 0, or -1 if there is no card
+// or it didn't respond (the system runs on without it).
+int sdhci_init(void);
+
+#endif // SDHCI_H
@@ -19,6 +19,32 @@ typedef struct {
 void spin_lock(spinlock_t *lk);
 void spin_unlock(spinlock_t *lk);
 
+// Lock with local IRQs masked, so the holder can't be preempted on this
+// core. Returns the previous DAIF state for the matching unlock.
+unsigned long spin_lock_irqsave(spinlock_t *lk);
+void spin_unlock_irqrestore(spinlock_t *lk, unsigned long flags);
+
+// ---- Reader-writer lock ----
+//
+// Any number of readers or one writer. Bit 31 of cnt marks a writer,
+// the low bits count readers. Waiters sleep in WFE like spin_lock.
+
+typedef struct {
+    volatile unsigned int cnt;
+} rwlock_t;
+
+#define RWLOCK_INIT { 0 }
+
+void read_lock(rwlock_t *rw);
+void read_unlock(rwlock_t *rw);
+void write_lock(rwlock_t *rw);
+void write_unlock(rwlock_t *rw);
+
+// ---- Memory barriers (inner shareable domain) ----
+
+#define smp_rmb()   asm volatile("dmb ishld" ::: "memory")
+#define smp_wmb()   asm volatile("dmb ishst" ::: "memory")
+
 // ---- SMP init ----
 
 // Initialize and wake secondary cores
@@ -33,10 +59,17 @@ static inline unsigned int smp_core_id(void) {
 
 // ---- Per-core state ----
 
+// Counters are written only by their own core (no atomics needed);
+// readers on other cores may see them a moment late.
 typedef struct {
     volatile unsigned int online;
     volatile unsigned long ticks;
-    volatile unsigned long tasks_run;
+    volatile unsigned long aio_served;      // Async fs requests served
+    volatile unsigned long irqs;            // IRQs taken
+    volatile unsigned long faults;          // Synchronous exceptions taken
+    volatile unsigned long lock_acquires;   // Spinlocks and rwlocks taken
+    volatile unsigned long lock_contended;  // ...that were held at first try
+    volatile unsigned long lock_spins;      // Wakeups spent waiting for them
 } core_info_t;
 
 core_info_t *smp_get_core_info(unsigned int core_id);
@@ -0,0 +1,35 @@
+// snapshot.h - Save the ramfs to a RAM image that survives warm reset
+//
+// `snapshot save` serializes the tree (fs_snapshot) into a region of RAM
+// the allocator never hands out, behind a header with a CRC-32C over
+// the image. A warm reset (`reboot`) leaves RAM as it is, so the next
+// boot finds the image, checks it and restores the tree before the
+// initramfs is unpacked. A cold boot leaves garbage there, which the
+// checks reject.
+//
+// The region sits well above the page allocator's 64 MB and above where
+// QEMU loads an -initrd (128 MB).
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#define SNAPSHOT_BASE   0x20000000UL        // 512 MB
+#define SNAPSHOT_SIZE   (32UL * 1024 * 1024)
+
+// Save the tree, replacing any earlier image once the new one is
+// complete. Returns 0, or -1 (with a message, keeping the earlier image)
+// if it doesn't fit in half the region.
+int snapshot_save(void);
+
+// At boot, before anything is created: restore the tree from a valid
+// image. Returns the nodes restored, 0 if there is no image, or -1 if
+// the image is damaged.
+long snapshot_restore(void);
+
+void snapshot_info(void);           // Describe the saved image
+void snapshot_clear(void);          // Invalidate it
+
+// Warm-reset the board through the power-management watchdog
+void snapshot_reboot(void) __attribute__((noreturn));
+
+#endif // SNAPSHOT_H
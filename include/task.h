@@ -3,7 +3,14 @@
 #ifndef TASK_H
 #define TASK_H
 
+#include "smp.h"
+
 #define MAX_TASKS 8
+#define TASK_MAX_FILES 16       // Descriptors per task
+
+struct file;
+struct fs_node;
+struct task;
 
 typedef enum {
     TASK_READY,
@@ -19,9 +26,25 @@ typedef struct task {
     unsigned int id;
     char name[32];
     unsigned long sleep_until;
+    unsigned long ticks;        // Timer ticks that found it running
+    unsigned long switches;     // Times switched in
+    struct file *files[TASK_MAX_FILES];  // Descriptor table (see fd.h)
+    struct fs_node *cwd;        // Working directory (0 = root)
+    unsigned int locks_held;    // Shared-state locks held (task_lock_hold)
+    int kill_pending;           // task_kill deferred until locks_held is 0
+    struct wait_queue *waiting_on;  // Queue this task is blocked on, if any
+    struct task *wait_next;     // Link in that queue
     struct task *next;
 } task_t;
 
+// Tasks blocked until some condition changes (FIFO order)
+typedef struct wait_queue {
+    struct task *head;
+    struct task *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT {0, 0}
+
 // Scheduler API
 void scheduler_init(void);
 void task_create(void (*entry_point)(void), const char *name);
@@ -31,6 +54,26 @@ void task_sleep(unsigned int ms);
 void task_exit(void);
 int task_kill(unsigned int task_id);  // Kill task by ID. Returns 0=success, -1=not found
 
+// Account for a lock that other cores may spin on (fs node locks, the
+// fs pools, the FAT and buffer caches), around taking and dropping it.
+// A task killed while preempted holding one would leave the aio workers
+// on cores 1-3 spinning forever, so task_kill only marks such a task;
+// it exits when it drops its last one. That can be mid-operation, so
+// a pinned node or buffer it had may leak, as with any kill. Only core
+// 0 runs tasks, so calls on the other cores are ignored.
+void task_lock_hold(void);
+void task_lock_drop(void);
+
+// Block the current task on wq. The caller holds lock (taken with
+// spin_lock_irqsave, flags = its return value) after finding that it
+// must wait; queueing and unlocking happen together, so a wake_up() by
+// a task that takes lock next can't be missed. Returns with lock
+// released — re-take it and re-check the condition.
+void task_wait(wait_queue_t *wq, spinlock_t *lock, unsigned long flags);
+
+// Make every task on wq runnable again
+void wake_up_all(wait_queue_t *wq);
+
 // IRQ-based scheduling (called from vectors.S)
 unsigned long schedule_irq(unsigned long current_sp);
 
@@ -3,6 +3,8 @@
 #ifndef TIMER_H
 #define TIMER_H
 
+#define TIMER_TICK_MS   100     // Scheduler tick interval (timer_init)
+
 // Initialize the timer with given interval in milliseconds
 void timer_init(unsigned int interval_ms);
 
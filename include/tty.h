@@ -0,0 +1,51 @@
+// tty.h - Console line discipline
+//
+// Sits between the UART and the shell. Input comes out of the UART's RX
+// ring, which the RX interrupt fills; a read with nothing there sleeps
+// the calling task on the ring's wait queue, so a shell waiting for a
+// keystroke leaves the core to other tasks (or to wfi).
+//
+// tty_readline() is the cooked mode: the line is echoed and can be
+// edited until Enter:
+//   Left/Right, Home/End, Ctrl+A/Ctrl+E   move the cursor
+//   Backspace, Delete                     delete before / at the cursor
+//   Ctrl+W, Ctrl+U                        delete the word / whole line
+//   Up/Down                               browse history (if enabled)
+//   Tab, Ctrl+L                           completion / redraw hooks
+//   Ctrl+C, Ctrl+D (on an empty line)     cancel / end of input
+
+#ifndef TTY_H
+#define TTY_H
+
+#define TTY_LINE_MAX    256     // Longest line (with its NUL)
+#define TTY_HISTORY     16      // Lines kept for Up/Down
+
+#define TTY_INTR        (-1)    // Ctrl+C
+#define TTY_EOF         (-2)    // Ctrl+D on an empty line
+
+typedef struct {
+    // Print the prompt again (Ctrl+L, after a completion listing)
+    void (*prompt)(void);
+    // Tab, with the cursor at the end of the line: extend buf[0..*len)
+    // in place, echoing what is added
+    void (*complete)(char *buf, int *len);
+    int history;                // Record lines and browse them with Up/Down
+} tty_opts_t;
+
+// Read an edited line into buf (max bytes, at most TTY_LINE_MAX).
+// Returns its length, or TTY_INTR / TTY_EOF (buf is then empty).
+// opts may be 0 for a plain line with no history.
+int tty_readline(char *buf, int max, const tty_opts_t *opts);
+
+// Raw input: one byte, sleeping until it arrives
+int tty_getc(void);
+
+// One byte, or -1 if none arrives within ms. The caller sleeps a timer
+// tick at a time in between.
+int tty_getc_timeout(unsigned int ms);
+
+// Recorded lines: index 0 is the most recent. 0 past the end.
+int tty_history_count(void);
+const char *tty_history(int index);
+
+#endif // TTY_H
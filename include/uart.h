@@ -1,23 +1,69 @@
 // uart.h - UART driver header
+//
+// PL011 UART0. Polled at boot; uart_enable_irq() switches to interrupt-
+// driven TX/RX rings, after which output returns once queued and
+// blocking reads sleep the calling task. Large backlogs of output go
+// to the TX FIFO by DMA.
 
 #ifndef UART_H
 #define UART_H
 
+#define UART_IRQ        153     // PL011 in the GIC (SPI 121)
+#define UART_DMA_CH     5       // DMA channel for bulk TX
+#define UART_DMA_IRQ    117     // Its interrupt (DMA_IRQ(UART_DMA_CH))
+
+#define UART_CLOCK      48000000    // UARTCLK on the Pi 4
+#define UART_BAUD_MAX   (UART_CLOCK / 16)   // 3 Mbaud
+#ifndef UART_BAUD
+#define UART_BAUD       115200      // Boot rate (make BAUD=N)
+#endif
+
 // Initialize UART
 void uart_init(void);
 
+// Switch to interrupt-driven I/O (once the GIC and scheduler are up)
+void uart_enable_irq(void);
+
+// PL011 and TX DMA channel interrupt handlers (called from irq_handler_c)
+void uart_handle_irq(void);
+void uart_handle_dma_irq(void);
+
+// Send everything queued, polling, and wait for the line to go idle
+// (before halting or resetting)
+void uart_flush(void);
+
+// Switch the line to rate, after sending what is already queued at the
+// old one. Returns 0, or -1 if the divisor can't be made (over
+// UART_BAUD_MAX or under ~46 baud).
+int uart_set_baud(unsigned long rate);
+
+// Current rate as set; *actual (if not 0) gets the rate the rounded
+// divisor really produces
+unsigned int uart_get_baud(unsigned int *actual);
+
 // Output functions
 void uart_putc(unsigned char c);
 void uart_puts(const char* str);
 void uart_put_hex(unsigned long value);
 void uart_put_dec(unsigned long value);
 
+// Bulk text output: len bytes, NULs included, with '\n' sent as "\r\n"
+// like uart_puts (so not for raw binary). Sleeps for ring space when
+// called from a task that can.
+void uart_write(const char *buf, unsigned long len);
+
 // Input functions
 unsigned char uart_getc(void);      // Blocking read
 int uart_getc_nonblock(void);       // Non-blocking read (-1 if no data)
 int uart_has_data(void);            // Check if data available
 
-// Line input with echo
-void uart_gets(char* buffer, int max_len);
+typedef struct {
+    unsigned long dma_runs;             // TX DMA transfers started
+    unsigned long dma_bytes;            // Bytes sent by them
+    unsigned long dma_errors;           // (DMA is turned off after one)
+    unsigned long rx_dropped;           // Bytes lost to a full RX ring
+} uart_stats_t;
+
+void uart_stats(uart_stats_t *st);
 
 #endif // UART_H
@@ -0,0 +1,227 @@
+// aio.c - Asynchronous fs requests through submission/completion rings
+//
+// Ring indices are free-running counters:
+//   cq_head <= cq_tail <= sq_head <= sq_ready <= sq_tail
+// The owner task moves sq_tail (prep), sq_ready (submit) and cq_head
+// (reap); workers move sq_head (claim) and cq_tail (complete). prep
+// refuses once sq_tail - cq_head reaches AIO_RING_SIZE, so a completion
+// always has a free CQ slot. An SQ slot, however, can be reused while
+// the request claimed from it still runs: workers complete out of order,
+// so reaping later completions frees the slot of an earlier, slower one.
+// Workers therefore copy the SQE out under the lock when they claim it
+// and never look at the slot again.
+//
+// Rings are indexed by task slot and kept when the task dies; the next
+// task in that slot resets it. A dead owner's unclaimed requests are
+// dropped, and task_create() skips the slot while claimed ones still run.
+
+#include "aio.h"
+#include "memory.h"
+#include "smp.h"
+
+typedef struct {
+    spinlock_t lock;
+    unsigned int owner;             // Task id
+    int dead;                       // Owner gone: claim nothing more
+    unsigned int sq_tail;           // Prepared
+    unsigned int sq_ready;          // Submitted (visible to workers)
+    unsigned int sq_head;           // Claimed by workers
+    unsigned int cq_tail;           // Completed
+    unsigned int cq_head;           // Reaped
+    unsigned int inflight;          // Claimed, not completed
+    wait_queue_t cq_wait;           // Owner blocked in aio_reap
+    aio_cqe_t cq[AIO_RING_SIZE];
+    aio_sqe_t sq[AIO_RING_SIZE];
+} aio_ring_t;
+
+static aio_ring_t *rings[MAX_TASKS];
+static unsigned int worker_next;    // Ring to look at first (fairness hint)
+
+// ---- Helpers ----
+
+static int task_slot(task_t *task) {
+    return (int)(task - get_task_pool());
+}
+
+static void ring_reset(aio_ring_t *r, unsigned int owner) {
+    r->owner = owner;
+    r->dead = 0;
+    r->sq_tail = r->sq_ready = r->sq_head = 0;
+    r->cq_tail = r->cq_head = 0;
+    r->inflight = 0;
+    r->cq_wait.head = r->cq_wait.tail = 0;
+}
+
+// The current task's ring, created or taken over from the slot's
+// previous owner on first use
+static aio_ring_t *current_ring(void) {
+    task_t *task = get_current_task();
+    if (!task) return 0;
+    int slot = task_slot(task);
+
+    aio_ring_t *r = rings[slot];
+    if (!r) {
+        if (PAGE_SIZE < sizeof(aio_ring_t)) return 0;
+        r = (aio_ring_t *)page_alloc();
+        if (!r) return 0;
+        r->lock.lock = 0;
+        ring_reset(r, task->id);
+        smp_wmb();                  // Initialized before workers can see it
+        rings[slot] = r;
+        return r;
+    }
+
+    if (r->owner != task->id) {
+        unsigned long irq = spin_lock_irqsave(&r->lock);
+        int busy = r->inflight > 0;
+        if (!busy) ring_reset(r, task->id);
+        spin_unlock_irqrestore(&r->lock, irq);
+        if (busy) return 0;
+    }
+    return r;
+}
+
+// Runs on a secondary core, concurrently with the submitter and the
+// shell: every fs call here pins the node it works on (see fs.h)
+static long aio_execute(const aio_sqe_t *sqe) {
+    switch (sqe->op) {
+        case AIO_READ:   return fs_pread(sqe->path, sqe->off, sqe->buf, sqe->len);
+        case AIO_WRITE:  return fs_pwrite(sqe->path, sqe->off, sqe->buf, sqe->len);
+        case AIO_CREATE: return fs_touch(sqe->path) ? 0 : -1;
+        case AIO_UNLINK: return fs_rm(sqe->path);
+        case AIO_STAT:   return fs_stat(sqe->path, (fs_dirent_t *)sqe->buf);
+        default:         return -1;
+    }
+}
+
+// ---- Submitter side ----
+
+int aio_prep(unsigned int op, const char *path, void *buf, unsigned long len,
+             unsigned long off, unsigned long user_data) {
+    aio_ring_t *r = current_ring();
+    if (!r) return -1;
+    if (r->sq_tail - r->cq_head >= AIO_RING_SIZE) return -1;
+
+    aio_sqe_t *sqe = &r->sq[r->sq_tail % AIO_RING_SIZE];
+
+    // Workers have no cwd: store the path absolute
+    int n = 0;
+    if (path[0] != '/') {
+        fs_get_path(fs_get_cwd(), sqe->path, FS_PATH_MAX);
+        while (sqe->path[n]) n++;
+        if (n > 1) sqe->path[n++] = '/';
+    }
+    for (const char *p = path; *p; p++) {
+        if (n >= FS_PATH_MAX - 1) return -1;
+        sqe->path[n++] = *p;
+    }
+    sqe->path[n] = '\0';
+
+    sqe->op = op;
+    sqe->buf = buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+    r->sq_tail++;
+    return 0;
+}
+
+int aio_submit(void) {
+    task_t *task = get_current_task();
+    if (!task) return 0;
+    aio_ring_t *r = rings[task_slot(task)];
+    if (!r || r->owner != task->id) return 0;
+
+    // The lock orders the SQE stores before the new sq_ready
+    unsigned long irq = spin_lock_irqsave(&r->lock);
+    int n = (int)(r->sq_tail - r->sq_ready);
+    r->sq_ready = r->sq_tail;
+    spin_unlock_irqrestore(&r->lock, irq);
+
+    if (n > 0)
+        asm volatile("sev");        // One notification for the whole batch
+    return n;
+}
+
+int aio_reap(aio_cqe_t *out, int max, int min_wait) {
+    task_t *task = get_current_task();
+    if (!task) return 0;
+    aio_ring_t *r = rings[task_slot(task)];
+    if (!r || r->owner != task->id) return 0;
+
+    unsigned long irq = spin_lock_irqsave(&r->lock);
+    // Never wait for more than has been submitted
+    unsigned int outstanding = r->sq_ready - r->cq_head;
+    if (min_wait > (int)outstanding) min_wait = (int)outstanding;
+    if (min_wait > max) min_wait = max;
+
+    while ((int)(r->cq_tail - r->cq_head) < min_wait) {
+        task_wait(&r->cq_wait, &r->lock, irq);
+        irq = spin_lock_irqsave(&r->lock);
+    }
+
+    int n = 0;
+    while (n < max && r->cq_head != r->cq_tail) {
+        aio_cqe_t *c = &r->cq[r->cq_head % AIO_RING_SIZE];
+        out[n].user_data = c->user_data;
+        out[n].res = c->res;
+        out[n].core = c->core;
+        r->cq_head++;
+        n++;
+    }
+    spin_unlock_irqrestore(&r->lock, irq);
+    return n;
+}
+
+// ---- Worker side ----
+
+int aio_worker_poll(unsigned int core) {
+    for (int k = 0; k < MAX_TASKS; k++) {
+        int i = (int)((worker_next + k) % MAX_TASKS);
+        aio_ring_t *r = rings[i];
+        if (!r || r->sq_head == r->sq_ready) continue;  // Unlocked peek
+
+        unsigned long irq = spin_lock_irqsave(&r->lock);
+        if (r->dead || r->sq_head == r->sq_ready) {
+            spin_unlock_irqrestore(&r->lock, irq);
+            continue;
+        }
+        aio_sqe_t sqe = r->sq[r->sq_head % AIO_RING_SIZE];
+        r->sq_head++;
+        r->inflight++;
+        spin_unlock_irqrestore(&r->lock, irq);
+        worker_next = (unsigned int)i + 1;
+
+        long res = aio_execute(&sqe);
+
+        irq = spin_lock_irqsave(&r->lock);
+        aio_cqe_t *c = &r->cq[r->cq_tail % AIO_RING_SIZE];
+        c->user_data = sqe.user_data;
+        c->res = res;
+        c->core = core;
+        r->cq_tail++;
+        r->inflight--;
+        wake_up_all(&r->cq_wait);
+        spin_unlock_irqrestore(&r->lock, irq);
+        return 1;
+    }
+    return 0;
+}
+
+// ---- Scheduler hooks ----
+
+void aio_task_exit(task_t *task) {
+    aio_ring_t *r = rings[task_slot(task)];
+    if (!r || r->owner != task->id) return;
+
+    unsigned long irq = spin_lock_irqsave(&r->lock);
+    r->dead = 1;
+    r->sq_ready = r->sq_head;       // Drop what no worker has claimed
+    r->sq_tail = r->sq_head;
+    spin_unlock_irqrestore(&r->lock, irq);
+}
+
+int aio_busy(task_t *task) {
+    aio_ring_t *r = rings[task_slot(task)];
+    return r && r->inflight > 0;
+}
@@ -0,0 +1,386 @@
+// block.c - Block device registry and buffer cache
+//
+// One lock covers the cache and is held across driver transfers: the
+// single SD controller serializes commands anyway, and holding it keeps
+// two misses on the same buffer from both reading it in.
+
+#include "block.h"
+#include "memory.h"
+#include "task.h"
+
+#define BCACHE_HASH     128     // Hash buckets (power of two)
+
+static block_dev_t *devs[BLOCK_MAX_DEVS];
+static int ndevs = 0;
+
+static buf_t bufs[BCACHE_BUFS];
+static buf_t *lru_head = 0;             // Most recently used
+static buf_t *lru_tail = 0;             // Eviction starts here
+static buf_t *htab[BCACHE_HASH];
+static spinlock_t bcache_lock = SPINLOCK_INIT;
+static int bcache_ready = 0;
+static unsigned int ndirty = 0;
+static bcache_stats_t stats;
+
+// ---- Helpers ----
+
+// The lock is taken by aio workers too (FAT reads): a task holding it
+// must not be killed on the spot (see task_lock_hold)
+static void bcache_lock_take(void) {
+    task_lock_hold();
+    spin_lock(&bcache_lock);
+}
+
+static void bcache_lock_drop(void) {
+    spin_unlock(&bcache_lock);
+    task_lock_drop();
+}
+
+static int name_eq(const char *a, const char *b) {
+    while (*a && *a == *b) { a++; b++; }
+    return *a == *b;
+}
+
+static void copy_bytes(void *dst, const void *src, unsigned long n) {
+    unsigned char *d = (unsigned char *)dst;
+    const unsigned char *s = (const unsigned char *)src;
+    while (n--) *d++ = *s++;
+}
+
+static unsigned int bucket(block_dev_t *dev, unsigned long bno) {
+    return (unsigned int)(((unsigned long)dev >> 4) + bno) & (BCACHE_HASH - 1);
+}
+
+static buf_t *lookup(block_dev_t *dev, unsigned long bno) {
+    for (buf_t *b = htab[bucket(dev, bno)]; b; b = b->hash_next)
+        if (b->dev == dev && b->bno == bno)
+            return b;
+    return 0;
+}
+
+static void hash_insert(buf_t *b) {
+    unsigned int h = bucket(b->dev, b->bno);
+    b->hash_next = htab[h];
+    htab[h] = b;
+}
+
+static void hash_remove(buf_t *b) {
+    if (!b->dev) return;
+    buf_t **pp = &htab[bucket(b->dev, b->bno)];
+    while (*pp && *pp != b) pp = &(*pp)->hash_next;
+    if (*pp) *pp = b->hash_next;
+    b->hash_next = 0;
+}
+
+static void lru_unlink(buf_t *b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next;
+    else lru_head = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+    else lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = 0;
+}
+
+static void lru_push_front(buf_t *b) {
+    b->lru_prev = 0;
+    b->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = b;
+    lru_head = b;
+    if (!lru_tail) lru_tail = b;
+}
+
+static void lru_push_back(buf_t *b) {
+    b->lru_next = 0;
+    b->lru_prev = lru_tail;
+    if (lru_tail) lru_tail->lru_next = b;
+    lru_tail = b;
+    if (!lru_head) lru_head = b;
+}
+
+static int bcache_init(void) {
+    for (int i = 0; i < BCACHE_BUFS; i++) {
+        bufs[i].data = (unsigned char *)page_alloc();
+        if (!bufs[i].data) return -1;
+        bufs[i].dev = 0;
+        bufs[i].flags = 0;
+        bufs[i].refs = 0;
+        bufs[i].hash_next = 0;
+        lru_push_back(&bufs[i]);
+    }
+    bcache_ready = 1;
+    return 0;
+}
+
+// Write the run of consecutive dirty buffers around b in one transfer.
+// Caller holds bcache_lock.
+static int write_run(buf_t *b) {
+    block_dev_t *dev = b->dev;
+    buf_t *run[BCACHE_MAX_RUN];
+    void *segs[BCACHE_MAX_RUN];
+
+    // Back up to the start of the run, but keep b inside the window
+    buf_t *start = b;
+    for (int i = 1; i < BCACHE_MAX_RUN && start->bno > 0; i++) {
+        buf_t *p = lookup(dev, start->bno - 1);
+        if (!p || !(p->flags & BUF_DIRTY)) break;
+        start = p;
+    }
+
+    int n = 0;
+    for (buf_t *p = start; p && (p->flags & BUF_DIRTY) && n < BCACHE_MAX_RUN;
+         p = lookup(dev, p->bno + 1)) {
+        run[n] = p;
+        segs[n] = p->data;
+        n++;
+    }
+
+    unsigned long lba = start->bno * BCACHE_BUF_SECTORS;
+    unsigned long count = (unsigned long)n * BCACHE_BUF_SECTORS;
+    if (count > dev->nsectors - lba) count = dev->nsectors - lba;
+
+    stats.xfers++;
+    if (dev->xfer(dev, 1, lba, (unsigned int)count, segs) < 0)
+        return -1;
+
+    for (int i = 0; i < n; i++)
+        run[i]->flags &= ~BUF_DIRTY;
+    ndirty -= n;
+    stats.writebacks += n;
+    return 0;
+}
+
+// Least recently used unpinned buffer, written back first if dirty.
+// Caller holds bcache_lock.
+static buf_t *grab_victim(void) {
+    for (buf_t *b = lru_tail; b; b = b->lru_prev) {
+        if (b->refs) continue;
+        if ((b->flags & BUF_DIRTY) && write_run(b) < 0) continue;
+        hash_remove(b);
+        b->dev = 0;
+        b->flags = 0;
+        return b;
+    }
+    return 0;
+}
+
+// Read up to max whole buffers from bno on straight into dst, stopping
+// at the first one the cache holds (it may be dirty). Returns bytes
+// read, 0 if bno itself is cached, -1 on error.
+static long read_direct(block_dev_t *dev, unsigned long bno, unsigned long max, char *dst) {
+    void *segs[BLOCK_DIRECT_MAX];
+    unsigned long whole = dev->nsectors / BCACHE_BUF_SECTORS;
+    if (max > BLOCK_DIRECT_MAX) max = BLOCK_DIRECT_MAX;
+
+    bcache_lock_take();
+    unsigned long n = 0;
+    while (n < max && bno + n < whole && !lookup(dev, bno + n)) {
+        segs[n] = dst + n * BCACHE_BUF_SIZE;
+        n++;
+    }
+    if (n == 0) {
+        bcache_lock_drop();
+        return 0;
+    }
+    stats.xfers++;
+    int err = dev->xfer(dev, 0, bno * BCACHE_BUF_SECTORS,
+                        (unsigned int)(n * BCACHE_BUF_SECTORS), segs) < 0;
+    if (!err) stats.direct += n;
+    dev->last_bno = bno + n - 1;    // Small reads after this still read ahead
+    bcache_lock_drop();
+    return err ? -1 : (long)(n * BCACHE_BUF_SIZE);
+}
+
+// ---- Devices ----
+
+int block_register(block_dev_t *dev) {
+    if (ndevs >= BLOCK_MAX_DEVS) return -1;
+    if (!bcache_ready && bcache_init() < 0) return -1;
+    dev->last_bno = (unsigned long)-2;      // Not sequential with anything
+    devs[ndevs++] = dev;
+    return 0;
+}
+
+block_dev_t *block_get(const char *name) {
+    for (int i = 0; i < ndevs; i++)
+        if (name_eq(devs[i]->name, name))
+            return devs[i];
+    return 0;
+}
+
+block_dev_t *block_get_index(int i) {
+    return (i >= 0 && i < ndevs) ? devs[i] : 0;
+}
+
+// ---- Buffer cache ----
+
+buf_t *bcache_get(block_dev_t *dev, unsigned long bno) {
+    if (bno >= (dev->nsectors + BCACHE_BUF_SECTORS - 1) / BCACHE_BUF_SECTORS)
+        return 0;
+
+    bcache_lock_take();
+    int sequential = (bno == dev->last_bno + 1);
+    dev->last_bno = bno;
+
+    buf_t *b = lookup(dev, bno);
+    if (b) {
+        stats.hits++;
+        b->refs++;
+        lru_unlink(b);
+        lru_push_front(b);
+        bcache_lock_drop();
+        return b;
+    }
+    stats.misses++;
+
+    // Claim buffers for bno and, on a sequential miss, the uncached ones
+    // after it, then fill them all with one transfer
+    buf_t *run[BCACHE_READAHEAD];
+    void *segs[BCACHE_READAHEAD];
+    int want = sequential ? BCACHE_READAHEAD : 1;
+    int n = 0;
+    while (n < want) {
+        unsigned long nb = bno + n;
+        if (nb * BCACHE_BUF_SECTORS >= dev->nsectors) break;
+        if (n > 0 && lookup(dev, nb)) break;
+        buf_t *v = grab_victim();
+        if (!v) break;
+        v->dev = dev;
+        v->bno = nb;
+        v->refs = 1;
+        hash_insert(v);
+        run[n] = v;
+        segs[n] = v->data;
+        n++;
+    }
+    if (n == 0) {
+        bcache_lock_drop();
+        return 0;
+    }
+
+    unsigned long lba = bno * BCACHE_BUF_SECTORS;
+    unsigned long count = (unsigned long)n * BCACHE_BUF_SECTORS;
+    if (count > dev->nsectors - lba) count = dev->nsectors - lba;
+
+    stats.xfers++;
+    int err = dev->xfer(dev, 0, lba, (unsigned int)count, segs) < 0;
+
+    // Demand buffer ends up most recent, read-ahead right behind it
+    for (int i = n - 1; i >= 0; i--) {
+        buf_t *v = run[i];
+        lru_unlink(v);
+        if (err) {
+            hash_remove(v);
+            v->dev = 0;
+            v->refs = 0;
+            lru_push_back(v);
+            continue;
+        }
+        v->flags = BUF_VALID;
+        if (i > 0) v->refs = 0;
+        lru_push_front(v);
+    }
+    if (!err) stats.readahead += n - 1;
+    bcache_lock_drop();
+    return err ? 0 : run[0];
+}
+
+void bcache_dirty(buf_t *b) {
+    bcache_lock_take();
+    if (!(b->flags & BUF_DIRTY)) {
+        b->flags |= BUF_DIRTY;
+        ndirty++;
+    }
+    int flush = ndirty > BCACHE_DIRTY_MAX;
+    bcache_lock_drop();
+
+    if (flush) bcache_sync(b->dev);
+}
+
+void bcache_put(buf_t *b) {
+    bcache_lock_take();
+    if (b->refs) b->refs--;
+    bcache_lock_drop();
+}
+
+int bcache_sync(block_dev_t *dev) {
+    int rc = 0;
+    bcache_lock_take();
+    for (int i = 0; i < BCACHE_BUFS; i++) {
+        buf_t *b = &bufs[i];
+        if (!(b->flags & BUF_DIRTY)) continue;
+        if (dev && b->dev != dev) continue;
+        if (write_run(b) < 0) rc = -1;
+    }
+    bcache_lock_drop();
+    return rc;
+}
+
+long block_read(block_dev_t *dev, unsigned long off, void *buf, unsigned long len) {
+    unsigned long size = dev->nsectors * BLOCK_SIZE;
+    if (off >= size) return 0;
+    if (len > size - off) len = size - off;
+
+    unsigned long done = 0;
+    while (done < len) {
+        unsigned long pos = off + done;
+        unsigned long boff = pos % BCACHE_BUF_SIZE;
+        unsigned long n = BCACHE_BUF_SIZE - boff;
+        if (n > len - done) n = len - done;
+
+        char *dst = (char *)buf + done;
+        if (boff == 0 && len - done >= BLOCK_DIRECT_MIN * BCACHE_BUF_SIZE &&
+            ((unsigned long)dst & (BLOCK_DIRECT_ALIGN - 1)) == 0) {
+            long got = read_direct(dev, pos / BCACHE_BUF_SIZE,
+                                   (len - done) / BCACHE_BUF_SIZE, dst);
+            if (got < 0) return -1;
+            if (got > 0) {
+                done += got;
+                continue;
+            }
+        }
+
+        buf_t *b = bcache_get(dev, pos / BCACHE_BUF_SIZE);
+        if (!b) return -1;
+        copy_bytes(dst, b->data + boff, n);
+        bcache_put(b);
+        done += n;
+    }
+    return (long)done;
+}
+
+long block_write(block_dev_t *dev, unsigned long off, const void *buf, unsigned long len) {
+    unsigned long size = dev->nsectors * BLOCK_SIZE;
+    if (off >= size) return 0;
+    if (len > size - off) len = size - off;
+
+    unsigned long done = 0;
+    while (done < len) {
+        unsigned long pos = off + done;
+        unsigned long boff = pos % BCACHE_BUF_SIZE;
+        unsigned long n = BCACHE_BUF_SIZE - boff;
+        if (n > len - done) n = len - done;
+
+        buf_t *b = bcache_get(dev, pos / BCACHE_BUF_SIZE);
+        if (!b) return -1;
+        copy_bytes(b->data + boff, (const char *)buf + done, n);
+        bcache_dirty(b);
+        bcache_put(b);
+        done += n;
+    }
+    return (long)done;
+}
+
+void bcache_stats(bcache_stats_t *st) {
+    bcache_lock_take();
+    st->hits = stats.hits;
+    st->misses = stats.misses;
+    st->readahead = stats.readahead;
+    st->direct = stats.direct;
+    st->writebacks = stats.writebacks;
+    st->xfers = stats.xfers;
+    st->cached = 0;
+    st->dirty = ndirty;
+    for (int i = 0; i < BCACHE_BUFS; i++)
+        if (bufs[i].flags & BUF_VALID)
+            st->cached++;
+    bcache_lock_drop();
+}
@@ -0,0 +1,146 @@
+// crc32c.c - CRC-32C: ARMv8 CRC32 instructions, or slicing-by-8
+//
+// Internally the checksum register runs without the initial and final
+// inversion ("raw"); crc32c() adds them at the edges. In that form both
+// the table step and crc32cx are linear in the register, which is what
+// lets independent streams be combined with a shift operator.
+//
+// table[0] is the usual byte-at-a-time table for the reflected
+// polynomial; table[k][b] is the CRC of byte b followed by k zero bytes,
+// so eight table lookups fold in eight input bytes at once.
+//
+// The hardware path splits each 3 * CRC_BLK bytes into three blocks and
+// runs one crc32cx chain per block, so three instructions are in flight
+// instead of each waiting on the previous result; the chains are then
+// joined with two shifts by CRC_BLK. Three blocks of 1360 bytes cover a
+// 4 KB page but for 16 bytes.
+
+#include "crc32c.h"
+#include "smp.h"
+
+#define CRC32C_POLY     0x82F63B78U     // Reflected 0x1EDC6F41
+#define CRC_BLK         1360            // Bytes per stream per round (multiple of 8)
+
+static unsigned int table[8][256];
+static crc32c_shift_t blk_shift;        // Appends CRC_BLK bytes
+static volatile int ready = 0;
+static int use_hw;
+
+static void build_shift(crc32c_shift_t *op, unsigned long len);
+
+// Racing first callers build identical tables; publish after the data
+static void crc_init(void) {
+    for (unsigned int b = 0; b < 256; b++) {
+        unsigned int c = b;
+        for (int i = 0; i < 8; i++)
+            c = (c >> 1) ^ (CRC32C_POLY & -(c & 1));
+        table[0][b] = c;
+    }
+    for (unsigned int b = 0; b < 256; b++)
+        for (int k = 1; k < 8; k++)
+            table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+
+    unsigned long isar0;
+    asm volatile("mrs %0, id_aa64isar0_el1" : "=r"(isar0));
+    use_hw = ((isar0 >> 16) & 0xF) != 0;            // CRC32 field
+    if (use_hw) build_shift(&blk_shift, CRC_BLK);
+
+    smp_wmb();
+    ready = 1;
+}
+
+static unsigned int crc_sw(unsigned int r, const unsigned char *p, unsigned long len) {
+    while (len && ((unsigned long)p & 7)) {
+        r = (r >> 8) ^ table[0][(r ^ *p++) & 0xFF];
+        len--;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        unsigned long w = *(const unsigned long *)p ^ r;       // Little-endian
+        r = table[7][w & 0xFF] ^ table[6][(w >> 8) & 0xFF] ^
+            table[5][(w >> 16) & 0xFF] ^ table[4][(w >> 24) & 0xFF] ^
+            table[3][(w >> 32) & 0xFF] ^ table[2][(w >> 40) & 0xFF] ^
+            table[1][(w >> 48) & 0xFF] ^ table[0][w >> 56];
+    }
+    while (len--)
+        r = (r >> 8) ^ table[0][(r ^ *p++) & 0xFF];
+    return r;
+}
+
+static inline unsigned int crc_u8(unsigned int r, unsigned char v) {
+    asm("crc32cb %w0, %w0, %w1" : "+r"(r) : "r"(v));
+    return r;
+}
+
+static inline unsigned int crc_u64(unsigned int r, unsigned long v) {
+    asm("crc32cx %w0, %w0, %x1" : "+r"(r) : "r"(v));
+    return r;
+}
+
+static unsigned int shift(const crc32c_shift_t *op, unsigned int r) {
+    return op->t[0][r & 0xFF] ^ op->t[1][(r >> 8) & 0xFF] ^
+           op->t[2][(r >> 16) & 0xFF] ^ op->t[3][r >> 24];
+}
+
+static unsigned int crc_hw(unsigned int r, const unsigned char *p, unsigned long len) {
+    while (len && ((unsigned long)p & 7)) {
+        r = crc_u8(r, *p++);
+        len--;
+    }
+    for (; len >= 3 * CRC_BLK; len -= 3 * CRC_BLK, p += 3 * CRC_BLK) {
+        const unsigned long *a = (const unsigned long *)p;
+        const unsigned long *b = a + CRC_BLK / 8;
+        const unsigned long *c = b + CRC_BLK / 8;
+        unsigned int r1 = 0, r2 = 0;
+        for (int i = 0; i < CRC_BLK / 8; i++) {
+            r = crc_u64(r, a[i]);
+            r1 = crc_u64(r1, b[i]);
+            r2 = crc_u64(r2, c[i]);
+        }
+        r = shift(&blk_shift, shift(&blk_shift, r) ^ r1) ^ r2;
+    }
+    for (; len >= 8; len -= 8, p += 8)
+        r = crc_u64(r, *(const unsigned long *)p);
+    while (len--)
+        r = crc_u8(r, *p++);
+    return r;
+}
+
+unsigned int crc32c(unsigned int crc, const void *buf, unsigned long len) {
+    if (!ready) crc_init();
+    const unsigned char *p = (const unsigned char *)buf;
+    return ~(use_hw ? crc_hw(~crc, p, len) : crc_sw(~crc, p, len));
+}
+
+// The shift is linear: push each register bit through len zero bytes,
+// then tabulate the images of every byte value per lane
+static void build_shift(crc32c_shift_t *op, unsigned long len) {
+    unsigned int col[32];
+    for (int i = 0; i < 32; i++) {
+        unsigned int r = 1U << i;
+        for (unsigned long n = 0; n < len; n++)
+            r = (r >> 8) ^ table[0][r & 0xFF];
+        col[i] = r;
+    }
+    for (int k = 0; k < 4; k++) {
+        for (unsigned int b = 0; b < 256; b++) {
+            unsigned int v = 0;
+            for (int j = 0; j < 8; j++)
+                if (b & (1U << j)) v ^= col[8 * k + j];
+            op->t[k][b] = v;
+        }
+    }
+}
+
+void crc32c_shift_init(crc32c_shift_t *op, unsigned long len) {
+    if (!ready) crc_init();
+    build_shift(op, len);
+}
+
+unsigned int crc32c_combine(const crc32c_shift_t *op, unsigned int crc1, unsigned int crc2) {
+    return shift(op, crc1) ^ crc2;
+}
+
+int crc32c_hw(void) {
+    if (!ready) crc_init();
+    return use_hw;
+}
@@ -0,0 +1,70 @@
+// dma.c - BCM2711 DMA controller (legacy channels)
+//
+// Channels are owned by the drivers that initialize them; this file
+// keeps no state and no lock. Each owner serializes its own channel.
+
+#include "dma.h"
+
+#define DMA_BASE        0xFE007000
+#define DMA_CH_BASE(ch) (DMA_BASE + (unsigned long)(ch) * 0x100)
+
+#define DMA_CS(ch)      ((volatile unsigned int*)(DMA_CH_BASE(ch) + 0x00))
+#define DMA_CONBLK(ch)  ((volatile unsigned int*)(DMA_CH_BASE(ch) + 0x04))
+#define DMA_DEBUG(ch)   ((volatile unsigned int*)(DMA_CH_BASE(ch) + 0x20))
+#define DMA_ENABLE      ((volatile unsigned int*)(DMA_BASE + 0xFF0))
+
+// CS (control and status)
+#define CS_ACTIVE       (1 << 0)
+#define CS_END          (1 << 1)        // Write 1 to clear
+#define CS_INT          (1 << 2)        // Write 1 to clear
+#define CS_ERROR        (1 << 8)
+#define CS_PRIORITY(n)  ((unsigned int)(n) << 16)
+#define CS_PANIC(n)     ((unsigned int)(n) << 20)
+#define CS_WAIT_WRITES  (1 << 28)       // Wait for outstanding writes at the end
+#define CS_RESET        (1U << 31)
+
+#define DEBUG_ERRORS    0x7             // Read, FIFO, read-last-not-set errors
+
+#define CACHE_LINE      64
+
+unsigned int dma_bus_addr(const void *p) {
+    return 0xC0000000U | (unsigned int)(unsigned long)p;
+}
+
+unsigned int dma_periph_addr(unsigned long mmio) {
+    return (unsigned int)(mmio - 0xFE000000UL + 0x7E000000UL);
+}
+
+void dma_clean(const void *p, unsigned long len) {
+    unsigned long a = (unsigned long)p & ~(unsigned long)(CACHE_LINE - 1);
+    for (; a < (unsigned long)p + len; a += CACHE_LINE)
+        asm volatile("dc cvac, %0" :: "r"(a) : "memory");
+    asm volatile("dsb sy" ::: "memory");
+}
+
+void dma_init_channel(unsigned int ch) {
+    *DMA_ENABLE |= 1U << ch;
+    *DMA_CS(ch) = CS_RESET;
+    while (*DMA_CS(ch) & CS_RESET) { }
+    *DMA_DEBUG(ch) = DEBUG_ERRORS;
+    *DMA_CS(ch) = CS_END | CS_INT;
+}
+
+void dma_start(unsigned int ch, dma_cb_t *cb) {
+    dma_clean(cb, sizeof(*cb));
+    *DMA_CONBLK(ch) = dma_bus_addr(cb);
+    *DMA_CS(ch) = CS_WAIT_WRITES | CS_PANIC(15) | CS_PRIORITY(8) |
+                  CS_END | CS_INT | CS_ACTIVE;
+}
+
+int dma_busy(unsigned int ch) {
+    return (*DMA_CS(ch) & CS_ACTIVE) != 0;
+}
+
+int dma_ack(unsigned int ch) {
+    unsigned int cs = *DMA_CS(ch);
+    *DMA_CS(ch) = CS_END | CS_INT;      // ACTIVE written as 0: idle anyway
+    if (!(cs & CS_ERROR)) return 0;
+    *DMA_DEBUG(ch) = DEBUG_ERRORS;
+    return -1;
+}
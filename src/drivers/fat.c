@@ -0,0 +1,410 @@
+// fat.c - FAT32 filesystem driver (read-only)
+//
+// On-disk fields are little-endian and often unaligned, so they're read
+// byte by byte (rd16/rd32) rather than through packed structs.
+//
+// A volume's lock guards its FAT window cache and the mapping of chains
+// into runs. Run lists never change once published (the volume is
+// read-only), so reads look them up without the lock.
+
+#include "fat.h"
+#include "fs.h"
+#include "memory.h"
+#include "uart.h"
+#include "smp.h"
+#include "task.h"
+
+#define FAT_MASK        0x0FFFFFFF      // FAT32 entries are 28 bits
+#define FAT_IO_ERROR    0xFFFFFFFF      // fat_next: FAT unreadable (never a masked entry)
+#define FAT_WIN_ENTRIES (PAGE_SIZE / 4) // FAT entries per cached window
+#define FAT_WINDOWS     16              // Windows cached per volume (direct-mapped)
+#define FAT_MIN_CLUSTERS 65525          // Fewer means FAT12/16
+
+#define DIRENT_SIZE     32
+#define ATTR_VOLUME_ID  0x08
+#define ATTR_DIRECTORY  0x10
+#define ATTR_LFN        0x0F
+#define LFN_LAST        0x40
+#define LFN_CHARS       13              // Name characters per LFN entry
+#define LFN_MAX         (20 * LFN_CHARS)
+
+typedef struct {
+    unsigned int file_clus;             // Index of the run's first cluster in the file
+    unsigned int disk_clus;             // Where it is on disk
+    unsigned int len;                   // Clusters in the run
+} fat_run_t;
+
+typedef struct {
+    block_dev_t *dev;
+    unsigned long fat_off;              // Byte offset of the first FAT
+    unsigned long data_off;             // Byte offset of cluster 2
+    unsigned int cluster_shift;         // log2(bytes per cluster)
+    unsigned int nclusters;             // Valid clusters: 2 .. nclusters + 1
+    spinlock_t lock;
+    unsigned int win_id[FAT_WINDOWS];   // Window held in each slot, + 1 (0 = none)
+    unsigned int *win[FAT_WINDOWS];
+} fat_vol_t;
+
+typedef struct {
+    fs_ext_t ext;                       // Must be first
+    fat_vol_t *vol;
+    unsigned int first;                 // First cluster (0 = empty file)
+    unsigned int nruns;                 // 0 = chain not mapped yet
+    fat_run_t *runs;                    // Sorted by file_clus
+} fat_node_t;
+
+static int fat_populate(fs_node_t *dir);
+static long fat_read(fs_node_t *file, unsigned long off, void *buf, unsigned long len);
+
+static const fs_ops_t fat_ops = {
+    .populate = fat_populate,
+    .read = fat_read,
+};
+
+// ---- Helpers ----
+
+static unsigned int rd16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int rd32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static int valid_cluster(fat_vol_t *vol, unsigned int c) {
+    return c >= 2 && c < vol->nclusters + 2;
+}
+
+static fat_node_t *node_new(fat_vol_t *vol, unsigned int first) {
+    fat_node_t *fn = (fat_node_t *)kmalloc(sizeof(fat_node_t));
+    if (!fn) return 0;
+    fn->ext.ops = &fat_ops;
+    fn->vol = vol;
+    fn->first = first;
+    fn->nruns = 0;
+    fn->runs = 0;
+    return fn;
+}
+
+// ---- FAT ----
+
+// Next cluster in a chain, or FAT_IO_ERROR if the FAT can't be read
+// (the window is left uncached, so a later call retries the read).
+// Caller holds vol->lock.
+static unsigned int fat_next(fat_vol_t *vol, unsigned int c) {
+    unsigned int w = c / FAT_WIN_ENTRIES;
+    unsigned int slot = w % FAT_WINDOWS;
+    if (vol->win_id[slot] != w + 1) {
+        unsigned long off = vol->fat_off + (unsigned long)w * PAGE_SIZE;
+        vol->win_id[slot] = 0;              // A failed read may clobber it
+        if (block_read(vol->dev, off, vol->win[slot], PAGE_SIZE) <= 0) return FAT_IO_ERROR;
+        vol->win_id[slot] = w + 1;
+    }
+    return vol->win[slot][c % FAT_WIN_ENTRIES] & FAT_MASK;
+}
+
+// Walk fn's chain once and record it as runs of contiguous clusters.
+// A FAT read error fails the walk without recording anything, so the
+// next read maps the chain again instead of seeing it cut short.
+// Caller holds vol->lock.
+static int map_chain(fat_node_t *fn) {
+    fat_vol_t *vol = fn->vol;
+    unsigned int cap = 4, n = 0, idx = 0;
+    fat_run_t *runs = (fat_run_t *)kmalloc(cap * sizeof(fat_run_t));
+    if (!runs) return -1;
+
+    unsigned int c;
+    for (c = fn->first; valid_cluster(vol, c); c = fat_next(vol, c)) {
+        if (idx > vol->nclusters) break;        // Loop in a corrupt chain
+        if (n && runs[n - 1].disk_clus + runs[n - 1].len == c) {
+            runs[n - 1].len++;
+        } else {
+            if (n == cap) {
+                fat_run_t *bigger = (fat_run_t *)kmalloc(2 * cap * sizeof(fat_run_t));
+                if (!bigger) {
+                    kfree(runs);
+                    return -1;
+                }
+                for (unsigned int i = 0; i < n; i++) bigger[i] = runs[i];
+                kfree(runs);
+                runs = bigger;
+                cap *= 2;
+            }
+            runs[n].file_clus = idx;
+            runs[n].disk_clus = c;
+            runs[n].len = 1;
+            n++;
+        }
+        idx++;
+    }
+    if (n == 0 || c == FAT_IO_ERROR) {
+        kfree(runs);
+        return -1;
+    }
+
+    fn->runs = runs;
+    smp_wmb();                  // Runs visible before readers see nruns
+    fn->nruns = n;
+    return 0;
+}
+
+static int chain_mapped(fat_node_t *fn) {
+    if (fn->nruns) {
+        smp_rmb();
+        return 0;
+    }
+    task_lock_hold();                           // Workers take it too
+    spin_lock(&fn->vol->lock);
+    int rc = fn->nruns ? 0 : map_chain(fn);
+    spin_unlock(&fn->vol->lock);
+    task_lock_drop();
+    return rc;
+}
+
+static fat_run_t *find_run(fat_node_t *fn, unsigned int ci) {
+    unsigned int lo = 0, hi = fn->nruns;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        fat_run_t *r = &fn->runs[mid];
+        if (ci < r->file_clus) hi = mid;
+        else if (ci >= r->file_clus + r->len) lo = mid + 1;
+        else return r;
+    }
+    return 0;
+}
+
+// Read bytes [off, off + len) of a mapped chain. Each contiguous run is
+// one block_read, so long runs become multi-cluster device requests.
+static long chain_read(fat_node_t *fn, unsigned long off, void *buf, unsigned long len) {
+    fat_vol_t *vol = fn->vol;
+    unsigned int shift = vol->cluster_shift;
+    unsigned long done = 0;
+
+    while (done < len) {
+        unsigned long pos = off + done;
+        fat_run_t *r = find_run(fn, (unsigned int)(pos >> shift));
+        if (!r) break;                          // Past the end of the chain
+
+        unsigned long in_run = pos - ((unsigned long)r->file_clus << shift);
+        unsigned long n = ((unsigned long)r->len << shift) - in_run;
+        if (n > len - done) n = len - done;
+
+        unsigned long disk = vol->data_off +
+                             ((unsigned long)(r->disk_clus - 2) << shift) + in_run;
+        long got = block_read(vol->dev, disk, (char *)buf + done, n);
+        if (got <= 0) return done ? (long)done : -1;
+        done += got;
+    }
+    return (long)done;
+}
+
+// ---- fs hooks ----
+
+static long fat_read(fs_node_t *file, unsigned long off, void *buf, unsigned long len) {
+    fat_node_t *fn = (fat_node_t *)file->ext;
+    if (chain_mapped(fn) < 0) return -1;
+    return chain_read(fn, off, buf, len);
+}
+
+static unsigned char lfn_checksum(const unsigned char *short_name) {
+    unsigned char sum = 0;
+    for (int i = 0; i < 11; i++)
+        sum = (unsigned char)(((sum & 1) << 7) + (sum >> 1) + short_name[i]);
+    return sum;
+}
+
+// "NAME    EXT" -> "name.ext", honoring the NT lowercase bits
+static void short_name(const unsigned char *d, char *out) {
+    int lower_base = d[12] & 0x08, lower_ext = d[12] & 0x10;
+    int n = 0;
+    for (int i = 0; i < 8 && d[i] != ' '; i++) {
+        unsigned char c = (i == 0 && d[0] == 0x05) ? 0xE5 : d[i];
+        if (lower_base && c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        out[n++] = c < 0x80 ? (char)c : '?';
+    }
+    if (d[8] != ' ') {
+        out[n++] = '.';
+        for (int i = 8; i < 11 && d[i] != ' '; i++) {
+            unsigned char c = d[i];
+            if (lower_ext && c >= 'A' && c <= 'Z') c += 'a' - 'A';
+            out[n++] = c < 0x80 ? (char)c : '?';
+        }
+    }
+    out[n] = '\0';
+}
+
+// Store one LFN entry's 13 UCS-2 characters (non-ASCII become '?')
+static void lfn_collect(const unsigned char *d, char *lfn) {
+    static const unsigned char offs[LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    int base = ((d[0] & 0x1F) - 1) * LFN_CHARS;
+    for (int k = 0; k < LFN_CHARS; k++) {
+        unsigned int c = rd16(d + offs[k]);
+        if (c == 0 || c == 0xFFFF) c = 0;
+        else if (c >= 0x80) c = '?';
+        lfn[base + k] = (char)c;
+    }
+}
+
+static int fat_populate(fs_node_t *dir) {
+    fat_node_t *fn = (fat_node_t *)dir->ext;
+    fat_vol_t *vol = fn->vol;
+    if (chain_mapped(fn) < 0) return -1;
+
+    unsigned char *page = (unsigned char *)page_alloc();
+    if (!page) return -1;
+
+    char lfn[LFN_MAX + 1];
+    int lfn_next = 0;                   // Next LFN sequence number expected (0 = none)
+    unsigned char lfn_sum = 0;
+    char name[FS_NAME_MAX];
+    int rc = 0;
+
+    fat_run_t *last = &fn->runs[fn->nruns - 1];
+    unsigned long size = (unsigned long)(last->file_clus + last->len) << vol->cluster_shift;
+
+    for (unsigned long off = 0; off < size; off += PAGE_SIZE) {
+        long n = chain_read(fn, off, page, PAGE_SIZE);
+        if (n <= 0) {
+            rc = -1;
+            break;
+        }
+        for (long e = 0; e < n; e += DIRENT_SIZE) {
+            unsigned char *d = page + e;
+            if (d[0] == 0x00) goto done;        // End of directory
+            if (d[0] == 0xE5) {                 // Deleted
+                lfn_next = 0;
+                continue;
+            }
+            if (d[11] == ATTR_LFN) {
+                int seq = d[0] & 0x1F;
+                if (d[0] & LFN_LAST) {
+                    for (int i = 0; i <= LFN_MAX; i++) lfn[i] = 0;
+                    lfn_next = seq;
+                    lfn_sum = d[13];
+                }
+                if (seq == 0 || seq * LFN_CHARS > LFN_MAX ||
+                    seq != lfn_next || d[13] != lfn_sum) {
+                    lfn_next = 0;
+                    continue;
+                }
+                lfn_collect(d, lfn);
+                lfn_next--;
+                if (lfn_next == 0) lfn_next = -1;   // Complete, short entry next
+                continue;
+            }
+            if (d[11] & ATTR_VOLUME_ID) {
+                lfn_next = 0;
+                continue;
+            }
+
+            int n_lfn = 0;
+            if (lfn_next == -1 && lfn_checksum(d) == lfn_sum)
+                while (lfn[n_lfn]) n_lfn++;
+            if (n_lfn > 0 && n_lfn < FS_NAME_MAX) {
+                for (int i = 0; i <= n_lfn; i++) name[i] = lfn[i];
+            } else {
+                short_name(d, name);
+            }
+            lfn_next = 0;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            unsigned int first = (rd16(d + 20) << 16) | rd16(d + 26);
+            int is_dir = d[11] & ATTR_DIRECTORY;
+            fat_node_t *child = node_new(vol, first);
+            if (!child) {
+                rc = -1;
+                goto done;
+            }
+            fs_node_t *node = fs_ext_add(dir, name, is_dir ? FS_DIR : FS_FILE,
+                                         is_dir ? 0 : rd32(d + 28), &child->ext);
+            if (!node || node->ext != &child->ext) kfree(child);   // Failed, or added by an earlier try
+            if (!node) {
+                rc = -1;
+                goto done;
+            }
+        }
+    }
+done:
+    page_free(page);
+    return rc;
+}
+
+// ---- Mount ----
+
+int fat_mount(block_dev_t *dev, const char *path) {
+    unsigned char *sec = (unsigned char *)page_alloc();
+    if (!sec) return -1;
+
+    // Sector 0 is either the boot sector itself or an MBR
+    unsigned long part = 0;
+    if (block_read(dev, 0, sec, BLOCK_SIZE) != BLOCK_SIZE) goto io_error;
+    int is_boot = sec[82] == 'F' && sec[83] == 'A' && sec[84] == 'T' &&
+                  sec[85] == '3' && sec[86] == '2';
+    if (!is_boot && sec[510] == 0x55 && sec[511] == 0xAA) {
+        for (int i = 0; i < 4; i++) {
+            const unsigned char *pe = sec + 446 + 16 * i;
+            if (pe[4] == 0x0B || pe[4] == 0x0C) {   // FAT32 (CHS / LBA)
+                part = rd32(pe + 8);
+                break;
+            }
+        }
+        if (!part) {
+            uart_puts("mount: no FAT32 partition\n");
+            page_free(sec);
+            return -1;
+        }
+        if (block_read(dev, part * BLOCK_SIZE, sec, BLOCK_SIZE) != BLOCK_SIZE)
+            goto io_error;
+    }
+
+    // BIOS parameter block
+    unsigned int bytes_per_sec = rd16(sec + 11);
+    unsigned int sec_per_clus = sec[13];
+    unsigned int reserved = rd16(sec + 14);
+    unsigned int nfats = sec[16];
+    unsigned int root_entries = rd16(sec + 17);
+    unsigned long total = rd16(sec + 19) ? rd16(sec + 19) : rd32(sec + 32);
+    unsigned long fat_size = rd32(sec + 36);
+    unsigned int root_clus = rd32(sec + 44);
+
+    unsigned int shift = 0;
+    while (shift < 8 && (1u << shift) != sec_per_clus) shift++;
+    unsigned long data_sec = reserved + nfats * fat_size;
+    if (bytes_per_sec != BLOCK_SIZE || shift == 8 || !nfats || !fat_size ||
+        root_entries != 0 || total <= data_sec ||
+        (total - data_sec) / sec_per_clus < FAT_MIN_CLUSTERS) {
+        uart_puts("mount: not a FAT32 volume\n");
+        page_free(sec);
+        return -1;
+    }
+    page_free(sec);
+
+    fat_vol_t *vol = (fat_vol_t *)kmalloc(sizeof(fat_vol_t));
+    if (!vol) return -1;
+    vol->dev = dev;
+    vol->fat_off = (part + reserved) * BLOCK_SIZE;
+    vol->data_off = (part + data_sec) * BLOCK_SIZE;
+    vol->cluster_shift = shift + 9;
+    vol->nclusters = (unsigned int)((total - data_sec) / sec_per_clus);
+    vol->lock = (spinlock_t)SPINLOCK_INIT;
+    int i;
+    for (i = 0; i < FAT_WINDOWS; i++) {
+        vol->win_id[i] = 0;
+        if (!(vol->win[i] = (unsigned int *)page_alloc())) break;
+    }
+
+    fat_node_t *root = i == FAT_WINDOWS ? node_new(vol, root_clus) : 0;
+    if (!root || fs_mount(path, &root->ext) < 0) {
+        if (root) kfree(root);
+        while (i-- > 0) page_free(vol->win[i]);
+        kfree(vol);
+        return -1;
+    }
+    return 0;
+
+io_error:
+    uart_puts("mount: read error\n");
+    page_free(sec);
+    return -1;
+}
@@ -0,0 +1,238 @@
+// fd.c - Per-task file descriptors over the ramfs
+//
+// Open file objects come from a fixed pool; a task's descriptor table
+// holds pointers into it. The pool and the tables are guarded by
+// file_lock with IRQs masked, so a task is never preempted (or killed)
+// while holding it. The I/O itself runs unlocked on the resolved node.
+
+#include "fd.h"
+#include "smp.h"
+#include "pipe.h"
+
+static file_t file_pool[FD_MAX_OPEN];
+static spinlock_t file_lock = SPINLOCK_INIT;
+
+// ---- Helpers ----
+
+// Look up fd in the current task's table
+static file_t *fd_get(int fd) {
+    task_t *task = get_current_task();
+    if (!task || fd < 0 || fd >= TASK_MAX_FILES) return 0;
+    return task->files[fd];
+}
+
+// Install node in a free descriptor of task (caller holds file_lock).
+// The file object takes over the caller's node reference. node may be 0
+// to reserve the descriptor and fill it in later.
+static int fd_install(task_t *task, fs_node_t *node, int flags) {
+    int fd = -1;
+    for (int i = 0; i < TASK_MAX_FILES; i++) {
+        if (!task->files[i]) { fd = i; break; }
+    }
+    if (fd < 0) return -1;
+
+    file_t *f = 0;
+    for (int i = 0; i < FD_MAX_OPEN; i++) {
+        if (file_pool[i].refs == 0) { f = &file_pool[i]; break; }
+    }
+    if (!f) return -1;
+
+    f->node = node;
+    f->offset = 0;
+    f->flags = flags;
+    f->refs = 1;
+    task->files[fd] = f;
+    return fd;
+}
+
+static int is_writer(const file_t *f) {
+    return (f->flags & O_ACCMODE) == O_WRONLY;
+}
+
+// Drop one reference (caller holds file_lock)
+static void file_put(file_t *f) {
+    if (f->refs > 0 && --f->refs == 0 && f->node) {
+        if (f->node->type == FS_FIFO)
+            pipe_close(f->node->pipe, is_writer(f));
+        fs_node_put(f->node);
+        f->node = 0;
+    }
+}
+
+// ---- Public API ----
+
+int fd_open(const char *path, int flags) {
+    task_t *task = get_current_task();
+    if (!task) return -1;
+
+    // Claim the descriptor first, so a full table fails the open
+    // before O_CREAT has made a file
+    unsigned long irq = spin_lock_irqsave(&file_lock);
+    int fd = fd_install(task, 0, flags);
+    spin_unlock_irqrestore(&file_lock, irq);
+    if (fd < 0) return FD_EMFILE;
+
+    // Pin the node so an rm from another task can't free it
+    fs_node_t *node = (flags & O_CREAT) ? fs_create_get(path) : fs_resolve_get(path);
+    int mode = flags & O_ACCMODE;
+    int bad = !node;
+    if (node && (node->type == FS_DIR || (node->flags & FS_NODE_XIP)) &&
+        (mode != O_RDONLY || (flags & O_TRUNC)))
+        bad = 1;
+    if (node && node->type == FS_FIFO && mode == O_RDWR)
+        bad = 1;                // A FIFO end is either read or write
+    if (node && node->type == FS_DIR && (flags & O_CREAT))
+        bad = 1;                // Creating opens want a file
+
+    irq = spin_lock_irqsave(&file_lock);
+    file_t *f = task->files[fd];
+    unsigned int token = 0;
+    if (bad) {
+        task->files[fd] = 0;
+        file_put(f);
+    } else {
+        f->node = node;
+        // Attach the pipe end together with the node, so a kill
+        // between the two can't unbalance the pipe's reader/writer counts
+        if (node->type == FS_FIFO)
+            token = pipe_open(node->pipe, mode == O_WRONLY);
+    }
+    spin_unlock_irqrestore(&file_lock, irq);
+
+    if (bad) {
+        if (node) fs_node_put(node);
+        return -1;
+    }
+
+    if (node->type == FS_FIFO)
+        pipe_wait_peer(node->pipe, mode == O_WRONLY, token);
+    else if ((flags & O_TRUNC) && node->type == FS_FILE)
+        fs_node_truncate(node, 0);
+    return fd;
+}
+
+int fd_pipe(int fds[2]) {
+    task_t *task = get_current_task();
+    if (!task) return -1;
+
+    fs_node_t *node = fs_pipe_create();
+    if (!node) return -1;
+    fs_node_get(node);          // One reference per end
+
+    unsigned long irq = spin_lock_irqsave(&file_lock);
+    int rfd = fd_install(task, node, O_RDONLY);
+    int wfd = rfd >= 0 ? fd_install(task, node, O_WRONLY) : -1;
+    if (wfd < 0) {
+        if (rfd >= 0) {
+            task->files[rfd]->refs = 0;
+            task->files[rfd] = 0;
+        }
+        spin_unlock_irqrestore(&file_lock, irq);
+        fs_node_put(node);
+        fs_node_put(node);
+        return -1;
+    }
+    pipe_open(node->pipe, 0);
+    pipe_open(node->pipe, 1);
+    spin_unlock_irqrestore(&file_lock, irq);
+
+    fds[0] = rfd;
+    fds[1] = wfd;
+    return 0;
+}
+
+long fd_read(int fd, void *buf, unsigned long len) {
+    file_t *f = fd_get(fd);
+    if (!f || (f->flags & O_ACCMODE) == O_WRONLY) return -1;
+    if (f->node->type == FS_FIFO) return pipe_read(f->node->pipe, buf, len);
+    if (f->node->type != FS_FILE) return -1;
+
+    long n = fs_node_pread(f->node, f->offset, buf, len);
+    if (n > 0) f->offset += n;
+    return n;
+}
+
+long fd_write(int fd, const void *buf, unsigned long len) {
+    file_t *f = fd_get(fd);
+    if (!f || (f->flags & O_ACCMODE) == O_RDONLY) return -1;
+    if (f->node->type == FS_FIFO) return pipe_write(f->node->pipe, buf, len);
+
+    if (f->flags & O_APPEND) {
+        // The end is found under the file lock, so appends never overlap
+        long n = fs_node_append(f->node, buf, len);
+        f->offset = f->node->size;
+        return n;
+    }
+    long n = fs_node_pwrite(f->node, f->offset, buf, len);
+    if (n > 0) f->offset += n;
+    return n;
+}
+
+long fd_lseek(int fd, long offset, int whence) {
+    file_t *f = fd_get(fd);
+    if (!f || f->node->type == FS_FIFO) return -1;   // Pipes don't seek
+
+    long base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = (long)f->offset; break;
+        case SEEK_END: base = (long)f->node->size; break;
+        default:       return -1;
+    }
+    if (base + offset < 0) return -1;
+    f->offset = (unsigned long)(base + offset);
+    return (long)f->offset;
+}
+
+int fd_close(int fd) {
+    task_t *task = get_current_task();
+    if (!task || fd < 0 || fd >= TASK_MAX_FILES) return -1;
+
+    // Flush while unlocked: packing takes the node's lock
+    file_t *f = task->files[fd];
+    if (f && (f->flags & O_ACCMODE) != O_RDONLY)
+        fs_node_flush(f->node);
+
+    unsigned long irq = spin_lock_irqsave(&file_lock);
+    f = task->files[fd];
+    if (f) {
+        task->files[fd] = 0;
+        file_put(f);
+    }
+    spin_unlock_irqrestore(&file_lock, irq);
+    return f ? 0 : -1;
+}
+
+void fd_close_all(task_t *task) {
+    unsigned long irq = spin_lock_irqsave(&file_lock);
+    for (int i = 0; i < TASK_MAX_FILES; i++) {
+        if (task->files[i]) {
+            file_put(task->files[i]);
+            task->files[i] = 0;
+        }
+    }
+    spin_unlock_irqrestore(&file_lock, irq);
+}
+
+void fd_inherit(task_t *child, task_t *parent) {
+    unsigned long irq = spin_lock_irqsave(&file_lock);
+    for (int i = 0; i < TASK_MAX_FILES; i++) {
+        file_t *f = parent ? parent->files[i] : 0;
+        if (f && !f->node) f = 0;   // Reserved by an open still in progress
+        if (f) f->refs++;
+        child->files[i] = f;
+    }
+    spin_unlock_irqrestore(&file_lock, irq);
+}
+
+fs_node_t *fd_node_get(int fd, int *flags) {
+    unsigned long irq = spin_lock_irqsave(&file_lock);
+    file_t *f = fd_get(fd);
+    fs_node_t *node = f ? f->node : 0;
+    if (node) {
+        fs_node_get(node);
+        *flags = f->flags;
+    }
+    spin_unlock_irqrestore(&file_lock, irq);
+    return node;
+}
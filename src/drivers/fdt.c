@@ -0,0 +1,101 @@
+// fdt.c - Flattened device tree lookups
+//
+// Walks the structure block token by token: the header gives the
+// offsets of the structure and strings blocks, nodes nest between
+// BEGIN_NODE/END_NODE, and property names are offsets into the strings
+// block. Everything is big-endian and padded to 4 bytes.
+
+#include "fdt.h"
+
+#define FDT_MAGIC       0xD00DFEEDU
+#define FDT_BEGIN_NODE  1
+#define FDT_END_NODE    2
+#define FDT_PROP        3
+#define FDT_NOP         4
+#define FDT_END         9
+
+static unsigned int be32(const void *p) {
+    const unsigned char *b = (const unsigned char *)p;
+    return ((unsigned int)b[0] << 24) | ((unsigned int)b[1] << 16) |
+           ((unsigned int)b[2] << 8) | b[3];
+}
+
+static unsigned long align4(unsigned long x) {
+    return (x + 3) & ~3UL;
+}
+
+static int name_is(const char *a, const char *b) {
+    while (*a && *a == *b) { a++; b++; }
+    return *a == *b;
+}
+
+// Property cells are 32 or 64 bits wide
+unsigned long fdt_cell(const void *val, unsigned int len) {
+    const unsigned char *v = (const unsigned char *)val;
+    if (len == 8) return ((unsigned long)be32(v) << 32) | be32(v + 4);
+    return be32(v);
+}
+
+const void *fdt_chosen(unsigned long dtb, const char *name, unsigned int *len) {
+    if (!dtb || (dtb & 3) || be32((const void *)dtb) != FDT_MAGIC) return 0;
+
+    const unsigned char *fdt = (const unsigned char *)dtb;
+    const unsigned char *p = fdt + be32(fdt + 8);       // off_dt_struct
+    const char *strings = (const char *)fdt + be32(fdt + 12);
+    const unsigned char *end = fdt + be32(fdt + 4);     // totalsize
+
+    int depth = 0, in_chosen = 0;
+
+    while (p + 4 <= end) {
+        unsigned int tok = be32(p);
+        p += 4;
+        if (tok == FDT_BEGIN_NODE) {
+            const char *node = (const char *)p;
+            depth++;
+            if (depth == 2 && name_is(node, "chosen")) in_chosen = 1;
+            int n = 0;
+            while (node[n]) n++;
+            p += align4((unsigned long)n + 1);
+        } else if (tok == FDT_END_NODE) {
+            if (depth == 2 && in_chosen) break;
+            depth--;
+        } else if (tok == FDT_PROP) {
+            unsigned int plen = be32(p);
+            const char *pname = strings + be32(p + 4);
+            const unsigned char *val = p + 8;
+            if (in_chosen && depth == 2 && name_is(pname, name)) {
+                if (len) *len = plen;
+                return val;
+            }
+            p = val + align4(plen);
+        } else if (tok == FDT_NOP) {
+            continue;
+        } else {
+            break;  // FDT_END or garbage
+        }
+    }
+    return 0;
+}
+
+unsigned long fdt_bootarg_num(unsigned long dtb, const char *key) {
+    unsigned int len;
+    const char *args = (const char *)fdt_chosen(dtb, "bootargs", &len);
+    if (!args) return 0;
+
+    const char *end = args + len;
+    const char *p = args;
+    while (p < end && *p) {
+        // Match "key=" at the start of a word
+        const char *k = key;
+        while (*k && p < end && *p == *k) { p++; k++; }
+        if (!*k && p < end && *p == '=') {
+            unsigned long v = 0;
+            for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+                v = v * 10 + (unsigned long)(*p - '0');
+            return v;
+        }
+        while (p < end && *p && *p != ' ') p++;
+        while (p < end && *p == ' ') p++;
+    }
+    return 0;
+}
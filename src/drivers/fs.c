@@ -1,20 +1,59 @@
 // fs.c - In-memory filesystem (ramfs)
 //
-// Tree structure: each directory has a linked list of children.
-// File content is stored via kmalloc'd buffers.
-// Nodes are allocated from a static pool (no fragmentation).
+// Tree structure: each directory has a linked list of children, plus a
+// hash table over the same children for O(1) lookup by name.
+// A global dentry cache keyed by (parent, name) sits in front of the
+// per-directory tables and also remembers names that don't exist.
+// File content is stored inside the node when it is tiny, otherwise in
+// page-sized chunks behind a two-level index, or for XIP files read in
+// place from the kernel image / initrd.
+//
+// Locking (outer to inner): parent dir lock -> child node lock ->
+// pool_lock -> allocator. Only one directory is locked during a walk,
+// so parallel lookups never block each other; dentry cache hits are
+// lock-free (per-slot sequence counts). Node memory is type-stable:
+// slabs are never returned, and a node's lock word survives reuse.
+// Nodes come from page-backed slabs and are recycled through a free
+// list, so create/delete cycles never exhaust the pool.
+//
+// Mounted directories (FS_NODE_EXT) are filled in by their filesystem's
+// populate hook the first time anything looks inside them.
 
 #include "fs.h"
 #include "uart.h"
+#include "klog.h"
 #include "memory.h"
+#include "task.h"
+#include "lz4.h"
+#include "pipe.h"
+#include "crc32c.h"
 
 // ---- Node pool ----
 
-static fs_node_t node_pool[FS_MAX_NODES];
-static int nodes_used = 0;
+#define NODES_PER_SLAB  (PAGE_SIZE / sizeof(fs_node_t))
+
+// Internal flag: node is being freed (set under pool_lock, once)
+#define FS_NODE_FREEING 0x80000000U
+
+static fs_node_t *node_free = 0;        // Free list, linked via hash_next
+static unsigned long nodes_used = 0;    // Live nodes
+static unsigned long nodes_total = 0;   // Live + free (slab capacity)
+static spinlock_t pool_lock = SPINLOCK_INIT;
 
 static fs_node_t *root = 0;
-static fs_node_t *cwd = 0;
+
+// ---- Locks ----
+//
+// Every fs lock is taken through these, so a task holding one is never
+// killed on the spot (see task_lock_hold): the aio workers on the other
+// cores would spin on it forever.
+
+static void fs_spin_lock(spinlock_t *lk)    { task_lock_hold(); spin_lock(lk); }
+static void fs_spin_unlock(spinlock_t *lk)  { spin_unlock(lk); task_lock_drop(); }
+static void fs_read_lock(rwlock_t *rw)      { task_lock_hold(); read_lock(rw); }
+static void fs_read_unlock(rwlock_t *rw)    { read_unlock(rw); task_lock_drop(); }
+static void fs_write_lock(rwlock_t *rw)     { task_lock_hold(); write_lock(rw); }
+static void fs_write_unlock(rwlock_t *rw)   { write_unlock(rw); task_lock_drop(); }
 
 // ---- String helpers ----
 
@@ -39,74 +78,1095 @@ static void fs_strncpy(char *dst, const char *src, int n) {
     *dst = '\0';
 }
 
+// FNV-1a over the (already truncated) name
+static unsigned int fs_hash(const char *s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
 // ---- Allocate a new node ----
 
-static fs_node_t *alloc_node(const char *name, fs_node_type_t type) {
-    if (nodes_used >= FS_MAX_NODES) {
-        uart_puts("[fs] ERROR: node pool full\n");
-        return 0;
+// Carve a fresh page into nodes and push them on the free list.
+// Slab pages are never returned; freed nodes are reused instead.
+// Caller holds pool_lock.
+static int node_pool_grow(void) {
+    fs_node_t *slab = (fs_node_t *)page_alloc();
+    if (!slab) return -1;
+    for (unsigned long i = 0; i < NODES_PER_SLAB; i++) {
+        slab[i].lock.cnt = 0;
+        slab[i].gen = 0;    // Kept across reuse so stale cursors never match
+        slab[i].hash_next = node_free;
+        node_free = &slab[i];
     }
+    nodes_total += NODES_PER_SLAB;
+    return 0;
+}
 
-    fs_node_t *node = &node_pool[nodes_used++];
+// Fill in a node fresh off the free list
+static void node_init(fs_node_t *node, const char *name, fs_node_type_t type) {
     fs_strncpy(node->name, name, FS_NAME_MAX - 1);
+    node->hash = fs_hash(node->name);
     node->type = type;
+    node->flags = 0;
     node->parent = 0;
-    node->children = 0;
     node->next_sibling = 0;
-    node->data = 0;
+    node->hash_next = 0;
+    node->ext = 0;
+    for (int i = 0; i < FS_INLINE_MAX; i++)   // Dir/file/inline union
+        node->idata[i] = 0;
     node->size = 0;
+    node->stored = 0;
+    node->refs = 0;
+    node->maps = 0;
+    node->wmaps = 0;
+}
 
+static fs_node_t *alloc_node(const char *name, fs_node_type_t type) {
+    fs_spin_lock(&pool_lock);
+    if (nodes_used >= FS_MAX_NODES || (!node_free && node_pool_grow() < 0)) {
+        fs_spin_unlock(&pool_lock);
+        klog("[fs] ERROR: node pool full");
+        return 0;
+    }
+
+    fs_node_t *node = node_free;
+    node_free = node->hash_next;
+    nodes_used++;
+    fs_spin_unlock(&pool_lock);
+
+    node_init(node, name, type);
     return node;
 }
 
-// Free a node (mark slot reusable — simple version just leaks)
-// For a bare-metal OS with 64 slots this is fine
+// Take n nodes (n > 0) in one go, growing the pool up front: a bulk load
+// pays for the pool lock once instead of per node. Returns them linked
+// through hash_next (uninitialized), or 0 if the pool can't hold them.
+static fs_node_t *alloc_nodes(unsigned long n) {
+    fs_spin_lock(&pool_lock);
+    if (nodes_used + n > FS_MAX_NODES) {
+        fs_spin_unlock(&pool_lock);
+        return 0;
+    }
+    while (nodes_total - nodes_used < n) {
+        if (node_pool_grow() < 0) {
+            fs_spin_unlock(&pool_lock);
+            return 0;
+        }
+    }
+
+    fs_node_t *head = node_free, *tail = head;
+    for (unsigned long i = 1; i < n; i++)
+        tail = tail->hash_next;
+    node_free = tail->hash_next;
+    tail->hash_next = 0;
+    nodes_used += n;
+    fs_spin_unlock(&pool_lock);
+    return head;
+}
+
+// Give back the unused rest of an alloc_nodes() list
+static void free_nodes(fs_node_t *list) {
+    fs_spin_lock(&pool_lock);
+    while (list) {
+        fs_node_t *next = list->hash_next;
+        list->hash_next = node_free;
+        node_free = list;
+        nodes_used--;
+        list = next;
+    }
+    fs_spin_unlock(&pool_lock);
+}
+
+static void file_free_chunks(fs_node_t *file, unsigned long first);
+
+// Release a node's storage and return it to the free list
 static void free_node(fs_node_t *node) {
-    if (node->data) {
-        kfree(node->data);
-        node->data = 0;
+    if (node->type == FS_FILE)
+        file_free_chunks(node, 0);
+    else if (node->type == FS_FIFO) {
+        if (node->pipe) pipe_destroy(node->pipe);
+    }
+    else if (node->htab) {
+        kfree(node->htab);
+        node->htab = 0;
     }
     node->size = 0;
     node->name[0] = '\0';
-    // Note: we don't reclaim pool slots — kept simple
+
+    fs_spin_lock(&pool_lock);
+    node->hash_next = node_free;
+    node_free = node;
+    nodes_used--;
+    fs_spin_unlock(&pool_lock);
+}
+
+// ---- Directory hash table ----
+
+// Rebuild dir's hash table with nbuckets buckets (power of two).
+// On allocation failure the old table is kept — lookups stay correct,
+// chains just get longer.
+static void htab_resize(fs_node_t *dir, unsigned int nbuckets) {
+    fs_node_t **tab = (fs_node_t **)kmalloc(nbuckets * sizeof(fs_node_t *));
+    if (!tab) return;
+    for (unsigned int i = 0; i < nbuckets; i++)
+        tab[i] = 0;
+
+    for (fs_node_t *c = dir->children; c; c = c->next_sibling) {
+        unsigned int b = c->hash & (nbuckets - 1);
+        c->hash_next = tab[b];
+        tab[b] = c;
+    }
+
+    if (dir->htab) kfree(dir->htab);
+    dir->htab = tab;
+    dir->htab_size = nbuckets;
 }
 
-// ---- Add child to directory ----
+static void htab_insert(fs_node_t *dir, fs_node_t *child) {
+    // Keep load factor <= 1; a resize rehashes every child, including
+    // this one (already on the sibling list)
+    if (dir->nchildren > dir->htab_size) {
+        unsigned int old = dir->htab_size;
+        htab_resize(dir, old ? old * 2 : FS_HTAB_MIN);
+        if (dir->htab_size != old) return;
+    }
+    if (!dir->htab) return;
+
+    unsigned int b = child->hash & (dir->htab_size - 1);
+    child->hash_next = dir->htab[b];
+    dir->htab[b] = child;
+}
+
+static void htab_remove(fs_node_t *dir, fs_node_t *child) {
+    if (!dir->htab) return;
+    fs_node_t **pp = &dir->htab[child->hash & (dir->htab_size - 1)];
+    while (*pp) {
+        if (*pp == child) {
+            *pp = child->hash_next;
+            child->hash_next = 0;
+            return;
+        }
+        pp = &(*pp)->hash_next;
+    }
+}
+
+// ---- Dentry cache ----
+//
+// Direct-mapped cache of (parent, name) -> node. node == 0 is a negative
+// entry: the name is known not to exist in parent. Entries are updated
+// when a child is added and dropped when one is removed, so a hit is
+// always authoritative.
+//
+// Readers are lock-free: each slot has a sequence count that writers
+// make odd while updating, and a reader retries (falls back to the
+// directory) if it changed. Writers serialize on a lock stripe.
+
+#define DCACHE_SIZE     256     // Slots (power of two)
+#define DCACHE_STRIPES  16
+
+typedef struct {
+    volatile unsigned int seq;  // Odd while being written
+    fs_node_t *parent;          // 0 = empty slot
+    fs_node_t *node;            // 0 = negative entry
+    unsigned int hash;
+    char name[FS_NAME_MAX];
+} dcache_entry_t;
+
+static dcache_entry_t dcache[DCACHE_SIZE];
+static spinlock_t dcache_locks[DCACHE_STRIPES];
+
+static unsigned int dcache_index(fs_node_t *parent, unsigned int hash) {
+    unsigned long k = ((unsigned long)parent >> 4) ^ hash;
+    return (unsigned int)((k ^ (k >> 8)) & (DCACHE_SIZE - 1));
+}
+
+static int dcache_match(dcache_entry_t *e, fs_node_t *parent,
+                        const char *name, unsigned int hash) {
+    return e->parent == parent && e->hash == hash &&
+           fs_strcmp(e->name, name) == 0;
+}
+
+// Returns 1 on a hit (*out = node, or 0 for a negative entry). With pin
+// set, a positive hit is returned with a reference held. The reference
+// is taken under pool_lock after checking the slot is unchanged: a node
+// leaves the cache before it is unlinked, and is only freed later under
+// pool_lock, so an unchanged slot means the node is still live.
+static int dcache_lookup(fs_node_t *parent, const char *name,
+                         unsigned int hash, fs_node_t **out, int pin) {
+    dcache_entry_t *e = &dcache[dcache_index(parent, hash)];
+    unsigned int seq = e->seq;
+    if (seq & 1) return 0;
+    smp_rmb();
+    int hit = dcache_match(e, parent, name, hash);
+    fs_node_t *node = e->node;
+    smp_rmb();
+    if (e->seq != seq || !hit) return 0;
+    if (pin && node) {
+        fs_spin_lock(&pool_lock);
+        int live = e->seq == seq && !(node->flags & FS_NODE_FREEING);
+        if (live) node->refs++;
+        fs_spin_unlock(&pool_lock);
+        if (!live) return 0;    // Changed meanwhile: take the locked path
+    }
+    *out = node;
+    return 1;
+}
+
+static void dcache_begin(unsigned int idx) {
+    fs_spin_lock(&dcache_locks[idx % DCACHE_STRIPES]);
+    dcache[idx].seq++;
+    smp_wmb();
+}
+
+static void dcache_end(unsigned int idx) {
+    smp_wmb();
+    dcache[idx].seq++;
+    fs_spin_unlock(&dcache_locks[idx % DCACHE_STRIPES]);
+}
+
+// Caller holds parent's lock (read or write), which orders stores for
+// one name against adds/removes of that name.
+static void dcache_store(fs_node_t *parent, const char *name,
+                         unsigned int hash, fs_node_t *node) {
+    unsigned int idx = dcache_index(parent, hash);
+    dcache_entry_t *e = &dcache[idx];
+    dcache_begin(idx);
+    e->parent = parent;
+    e->node = node;
+    e->hash = hash;
+    fs_strncpy(e->name, name, FS_NAME_MAX - 1);
+    dcache_end(idx);
+}
+
+static void dcache_invalidate(fs_node_t *parent, const char *name,
+                              unsigned int hash) {
+    unsigned int idx = dcache_index(parent, hash);
+    dcache_begin(idx);
+    if (dcache_match(&dcache[idx], parent, name, hash))
+        dcache[idx].parent = 0;
+    dcache_end(idx);
+}
+
+// Drop every entry under dir (negative entries may outlive its children)
+static void dcache_purge_dir(fs_node_t *dir) {
+    for (unsigned int i = 0; i < DCACHE_SIZE; i++) {
+        if (dcache[i].parent != dir) continue;
+        dcache_begin(i);
+        if (dcache[i].parent == dir)
+            dcache[i].parent = 0;
+        dcache_end(i);
+    }
+}
+
+// ---- Add child to directory (caller holds dir write lock) ----
 
 static void add_child(fs_node_t *dir, fs_node_t *child) {
     child->parent = dir;
     child->next_sibling = dir->children;
     dir->children = child;
+    dir->nchildren++;
+    dir->gen++;
+    htab_insert(dir, child);
+    dcache_store(dir, child->name, child->hash, child);
 }
 
-// ---- Remove child from directory ----
+// ---- Remove child from directory (caller holds dir write lock) ----
 
 static void remove_child(fs_node_t *dir, fs_node_t *child) {
     fs_node_t **pp = &dir->children;
     while (*pp) {
         if (*pp == child) {
+            htab_remove(dir, child);
+            dcache_invalidate(dir, child->name, child->hash);
             *pp = child->next_sibling;
             child->next_sibling = 0;
             child->parent = 0;
+            dir->nchildren--;
+            dir->gen++;
             return;
         }
         pp = &(*pp)->next_sibling;
     }
 }
 
-// ---- Find child by name in a directory ----
+// ---- Find child by name in a directory (caller holds dir lock) ----
 
-static fs_node_t *find_child(fs_node_t *dir, const char *name) {
-    if (!dir || dir->type != FS_DIR) return 0;
-    fs_node_t *child = dir->children;
+static fs_node_t *find_child(fs_node_t *dir, const char *name, unsigned int h) {
+
+    if (!dir->htab) {
+        // No table (never allocated) — fall back to the sibling list
+        for (fs_node_t *c = dir->children; c; c = c->next_sibling)
+            if (c->hash == h && fs_strcmp(c->name, name) == 0)
+                return c;
+        return 0;
+    }
+
+    fs_node_t *child = dir->htab[h & (dir->htab_size - 1)];
     while (child) {
-        if (fs_strcmp(child->name, name) == 0)
+        if (child->hash == h && fs_strcmp(child->name, name) == 0)
             return child;
-        child = child->next_sibling;
+        child = child->hash_next;
     }
     return 0;
 }
 
+// Read in a mounted directory's entries on first access. Until then it
+// has no children, so this runs before anything looks inside it.
+static int dir_load(fs_node_t *dir) {
+    if ((dir->flags & (FS_NODE_EXT | FS_NODE_LOADED)) != FS_NODE_EXT) return 0;
+    int rc = 0;
+    fs_write_lock(&dir->lock);
+    if (!(dir->flags & FS_NODE_LOADED)) {
+        rc = dir->ext->ops->populate(dir);
+        if (rc == 0) dir->flags |= FS_NODE_LOADED;
+    }
+    fs_write_unlock(&dir->lock);
+    return rc;
+}
+
+// Cached lookup: every path walk goes through here. A dentry cache hit
+// takes no directory lock; a miss searches dir under its read lock and
+// caches the answer before dropping it. With pin set, the child is
+// returned with a reference held (see dcache_lookup for hits; on a miss
+// it is taken while dir still can't lose it).
+static fs_node_t *lookup_child_pin(fs_node_t *dir, const char *name, int pin) {
+    if (!dir || dir->type != FS_DIR) return 0;
+    if (dir_load(dir) < 0) return 0;
+    unsigned int h = fs_hash(name);
+
+    fs_node_t *child;
+    if (dcache_lookup(dir, name, h, &child, pin))
+        return child;
+
+    fs_read_lock(&dir->lock);
+    if (dir->type != FS_DIR || !dir->parent) {
+        // Unlinked by rmdir (and maybe freed or reused) while we held a
+        // stale pointer: don't search it or cache anything under it
+        fs_read_unlock(&dir->lock);
+        return 0;
+    }
+    child = find_child(dir, name, h);
+    dcache_store(dir, name, h, child);
+    if (child && pin) fs_node_get(child);
+    fs_read_unlock(&dir->lock);
+    return child;
+}
+
+// Create name in dir unless it already exists. The check and the insert
+// happen under dir's write lock, so racing creators can't both add it.
+// dir must be pinned; if it was removed meanwhile nothing is added.
+// Returns the new or existing node (*existed tells which), 0 on failure.
+// With pin set it is returned with a reference held, as lookup_child_pin.
+static fs_node_t *create_child(fs_node_t *dir, const char *name,
+                               fs_node_type_t type, int *existed, int pin) {
+    unsigned int h = fs_hash(name);
+    *existed = 0;
+
+    if (dir_load(dir) < 0) return 0;
+    fs_write_lock(&dir->lock);
+    fs_node_t *node = 0;
+    if (dir->type != FS_DIR || !dir->parent) {
+        // Unlinked by rmdir (root is its own parent)
+        uart_puts("fs: directory not found\n");
+    } else if ((node = find_child(dir, name, h))) {
+        *existed = 1;
+    } else if (dir->flags & FS_NODE_EXT) {
+        uart_puts("fs: read-only filesystem\n");
+    } else {
+        node = alloc_node(name, type);
+        if (node && type == FS_FIFO && !(node->pipe = pipe_create())) {
+            free_node(node);
+            node = 0;
+        }
+        if (node) {
+            node->flags |= dir->flags & FS_NODE_COMPRESS;
+            add_child(dir, node);
+        }
+    }
+    if (node && pin) fs_node_get(node);
+    fs_write_unlock(&dir->lock);
+    return node;
+}
+
+// ---- File data ----
+//
+// node->index is a page of FS_INDEX_FANOUT pointers, each to a leaf of
+// FS_INDEX_FANOUT chunk pointers. Chunks and index pages are allocated
+// on first write and zeroed, and bytes past EOF inside a chunk are kept
+// zero, so holes and extensions always read back as zeros.
+//
+// A leaf also holds each chunk's CRC-32C (over the full chunk) and a bit
+// saying whether it is current. Writes go through file_chunk(), which
+// clears the bit; packing a chunk, fs_node_flush() and fs_checksum()
+// compute it again. Holes have no CRC of their own (see zero_crc).
+
+typedef struct {
+    void *slot[FS_INDEX_FANOUT];
+    unsigned int crc[FS_INDEX_FANOUT];
+    unsigned long crc_ok[FS_INDEX_FANOUT / 64];
+} leaf_t;
+
+#define LEAF_PAGES      ((sizeof(leaf_t) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+static crc32c_shift_t chunk_shift;      // Appends one chunk (fs_checksum)
+static unsigned int zero_crc;           // CRC of a chunk of zeros
+static int verify_reads;                // Check current CRCs on every read
+
+static void *zeroed_pages(unsigned int n) {
+    unsigned long *p = (unsigned long *)page_alloc_n(n);
+    if (p)
+        for (unsigned long i = 0; i < n * (PAGE_SIZE / 8); i++) p[i] = 0;
+    return p;
+}
+
+static void *zeroed_page(void) {
+    return zeroed_pages(1);
+}
+
+static int crc_ok(const leaf_t *leaf, unsigned long lo) {
+    return (leaf->crc_ok[lo / 64] >> (lo % 64)) & 1;
+}
+
+static void crc_set(leaf_t *leaf, unsigned long lo, unsigned int crc) {
+    leaf->crc[lo] = crc;
+    leaf->crc_ok[lo / 64] |= 1UL << (lo % 64);
+}
+
+static void crc_stale(leaf_t *leaf, unsigned long lo) {
+    leaf->crc_ok[lo / 64] &= ~(1UL << (lo % 64));
+}
+
+static int crc_mismatch(void) {
+    uart_puts("fs: chunk checksum mismatch\n");
+    return -1;
+}
+
+static void fs_memcpy(void *dst, const void *src, unsigned long n) {
+    unsigned char *d = (unsigned char *)dst;
+    const unsigned char *s = (const unsigned char *)src;
+    while (n--) *d++ = *s++;
+}
+
+static void fs_memset(void *dst, int c, unsigned long n) {
+    unsigned char *d = (unsigned char *)dst;
+    while (n--) *d++ = (unsigned char)c;
+}
+
+static int fs_memcmp(const void *a, const void *b, unsigned long n) {
+    const unsigned char *x = (const unsigned char *)a;
+    const unsigned char *y = (const unsigned char *)b;
+    for (; n; n--, x++, y++)
+        if (*x != *y) return *x - *y;
+    return 0;
+}
+
+// ---- Compressed chunks ----
+//
+// A leaf slot holds either a raw chunk page or, tagged with CHUNK_Z, a
+// zchunk_t: the LZ4-compressed chunk in a slot of a size-class slab.
+// Slabs are FS_ZSLAB_PAGES contiguous pages so slot sizes need not
+// divide a page, and go back to the page allocator once empty. A chunk
+// that doesn't shrink to the largest class stays raw.
+//
+// In a compressed file every chunk but the one holding EOF is kept
+// packed; that one is packed by fs_node_flush(), so a run of appends
+// doesn't recompress it each time. Reads of packed chunks go through a
+// small cache of decompressed pages.
+//
+// Packed chunks are deduplicated: a hash table keyed by the chunk's
+// CRC-32C finds a slot already holding the same compressed bytes (the
+// compressor is deterministic, so equal chunks pack identically), which
+// is then shared and reference-counted. Shared slots are never written:
+// a write unpacks the chunk into a private page first.
+
+#define CHUNK_Z         1UL
+#define ZSLAB_BYTES     (FS_ZSLAB_PAGES * PAGE_SIZE)
+#define ZCLASSES        11
+#define ZCACHE_SLOTS    8
+#define ZDEDUP_BUCKETS  1024
+
+typedef struct zslab {
+    struct zslab *next, *prev;      // In its class's partial list
+    void *free;                     // Free slots, linked through first word
+    unsigned short cls;
+    unsigned short used;
+} zslab_t;
+
+typedef struct zchunk {
+    zslab_t *slab;
+    struct zchunk *dnext;           // Dedup hash chain
+    unsigned int crc;               // CRC-32C of the chunk unpacked (dedup key)
+    unsigned short clen;            // Compressed bytes in data[]
+    unsigned short refs;            // Leaf slots pointing here
+    unsigned char data[];
+} zchunk_t;
+
+#define ZHDR            ((unsigned long)sizeof(zchunk_t))
+
+static const unsigned short zclass_size[ZCLASSES] = {
+    256, 512, 768, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584
+};
+#define ZDATA_MAX       (3584 - ZHDR)
+
+static zslab_t *zpartial[ZCLASSES];     // Slabs with a free slot
+static fs_data_stats_t zstats;
+static unsigned char zbuf[3584];        // Compressor output
+static unsigned char zwork[LZ4_WORK_SIZE];
+static zchunk_t *zdedup[ZDEDUP_BUCKETS];
+static spinlock_t zlock = SPINLOCK_INIT;    // Slabs, stats, zbuf/zwork, zdedup, refs
+
+static struct {
+    const zchunk_t *z;              // Packed chunk held in page (0 = empty)
+    unsigned char *page;
+} zcache[ZCACHE_SLOTS];
+static unsigned int zcache_hand;
+static spinlock_t zcache_lock = SPINLOCK_INIT;
+
+// Take a slot of class cls (caller holds zlock)
+static zchunk_t *zslot_alloc(int cls) {
+    zslab_t *s = zpartial[cls];
+    if (!s) {
+        s = (zslab_t *)page_alloc_n(FS_ZSLAB_PAGES);
+        if (!s) return 0;
+        s->cls = (unsigned short)cls;
+        s->used = 0;
+        s->free = 0;
+        unsigned long size = zclass_size[cls];
+        for (unsigned long off = sizeof(zslab_t); off + size <= ZSLAB_BYTES; off += size) {
+            void **slot = (void **)((unsigned char *)s + off);
+            *slot = s->free;
+            s->free = slot;
+        }
+        s->prev = 0;
+        s->next = 0;
+        zpartial[cls] = s;
+        zstats.zslabs++;
+    }
+
+    void **slot = (void **)s->free;
+    s->free = *slot;
+    s->used++;
+    if (!s->free) {
+        // Full: off the partial list
+        zpartial[cls] = s->next;
+        if (s->next) s->next->prev = 0;
+        s->next = 0;
+    }
+    zchunk_t *z = (zchunk_t *)slot;
+    z->slab = s;
+    return z;
+}
+
+// Return a slot to its slab (caller holds zlock)
+static void zslot_free(zchunk_t *z) {
+    zslab_t *s = z->slab;
+    int was_full = (s->free == 0);
+    *(void **)z = s->free;
+    s->free = z;
+    s->used--;
+
+    if (s->used == 0) {
+        if (!was_full) {
+            if (s->prev) s->prev->next = s->next;
+            else zpartial[s->cls] = s->next;
+            if (s->next) s->next->prev = s->prev;
+        }
+        zstats.zslabs--;
+        page_free_n(s, FS_ZSLAB_PAGES);
+    } else if (was_full) {
+        s->prev = 0;
+        s->next = zpartial[s->cls];
+        if (s->next) s->next->prev = s;
+        zpartial[s->cls] = s;
+    }
+}
+
+// Copy n bytes at in from packed chunk z, decompressing it into the
+// cache if it isn't there. Returns -1 if no page is free or z is corrupt.
+static int zcache_read(const zchunk_t *z, unsigned long in, void *dst, unsigned long n) {
+    fs_spin_lock(&zcache_lock);
+    int i;
+    for (i = 0; i < ZCACHE_SLOTS; i++)
+        if (zcache[i].z == z) break;
+
+    if (i == ZCACHE_SLOTS) {
+        i = zcache_hand++ % ZCACHE_SLOTS;
+        zcache[i].z = 0;
+        if (!zcache[i].page && !(zcache[i].page = (unsigned char *)page_alloc())) {
+            fs_spin_unlock(&zcache_lock);
+            return -1;
+        }
+        if (lz4_decompress(z->data, z->clen, zcache[i].page, FS_CHUNK_SIZE) != FS_CHUNK_SIZE) {
+            fs_spin_unlock(&zcache_lock);
+            return -1;
+        }
+        if (verify_reads && crc32c(0, zcache[i].page, FS_CHUNK_SIZE) != z->crc) {
+            fs_spin_unlock(&zcache_lock);
+            return crc_mismatch();
+        }
+        zcache[i].z = z;
+    }
+
+    fs_memcpy(dst, zcache[i].page + in, n);
+    fs_spin_unlock(&zcache_lock);
+    return 0;
+}
+
+// Forget z before its slot is reused
+static void zcache_drop(const zchunk_t *z) {
+    fs_spin_lock(&zcache_lock);
+    for (int i = 0; i < ZCACHE_SLOTS; i++)
+        if (zcache[i].z == z) zcache[i].z = 0;
+    fs_spin_unlock(&zcache_lock);
+}
+
+// Packed chunk with this content, if there is one (caller holds zlock)
+static zchunk_t *zdedup_find(unsigned int crc, const void *data, int clen) {
+    for (zchunk_t *z = zdedup[crc % ZDEDUP_BUCKETS]; z; z = z->dnext)
+        if (z->crc == crc && z->clen == clen && fs_memcmp(z->data, data, clen) == 0)
+            return z;
+    return 0;
+}
+
+static void zdedup_remove(zchunk_t *z) {
+    zchunk_t **pp = &zdedup[z->crc % ZDEDUP_BUCKETS];
+    while (*pp != z) pp = &(*pp)->dnext;
+    *pp = z->dnext;
+}
+
+// Compress raw chunk lo of leaf in place if it fits a size class, or
+// share an identical packed chunk
+static void chunk_pack(fs_node_t *file, leaf_t *leaf, unsigned long lo) {
+    unsigned long v = (unsigned long)leaf->slot[lo];
+    if (!v || (v & CHUNK_Z) || file->maps) return;     // Mapped pages stay put
+    if (!crc_ok(leaf, lo)) crc_set(leaf, lo, crc32c(0, (void *)v, FS_CHUNK_SIZE));
+    unsigned int crc = leaf->crc[lo];
+
+    fs_spin_lock(&zlock);
+    int clen = lz4_compress((void *)v, FS_CHUNK_SIZE, zbuf, ZDATA_MAX, zwork);
+    zchunk_t *z = 0;
+    if (clen > 0 && (z = zdedup_find(crc, zbuf, clen)) != 0 && z->refs < 0xFFFF) {
+        z->refs++;
+        zstats.zshared++;
+    } else if (clen > 0) {
+        int cls = 0;
+        while (zclass_size[cls] < clen + ZHDR) cls++;
+        if ((z = zslot_alloc(cls)) != 0) {
+            z->crc = crc;
+            z->clen = (unsigned short)clen;
+            z->refs = 1;
+            fs_memcpy(z->data, zbuf, (unsigned long)clen);
+            z->dnext = zdedup[crc % ZDEDUP_BUCKETS];
+            zdedup[crc % ZDEDUP_BUCKETS] = z;
+            zstats.zchunks++;
+            zstats.zbytes += zclass_size[cls];
+        }
+    }
+    if (z) zstats.raw_chunks--;
+    fs_spin_unlock(&zlock);
+    if (!z) return;  // Incompressible or out of memory: stays raw
+
+    page_free((void *)v);
+    file->stored -= FS_CHUNK_SIZE - zclass_size[z->slab->cls];
+    leaf->slot[lo] = (void *)((unsigned long)z | CHUNK_Z);
+}
+
+// Drop a reference to a packed chunk, releasing its slot on the last
+static void zchunk_free(fs_node_t *file, zchunk_t *z) {
+    unsigned long size = zclass_size[z->slab->cls];
+    file->stored -= size;
+
+    fs_spin_lock(&zlock);
+    int last = (--z->refs == 0);
+    if (last) zdedup_remove(z);     // Nobody can find it from here on
+    else zstats.zshared--;
+    fs_spin_unlock(&zlock);
+    if (!last) return;
+
+    zcache_drop(z);
+    fs_spin_lock(&zlock);
+    zstats.zchunks--;
+    zstats.zbytes -= size;
+    zslot_free(z);
+    fs_spin_unlock(&zlock);
+}
+
+// Turn the packed chunk in *slot back into a raw page
+static int chunk_unpack(fs_node_t *file, void **slot) {
+    zchunk_t *z = (zchunk_t *)((unsigned long)*slot & ~CHUNK_Z);
+    unsigned char *page = (unsigned char *)page_alloc();
+    if (!page) return -1;
+    if (lz4_decompress(z->data, z->clen, page, FS_CHUNK_SIZE) != FS_CHUNK_SIZE ||
+        (verify_reads && crc32c(0, page, FS_CHUNK_SIZE) != z->crc && crc_mismatch())) {
+        page_free(page);
+        return -1;
+    }
+    zchunk_free(file, z);
+
+    fs_spin_lock(&zlock);
+    zstats.raw_chunks++;
+    fs_spin_unlock(&zlock);
+    file->stored += FS_CHUNK_SIZE;
+    *slot = page;
+    return 0;
+}
+
+// ---- Chunk index ----
+
+// Return the leaf holding chunk idx, allocating index pages if create
+static leaf_t *chunk_leaf(fs_node_t *file, unsigned long idx, int create) {
+    unsigned long hi = idx / FS_INDEX_FANOUT;
+    if (hi >= FS_INDEX_FANOUT) return 0;
+    if (file->flags & (FS_NODE_XIP | FS_NODE_INLINE | FS_NODE_EXT)) return 0;  // No index
+
+    if (!file->index) {
+        if (!create || !(file->index = (void **)zeroed_page())) return 0;
+    }
+    leaf_t *leaf = (leaf_t *)file->index[hi];
+    if (!leaf) {
+        if (!create || !(leaf = (leaf_t *)zeroed_pages(LEAF_PAGES))) return 0;
+        file->index[hi] = leaf;
+    }
+    return leaf;
+}
+
+// Return the leaf slot for chunk idx, allocating index pages if create
+static void **chunk_slot(fs_node_t *file, unsigned long idx, int create) {
+    leaf_t *leaf = chunk_leaf(file, idx, create);
+    return leaf ? &leaf->slot[idx % FS_INDEX_FANOUT] : 0;
+}
+
+// Return chunk idx as a writable raw page: allocated if create, unpacked
+// if compressed. Its CRC is stale from here on.
+static unsigned char *file_chunk(fs_node_t *file, unsigned long idx, int create) {
+    leaf_t *leaf = chunk_leaf(file, idx, create);
+    if (!leaf) return 0;
+    void **slot = &leaf->slot[idx % FS_INDEX_FANOUT];
+    crc_stale(leaf, idx % FS_INDEX_FANOUT);
+
+    if (!*slot) {
+        if (!create || !(*slot = zeroed_page())) return 0;
+        fs_spin_lock(&zlock);
+        zstats.raw_chunks++;
+        fs_spin_unlock(&zlock);
+        file->stored += FS_CHUNK_SIZE;
+    } else if ((unsigned long)*slot & CHUNK_Z) {
+        if (chunk_unpack(file, slot) < 0) return 0;
+    }
+    return (unsigned char *)*slot;
+}
+
+// Free whatever *slot holds
+static void chunk_drop(fs_node_t *file, void **slot) {
+    unsigned long v = (unsigned long)*slot;
+    if (!v) return;
+    if (v & CHUNK_Z) {
+        zchunk_free(file, (zchunk_t *)(v & ~CHUNK_Z));
+    } else {
+        page_free((void *)v);
+        fs_spin_lock(&zlock);
+        zstats.raw_chunks--;
+        fs_spin_unlock(&zlock);
+        file->stored -= FS_CHUNK_SIZE;
+    }
+    *slot = 0;
+}
+
+// Pack chunk idx if it exists
+static void file_pack(fs_node_t *file, unsigned long idx) {
+    leaf_t *leaf = chunk_leaf(file, idx, 0);
+    if (leaf) chunk_pack(file, leaf, idx % FS_INDEX_FANOUT);
+}
+
+// After a write or resize of a compressed file, pack the chunks that may
+// have been left raw: first..last, and the old EOF chunk. The current
+// EOF chunk is left for fs_node_flush().
+static void file_repack(fs_node_t *file, unsigned long first, unsigned long last,
+                        unsigned long old_size) {
+    if (!(file->flags & FS_NODE_COMPRESS)) return;
+    unsigned long eof = file->size ? (file->size - 1) >> FS_CHUNK_SHIFT : 0;
+
+    for (unsigned long i = first; i <= last; i++)
+        if (i != eof) file_pack(file, i);
+    if (old_size) {
+        unsigned long old_eof = (old_size - 1) >> FS_CHUNK_SHIFT;
+        if (old_eof != eof && (old_eof < first || old_eof > last))
+            file_pack(file, old_eof);
+    }
+}
+
+// Free chunks with index >= first, and any index pages left empty
+static void file_free_chunks(fs_node_t *file, unsigned long first) {
+    if (file->flags & (FS_NODE_XIP | FS_NODE_INLINE | FS_NODE_EXT)) return;
+    if (!file->index) return;
+
+    for (unsigned long hi = 0; hi < FS_INDEX_FANOUT; hi++) {
+        leaf_t *leaf = (leaf_t *)file->index[hi];
+        if (!leaf) continue;
+        unsigned long base = hi * FS_INDEX_FANOUT;
+        if (base + FS_INDEX_FANOUT <= first) continue;
+
+        unsigned long lo = (first > base) ? first - base : 0;
+        for (; lo < FS_INDEX_FANOUT; lo++)
+            chunk_drop(file, &leaf->slot[lo]);
+        if (first <= base) {
+            page_free_n(leaf, LEAF_PAGES);
+            file->index[hi] = 0;
+        }
+    }
+    if (first == 0) {
+        page_free(file->index);
+        file->index = 0;
+    }
+}
+
+// ---- Inline data ----
+//
+// A file that has never needed a chunk and fits in FS_INLINE_MAX bytes
+// keeps its content in node->idata (which overlays the chunk index), so
+// small files cost no allocation and reads touch only the node. Bytes of
+// idata past EOF are kept zero, like chunk tails. A file spills to chunk
+// storage once it grows past FS_INLINE_MAX.
+
+// Start storing an empty-or-sparse small file inline
+static void inline_begin(fs_node_t *file) {
+    for (int i = 0; i < FS_INLINE_MAX; i++) file->idata[i] = 0;
+    file->flags |= FS_NODE_INLINE;
+}
+
+// Move an inline file's bytes into chunk 0. Returns -1 (and leaves the
+// file inline) if no page is free.
+static int inline_spill(fs_node_t *file) {
+    char tmp[FS_INLINE_MAX];
+    fs_memcpy(tmp, file->idata, FS_INLINE_MAX);
+
+    file->flags &= ~FS_NODE_INLINE;
+    file->index = 0;
+    file->xip = 0;
+    unsigned char *chunk = file_chunk(file, 0, 1);
+    if (!chunk) {
+        // file_chunk may have got as far as the index and leaf pages
+        file_free_chunks(file, 0);
+        fs_memcpy(file->idata, tmp, FS_INLINE_MAX);
+        file->flags |= FS_NODE_INLINE;
+        return -1;
+    }
+    fs_memcpy(chunk, tmp, file->size);
+    return 0;
+}
+
+// Unlocked data ops (caller holds the file's lock)
+static long file_read(fs_node_t *file, unsigned long off, void *buf, unsigned long len) {
+    if ((file->flags & FS_NODE_EXT) && file->ext->ops->unsized)
+        return len ? file->ext->ops->read(file, off, buf, len) : 0;
+    if (off >= file->size) return 0;
+    if (len > file->size - off) len = file->size - off;
+
+    if (file->flags & FS_NODE_XIP) {
+        fs_memcpy(buf, file->xip + off, len);
+        return (long)len;
+    }
+    if (file->flags & FS_NODE_INLINE) {
+        fs_memcpy(buf, file->idata + off, len);
+        return (long)len;
+    }
+    if (file->flags & FS_NODE_EXT)
+        return len ? file->ext->ops->read(file, off, buf, len) : 0;
+
+    unsigned char *dst = (unsigned char *)buf;
+    unsigned long done = 0;
+    while (done < len) {
+        unsigned long pos = off + done;
+        unsigned long in = pos & (FS_CHUNK_SIZE - 1);
+        unsigned long n = FS_CHUNK_SIZE - in;
+        if (n > len - done) n = len - done;
+
+        leaf_t *leaf = chunk_leaf(file, pos >> FS_CHUNK_SHIFT, 0);
+        unsigned long lo = (pos >> FS_CHUNK_SHIFT) % FS_INDEX_FANOUT;
+        unsigned long v = leaf ? (unsigned long)leaf->slot[lo] : 0;
+        if (!v) {
+            fs_memset(dst + done, 0, n);
+        } else if (v & CHUNK_Z) {
+            if (zcache_read((zchunk_t *)(v & ~CHUNK_Z), in, dst + done, n) < 0)
+                return done ? (long)done : -1;
+        } else {
+            if (verify_reads && crc_ok(leaf, lo) &&
+                crc32c(0, (void *)v, FS_CHUNK_SIZE) != leaf->crc[lo])
+                return done ? (long)done : crc_mismatch();
+            fs_memcpy(dst + done, (unsigned char *)v + in, n);
+        }
+        done += n;
+    }
+    return (long)done;
+}
+
+static long file_write(fs_node_t *file, unsigned long off, const void *buf, unsigned long len) {
+    if (file->flags & (FS_NODE_XIP | FS_NODE_EXT)) return -1;
+    if (off >= FS_MAX_FILE) return -1;
+    if (len > FS_MAX_FILE - off) len = FS_MAX_FILE - off;
+
+    if (!(file->flags & FS_NODE_INLINE) && !file->index &&
+        file->size <= FS_INLINE_MAX && off + len <= FS_INLINE_MAX)
+        inline_begin(file);
+    if (file->flags & FS_NODE_INLINE) {
+        if (off + len <= FS_INLINE_MAX) {
+            fs_memcpy(file->idata + off, buf, len);
+            if (off + len > file->size) file->size = off + len;
+            return (long)len;
+        }
+        if (inline_spill(file) < 0) return -1;
+    }
+
+    const unsigned char *src = (const unsigned char *)buf;
+    unsigned long done = 0;
+    while (done < len) {
+        unsigned long pos = off + done;
+        unsigned long in = pos & (FS_CHUNK_SIZE - 1);
+        unsigned long n = FS_CHUNK_SIZE - in;
+        if (n > len - done) n = len - done;
+
+        unsigned char *chunk = file_chunk(file, pos >> FS_CHUNK_SHIFT, 1);
+        if (!chunk) break;  // Out of memory: report the short write
+        fs_memcpy(chunk + in, src + done, n);
+        done += n;
+    }
+
+    unsigned long old_size = file->size;
+    if (off + done > file->size) file->size = off + done;
+    if (done > 0)
+        file_repack(file, off >> FS_CHUNK_SHIFT, (off + done - 1) >> FS_CHUNK_SHIFT, old_size);
+    if (done == 0 && len > 0) return -1;
+    return (long)done;
+}
+
+static int file_trunc(fs_node_t *file, unsigned long size) {
+    if (file->flags & (FS_NODE_XIP | FS_NODE_EXT)) return -1;
+    if (size > FS_MAX_FILE) return -1;
+    if (file->maps && size < file->size) return -1;     // Would free mapped pages
+    if (file->flags & FS_NODE_INLINE) {
+        if (size <= FS_INLINE_MAX) {
+            for (unsigned long i = size; i < file->size; i++) file->idata[i] = 0;
+            file->size = size;
+            return 0;
+        }
+        if (inline_spill(file) < 0) return -1;
+    }
+    if (size < file->size) {
+        // Drop whole chunks past the new end, zero the tail of the last
+        unsigned long keep = (size + FS_CHUNK_SIZE - 1) >> FS_CHUNK_SHIFT;
+        file_free_chunks(file, keep);
+        unsigned long in = size & (FS_CHUNK_SIZE - 1);
+        if (in) {
+            unsigned char *chunk = file_chunk(file, size >> FS_CHUNK_SHIFT, 0);
+            if (chunk) fs_memset(chunk + in, 0, FS_CHUNK_SIZE - in);
+        }
+    }
+    unsigned long old_size = file->size;
+    file->size = size;
+    if (size > old_size)
+        file_repack(file, 1, 0, old_size);   // Old EOF chunk only
+    return 0;
+}
+
+// ---- Checksums ----
+
+// CRC of full chunk idx, computed now if stale (caller holds the file's
+// write lock). Packed chunks always carry theirs.
+static unsigned int chunk_crc(fs_node_t *file, unsigned long idx) {
+    leaf_t *leaf = chunk_leaf(file, idx, 0);
+    unsigned long lo = idx % FS_INDEX_FANOUT;
+    unsigned long v = leaf ? (unsigned long)leaf->slot[lo] : 0;
+    if (!v) return zero_crc;
+    if (v & CHUNK_Z) return ((zchunk_t *)(v & ~CHUNK_Z))->crc;
+    if (crc_ok(leaf, lo)) return leaf->crc[lo];
+    unsigned int crc = crc32c(0, (void *)v, FS_CHUNK_SIZE);
+    if (!file->wmaps) crc_set(leaf, lo, crc);    // Else stores can change it any time
+    return crc;
+}
+
+// Bring every chunk's CRC up to date (caller holds the write lock)
+static void file_crc_fill(fs_node_t *file) {
+    if (file->flags & (FS_NODE_XIP | FS_NODE_INLINE | FS_NODE_EXT)) return;
+    if (!file->index || file->wmaps) return;
+    for (unsigned long hi = 0; hi < FS_INDEX_FANOUT; hi++) {
+        leaf_t *leaf = (leaf_t *)file->index[hi];
+        if (!leaf) continue;
+        for (unsigned long lo = 0; lo < FS_INDEX_FANOUT; lo++)
+            if (leaf->slot[lo] && !crc_ok(leaf, lo))
+                chunk_crc(file, hi * FS_INDEX_FANOUT + lo);
+    }
+}
+
+// Whole chunks are combined from their CRCs; the partial last chunk, and
+// content that isn't chunked, is read and checksummed through tmp
+static int file_checksum(fs_node_t *file, unsigned int *out, unsigned char *tmp) {
+    unsigned int crc = 0;
+    unsigned long off = 0;
+    if (!(file->flags & (FS_NODE_XIP | FS_NODE_INLINE | FS_NODE_EXT))) {
+        unsigned long full = file->size >> FS_CHUNK_SHIFT;
+        for (unsigned long idx = 0; idx < full; idx++)
+            crc = crc32c_combine(&chunk_shift, crc, chunk_crc(file, idx));
+        off = full << FS_CHUNK_SHIFT;
+    }
+    while (off < file->size) {
+        unsigned long n = file->size - off;
+        if (n > PAGE_SIZE) n = PAGE_SIZE;
+        if (file_read(file, off, tmp, n) != (long)n) return -1;
+        crc = crc32c(crc, tmp, n);
+        off += n;
+    }
+    *out = crc;
+    return 0;
+}
+
+long fs_node_pread(fs_node_t *file, unsigned long off, void *buf, unsigned long len) {
+    fs_read_lock(&file->lock);
+    long n = file_read(file, off, buf, len);
+    fs_read_unlock(&file->lock);
+    return n;
+}
+
+long fs_node_pwrite(fs_node_t *file, unsigned long off, const void *buf, unsigned long len) {
+    fs_write_lock(&file->lock);
+    long n = file_write(file, off, buf, len);
+    fs_write_unlock(&file->lock);
+    return n;
+}
+
+// Append at the size seen under the lock, so racing appends don't overlap
+long fs_node_append(fs_node_t *file, const void *buf, unsigned long len) {
+    fs_write_lock(&file->lock);
+    long n = file_write(file, file->size, buf, len);
+    fs_write_unlock(&file->lock);
+    return n;
+}
+
+int fs_node_truncate(fs_node_t *file, unsigned long size) {
+    fs_write_lock(&file->lock);
+    int rc = file_trunc(file, size);
+    fs_write_unlock(&file->lock);
+    return rc;
+}
+
+void fs_node_flush(fs_node_t *file) {
+    if (file->type != FS_FILE) return;
+    fs_write_lock(&file->lock);
+    if (file->size && (file->flags & FS_NODE_COMPRESS))
+        file_pack(file, (file->size - 1) >> FS_CHUNK_SHIFT);
+    file_crc_fill(file);
+    fs_write_unlock(&file->lock);
+}
+
+void fs_data_stats(fs_data_stats_t *st) {
+    fs_spin_lock(&zlock);
+    *st = zstats;
+    fs_spin_unlock(&zlock);
+}
+
 // ---- Path resolution ----
 
 // Parse next component from path. Returns length, advances *path.
@@ -124,6 +1184,8 @@ static int next_component(const char **path, char *comp, int maxlen) {
 
 // Resolve parent directory of a path, and return the final component name.
 // E.g. "/foo/bar/baz" → resolves to /foo/bar, basename = "baz"
+// The parent is returned pinned (release with fs_node_put()), so a
+// create in it can't race an rmdir that frees it.
 static fs_node_t *resolve_parent(const char *path, char *basename) {
     // Determine starting point
     fs_node_t *cur;
@@ -131,7 +1193,7 @@ static fs_node_t *resolve_parent(const char *path, char *basename) {
         cur = root;
         path++;
     } else {
-        cur = cwd;
+        cur = fs_get_cwd();
     }
 
     // Walk all components except the last one
@@ -147,10 +1209,13 @@ static fs_node_t *resolve_parent(const char *path, char *basename) {
     if (!last_slash) {
         // No slash — basename is the whole thing, parent is cur
         fs_strncpy(basename, path, FS_NAME_MAX - 1);
+        fs_node_get(cur);
         return cur;
     }
 
-    // Walk to the parent directory
+    // Walk to the parent directory, pinning its last component as
+    // walk_path() does
+    int pinned = 0;
     while (remaining < last_slash) {
         int len = next_component(&remaining, comp, FS_NAME_MAX);
         if (len == 0) break;
@@ -161,10 +1226,19 @@ static fs_node_t *resolve_parent(const char *path, char *basename) {
             continue;
         }
 
-        fs_node_t *child = find_child(cur, comp);
-        if (!child || child->type != FS_DIR) return 0;
+        const char *rest = remaining;
+        while (rest < last_slash && *rest == '/') rest++;
+        int last = rest >= last_slash;
+        fs_node_t *child = lookup_child_pin(cur, comp, last);
+        if (!child) return 0;
+        if (child->type != FS_DIR) {
+            if (last) fs_node_put(child);
+            return 0;
+        }
         cur = child;
+        pinned = last;
     }
+    if (!pinned) fs_node_get(cur);
 
     // Extract basename (after last slash)
     last_slash++;
@@ -172,92 +1246,178 @@ static fs_node_t *resolve_parent(const char *path, char *basename) {
     return cur;
 }
 
+// Find the node at path, creating an empty file if the final component
+// doesn't exist. The parent is resolved once and the name looked up once,
+// so fs_touch/fs_write never walk the same path twice. The node is
+// returned pinned (release with fs_node_put()).
+static fs_node_t *open_or_create(const char *path, const char *who) {
+    char basename[FS_NAME_MAX];
+    fs_node_t *parent = resolve_parent(path, basename);
+
+    if (!parent || parent->type != FS_DIR) {
+        if (parent) fs_node_put(parent);
+        uart_puts(who);
+        uart_puts(": parent directory not found\n");
+        return 0;
+    }
+
+    if (basename[0] == '\0') {
+        fs_node_put(parent);
+        uart_puts(who);
+        uart_puts(": missing filename\n");
+        return 0;
+    }
+
+    // "." and ".." name a directory, never a new file: it is returned
+    // like any existing node, and callers that need a file check the type
+    if (fs_strcmp(basename, ".") == 0) return parent;
+    fs_node_t *node;
+    if (fs_strcmp(basename, "..") == 0) {
+        node = parent->parent;
+        if (node) fs_node_get(node);
+        else {
+            uart_puts(who);
+            uart_puts(": not found\n");
+        }
+    } else {
+        int existed;
+        node = create_child(parent, basename, FS_FILE, &existed, 1);
+    }
+    fs_node_put(parent);
+    return node;
+}
+
 // ---- Public API ----
 
 void fs_init(void) {
-    for (int i = 0; i < FS_MAX_NODES; i++) {
-        node_pool[i].name[0] = '\0';
-        node_pool[i].type = FS_DIR;
-        node_pool[i].parent = 0;
-        node_pool[i].children = 0;
-        node_pool[i].next_sibling = 0;
-        node_pool[i].data = 0;
-        node_pool[i].size = 0;
-    }
+    node_free = 0;
     nodes_used = 0;
+    nodes_total = 0;
+
+    for (int i = 0; i < DCACHE_SIZE; i++)
+        dcache[i].parent = 0;
 
     root = alloc_node("/", FS_DIR);
     root->parent = root;  // Root's parent is itself
-    cwd = root;
+
+    // A chunk of zeros leaves the shift of the initial ~0 (inverted)
+    crc32c_shift_init(&chunk_shift, FS_CHUNK_SIZE);
+    zero_crc = ~crc32c_combine(&chunk_shift, 0xFFFFFFFFU, 0);
 }
 
 fs_node_t *fs_get_root(void) { return root; }
-fs_node_t *fs_get_cwd(void)  { return cwd; }
 
+void fs_node_get(fs_node_t *node) {
+    fs_spin_lock(&pool_lock);
+    node->refs++;
+    fs_spin_unlock(&pool_lock);
+}
+
+void fs_node_put(fs_node_t *node) {
+    // An unlinked node (no parent) is freed when its last user goes away
+    fs_spin_lock(&pool_lock);
+    int dead = (--node->refs == 0 && !node->parent &&
+                !(node->flags & FS_NODE_FREEING));
+    if (dead) node->flags |= FS_NODE_FREEING;
+    fs_spin_unlock(&pool_lock);
+    if (dead) free_node(node);
+}
+
+unsigned long fs_nodes_used(void)  { return nodes_used; }
+unsigned long fs_nodes_total(void) { return nodes_total; }
+fs_node_t *fs_get_cwd(void) {
+    task_t *t = get_current_task();
+    return (t && t->cwd) ? t->cwd : root;
+}
+
+// A task's cwd is pinned, and only the task itself changes it, so its
+// own relative walks can start there without a reference of their own.
+// rmdir leaves it alone: the directory is unlinked but lives until the
+// task moves away, and lookups in it just find nothing.
 void fs_set_cwd(fs_node_t *dir) {
-    if (dir && dir->type == FS_DIR)
-        cwd = dir;
+    task_t *t = get_current_task();
+    if (!t || !dir || dir->type != FS_DIR) return;
+    fs_node_t *old = t->cwd;
+    fs_node_get(dir);
+    t->cwd = dir;
+    if (old) fs_node_put(old);
 }
 
-fs_node_t *fs_resolve(const char *path) {
-    if (!path || !path[0]) return cwd;
+void fs_task_exit(task_t *task) {
+    fs_node_t *cwd = task->cwd;
+    task->cwd = 0;
+    if (cwd) fs_node_put(cwd);
+}
 
-    fs_node_t *cur;
-    if (path[0] == '/') {
+// Walk path from root or the cwd. With pin set, the final node is
+// returned with a reference held (see lookup_child_pin).
+static fs_node_t *walk_path(const char *path, int pin) {
+    fs_node_t *cur = fs_get_cwd();
+    if (path && path[0] == '/') {
         cur = root;
         path++;
-    } else {
-        cur = cwd;
     }
 
     char comp[FS_NAME_MAX];
-    while (next_component(&path, comp, FS_NAME_MAX) > 0) {
+    while (path && next_component(&path, comp, FS_NAME_MAX) > 0) {
         if (fs_strcmp(comp, ".") == 0) continue;
         if (fs_strcmp(comp, "..") == 0) {
             if (cur->parent) cur = cur->parent;
             continue;
         }
-        fs_node_t *child = find_child(cur, comp);
+        // Only the last component needs pinning
+        const char *rest = path;
+        while (*rest == '/') rest++;
+        fs_node_t *child = lookup_child_pin(cur, comp, pin && !*rest);
         if (!child) return 0;
+        if (pin && !*rest) return child;
         cur = child;
     }
 
+    // Path ended in ".", ".." or named the starting directory itself
+    if (pin) fs_node_get(cur);
     return cur;
 }
 
+fs_node_t *fs_resolve(const char *path) {
+    return walk_path(path, 0);
+}
+
+fs_node_t *fs_resolve_get(const char *path) {
+    return walk_path(path, 1);
+}
+
 fs_node_t *fs_mkdir(const char *path) {
     char basename[FS_NAME_MAX];
     fs_node_t *parent = resolve_parent(path, basename);
 
     if (!parent || parent->type != FS_DIR) {
+        if (parent) fs_node_put(parent);
         uart_puts("mkdir: parent directory not found\n");
         return 0;
     }
 
     if (basename[0] == '\0') {
+        fs_node_put(parent);
         uart_puts("mkdir: missing directory name\n");
         return 0;
     }
 
-    if (find_child(parent, basename)) {
+    int existed;
+    fs_node_t *dir = create_child(parent, basename, FS_DIR, &existed, 0);
+    fs_node_put(parent);
+    if (existed) {
         uart_puts("mkdir: '");
         uart_puts(basename);
         uart_puts("' already exists\n");
         return 0;
     }
-
-    fs_node_t *dir = alloc_node(basename, FS_DIR);
-    if (!dir) return 0;
-    add_child(parent, dir);
     return dir;
 }
 
-int fs_rmdir(const char *path) {
-    fs_node_t *node = fs_resolve(path);
-    if (!node) {
-        uart_puts("rmdir: not found\n");
-        return -1;
-    }
+// Unlink an empty directory. node is pinned by the caller, so a racing
+// rmdir can't free it before we lock it; the caller's put frees it.
+static int rmdir_node(fs_node_t *node) {
     if (node->type != FS_DIR) {
         uart_puts("rmdir: not a directory\n");
         return -1;
@@ -266,78 +1426,158 @@ int fs_rmdir(const char *path) {
         uart_puts("rmdir: cannot remove root\n");
         return -1;
     }
-    if (node->children) {
-        uart_puts("rmdir: directory not empty\n");
+    if (node->flags & FS_NODE_EXT) {
+        uart_puts("rmdir: read-only filesystem\n");
         return -1;
     }
-    if (node == cwd) {
-        // Move cwd to parent before removing
-        cwd = node->parent;
+
+    // Lock order is always parent before child
+    fs_node_t *parent = node->parent;
+    if (!parent) return -1;  // Already unlinked by another task
+    fs_write_lock(&parent->lock);
+    fs_write_lock(&node->lock);
+    int err = 0;
+    if (node->parent != parent) {
+        uart_puts("rmdir: not found\n");  // Removed under us
+        err = -1;
+    } else if (node->children) {
+        uart_puts("rmdir: directory not empty\n");
+        err = -1;
+    } else {
+        // A task whose cwd it is keeps it alive (see fs_set_cwd)
+        remove_child(parent, node);
+        dcache_purge_dir(node);
     }
-    remove_child(node->parent, node);
-    free_node(node);
-    return 0;
+    fs_write_unlock(&node->lock);
+    fs_write_unlock(&parent->lock);
+    return err;
+}
+
+int fs_rmdir(const char *path) {
+    fs_node_t *node = fs_resolve_get(path);
+    if (!node) {
+        uart_puts("rmdir: not found\n");
+        return -1;
+    }
+    int err = rmdir_node(node);
+    fs_node_put(node);  // Frees it if unlinked and unused
+    return err;
 }
 
 fs_node_t *fs_touch(const char *path) {
     // If file already exists, just return it
-    fs_node_t *existing = fs_resolve(path);
-    if (existing) return existing;
+    fs_node_t *node = open_or_create(path, "touch");
+    if (!node) return 0;
+    int is_file = node->type == FS_FILE;
+    fs_node_put(node);
+    if (!is_file) {
+        uart_puts("touch: not a file\n");
+        return 0;
+    }
+    return node;
+}
+
+fs_node_t *fs_create_get(const char *path) {
+    return open_or_create(path, "open");
+}
 
+fs_node_t *fs_mkfifo(const char *path) {
     char basename[FS_NAME_MAX];
     fs_node_t *parent = resolve_parent(path, basename);
 
     if (!parent || parent->type != FS_DIR) {
-        uart_puts("touch: parent directory not found\n");
+        if (parent) fs_node_put(parent);
+        uart_puts("mkfifo: parent directory not found\n");
         return 0;
     }
-
     if (basename[0] == '\0') {
-        uart_puts("touch: missing filename\n");
+        fs_node_put(parent);
+        uart_puts("mkfifo: missing name\n");
         return 0;
     }
 
-    fs_node_t *file = alloc_node(basename, FS_FILE);
-    if (!file) return 0;
-    add_child(parent, file);
-    return file;
+    int existed;
+    fs_node_t *fifo = create_child(parent, basename, FS_FIFO, &existed, 0);
+    fs_node_put(parent);
+    if (existed) {
+        uart_puts("mkfifo: '");
+        uart_puts(basename);
+        uart_puts("' already exists\n");
+        return 0;
+    }
+    return fifo;
+}
+
+fs_node_t *fs_pipe_create(void) {
+    fs_node_t *node = alloc_node("pipe", FS_FIFO);
+    if (!node) return 0;
+    if (!(node->pipe = pipe_create())) {
+        free_node(node);
+        return 0;
+    }
+    fs_node_get(node);
+    return node;
 }
 
 fs_node_t *fs_write(const char *path, const char *content) {
     // Create file if it doesn't exist
-    fs_node_t *file = fs_resolve(path);
-    if (!file) {
-        file = fs_touch(path);
-        if (!file) return 0;
-    }
+    fs_node_t *file = open_or_create(path, "write");
+    if (!file) return 0;
 
+    const char *err = 0;
     if (file->type != FS_FILE) {
-        uart_puts("write: not a file\n");
-        return 0;
+        err = "write: not a file\n";
+    } else if (file->flags & (FS_NODE_XIP | FS_NODE_EXT)) {
+        err = "write: read-only file\n";
+    } else {
+        // One lock hold so readers never see the truncated-but-unwritten file
+        unsigned long len = fs_strlen(content);
+        fs_write_lock(&file->lock);
+        if (file_trunc(file, 0) < 0) {
+            err = "write: file is mapped\n";
+        } else {
+            long n = len > 0 ? file_write(file, 0, content, len) : 0;
+            if (n > 0 && (file->flags & FS_NODE_COMPRESS))
+                file_pack(file, (file->size - 1) >> FS_CHUNK_SHIFT);
+            if (n != (long)len) err = "write: allocation failed\n";
+        }
+        fs_write_unlock(&file->lock);
     }
 
-    // Free old content
-    if (file->data) {
-        kfree(file->data);
-        file->data = 0;
-        file->size = 0;
+    fs_node_put(file);
+    if (err) {
+        uart_puts(err);
+        return 0;
     }
+    return file;
+}
 
-    unsigned long len = fs_strlen(content);
-    if (len > FS_MAX_DATA) len = FS_MAX_DATA;
+// Point a file at bytes that already live in memory (no copy, no
+// allocation). Any previous content is dropped; the file becomes
+// read-only until removed.
+fs_node_t *fs_create_static(const char *path, const void *data, unsigned long size) {
+    fs_node_t *file = open_or_create(path, "xip");
+    if (!file) return 0;
 
-    if (len > 0) {
-        file->data = (char *)kmalloc(len + 1);
-        if (!file->data) {
-            uart_puts("write: allocation failed\n");
-            return 0;
-        }
-        for (unsigned long i = 0; i < len; i++)
-            file->data[i] = content[i];
-        file->data[len] = '\0';
-        file->size = len;
+    const char *err = 0;
+    if (file->type != FS_FILE || (file->flags & FS_NODE_EXT)) {
+        err = "xip: not a ramfs file\n";
+    } else if (file->maps) {
+        err = "xip: file is mapped\n";
+    } else {
+        fs_write_lock(&file->lock);
+        file_free_chunks(file, 0);
+        file->flags = (file->flags & ~(FS_NODE_COMPRESS | FS_NODE_INLINE)) | FS_NODE_XIP;
+        file->xip = (const char *)data;
+        file->size = size;
+        fs_write_unlock(&file->lock);
     }
 
+    fs_node_put(file);
+    if (err) {
+        uart_puts(err);
+        return 0;
+    }
     return file;
 }
 
@@ -346,15 +1586,75 @@ const char *fs_read(const char *path, unsigned long *size) {
     if (!file) return 0;
     if (file->type != FS_FILE) return 0;
     if (size) *size = file->size;
-    return file->data;
+    if (file->flags & FS_NODE_XIP) return file->xip;
+    if (file->flags & FS_NODE_INLINE) return file->idata;
+    if ((file->flags & FS_NODE_EXT) || file->size > FS_CHUNK_SIZE) return 0;
+    void **slot = chunk_slot(file, 0, 0);
+    if (!slot || ((unsigned long)*slot & CHUNK_Z)) return 0;
+    return (const char *)*slot;
 }
 
-int fs_rm(const char *path) {
-    fs_node_t *node = fs_resolve(path);
-    if (!node) {
-        uart_puts("rm: not found\n");
-        return -1;
+// The path helpers below pin the file for the whole operation, so an rm
+// on another core can't free it mid-copy (the aio workers use them).
+
+// Readers need an existing regular file (pinned, or 0)
+static fs_node_t *readable_file(const char *path) {
+    fs_node_t *file = fs_resolve_get(path);
+    if (file && file->type != FS_FILE) {
+        fs_node_put(file);
+        return 0;
     }
+    return file;
+}
+
+long fs_pread(const char *path, unsigned long off, void *buf, unsigned long len) {
+    fs_node_t *file = readable_file(path);
+    if (!file) return -1;
+    long n = fs_node_pread(file, off, buf, len);
+    fs_node_put(file);
+    return n;
+}
+
+// Writers create the file, like fs_write
+static fs_node_t *writable_file(const char *path, const char *who) {
+    fs_node_t *file = open_or_create(path, who);
+    if (file && file->type != FS_FILE) {
+        fs_node_put(file);
+        uart_puts(who);
+        uart_puts(": not a file\n");
+        return 0;
+    }
+    return file;
+}
+
+long fs_pwrite(const char *path, unsigned long off, const void *buf, unsigned long len) {
+    fs_node_t *file = writable_file(path, "pwrite");
+    if (!file) return -1;
+    long n = fs_node_pwrite(file, off, buf, len);
+    fs_node_flush(file);
+    fs_node_put(file);
+    return n;
+}
+
+long fs_append(const char *path, const void *buf, unsigned long len) {
+    fs_node_t *file = writable_file(path, "append");
+    if (!file) return -1;
+    long n = fs_node_append(file, buf, len);
+    fs_node_flush(file);
+    fs_node_put(file);
+    return n;
+}
+
+int fs_truncate(const char *path, unsigned long size) {
+    fs_node_t *file = readable_file(path);
+    if (!file) return -1;
+    int rc = fs_node_truncate(file, size);
+    fs_node_put(file);
+    return rc;
+}
+
+// Unlink a file. Pinned by the caller, as rmdir_node.
+static int rm_node(fs_node_t *node) {
     if (node->type == FS_DIR) {
         uart_puts("rm: is a directory (use rmdir)\n");
         return -1;
@@ -363,15 +1663,135 @@ int fs_rm(const char *path) {
         uart_puts("rm: cannot remove root\n");
         return -1;
     }
-    remove_child(node->parent, node);
-    free_node(node);
+    if (node->flags & FS_NODE_EXT) {
+        uart_puts("rm: read-only filesystem\n");
+        return -1;
+    }
+
+    fs_node_t *parent = node->parent;
+    if (!parent) return -1;  // Already unlinked by another task
+    fs_write_lock(&parent->lock);
+    int err = 0;
+    if (node->parent != parent) {
+        uart_puts("rm: not found\n");  // Removed under us
+        err = -1;
+    } else {
+        remove_child(parent, node);
+    }
+    fs_write_unlock(&parent->lock);
+    return err;
+}
+
+int fs_rm(const char *path) {
+    fs_node_t *node = fs_resolve_get(path);
+    if (!node) {
+        uart_puts("rm: not found\n");
+        return -1;
+    }
+    int err = rm_node(node);
+    fs_node_put(node);  // Frees it if unlinked and unused
+    return err;
+}
+
+static void fill_dirent(fs_dirent_t *e, const fs_node_t *node) {
+    fs_strcpy(e->name, node->name);
+    e->type = node->type;
+    e->flags = node->flags;
+    e->size = node->size;
+    e->stored = node->stored;
+}
+
+int fs_stat(const char *path, fs_dirent_t *st) {
+    fs_node_t *node = fs_resolve_get(path);
+    if (!node) return -1;
+    fs_read_lock(&node->lock);
+    fill_dirent(st, node);
+    fs_read_unlock(&node->lock);
+    fs_node_put(node);
     return 0;
 }
 
-void fs_ls(const char *path) {
+int fs_readdir(fs_node_t *dir, fs_dir_cursor_t *cursor, fs_dirent_t *ents, int n) {
+    if (!dir || dir->type != FS_DIR) return -1;
+    if (dir_load(dir) < 0) return -1;
+
+    fs_read_lock(&dir->lock);
+
+    // Resume from the saved node if the directory hasn't changed since;
+    // otherwise skip pos entries from the start.
+    fs_node_t *child;
+    if (cursor->pos == 0) {
+        child = dir->children;
+    } else if (cursor->gen == dir->gen) {
+        child = cursor->next;
+    } else {
+        child = dir->children;
+        for (unsigned long i = 0; child && i < cursor->pos; i++)
+            child = child->next_sibling;
+    }
+
+    int count = 0;
+    while (child && count < n) {
+        fill_dirent(&ents[count++], child);
+        child = child->next_sibling;
+    }
+
+    cursor->pos += count;
+    cursor->gen = dir->gen;
+    cursor->next = child;
+    fs_read_unlock(&dir->lock);
+    return count;
+}
+
+// Print num/den as "N.Nx"
+static void put_ratio(unsigned long num, unsigned long den) {
+    unsigned long r = den ? num * 10 / den : 0;
+    uart_put_dec(r / 10);
+    uart_putc('.');
+    uart_put_dec(r % 10);
+    uart_putc('x');
+}
+
+static void ls_print(const fs_dirent_t *e, int long_fmt) {
+    uart_puts("  ");
+    uart_puts(e->name);
+    if (e->type == FS_DIR) {
+        uart_puts((long_fmt && (e->flags & FS_NODE_COMPRESS)) ? "/  (lz4)\n" : "/\n");
+        return;
+    }
+    if (e->type == FS_FIFO) {
+        uart_puts("  (fifo)\n");
+        return;
+    }
+    uart_puts("  (");
+    uart_put_dec(e->size);
+    if (e->flags & FS_NODE_XIP) {
+        uart_puts(" bytes, xip)\n");
+        return;
+    }
+    if (e->flags & FS_NODE_EXT) {
+        uart_puts(" bytes)\n");
+        return;
+    }
+    uart_puts(" bytes");
+    if (long_fmt && (e->flags & FS_NODE_INLINE)) {
+        uart_puts(", inline");
+    } else if (long_fmt) {
+        uart_puts(", ");
+        uart_put_dec(e->stored);
+        uart_puts(" stored");
+        if ((e->flags & FS_NODE_COMPRESS) && e->stored) {
+            uart_puts(", lz4 ");
+            put_ratio(e->size, e->stored);
+        }
+    }
+    uart_puts(")\n");
+}
+
+void fs_ls(const char *path, int long_fmt) {
     fs_node_t *dir;
     if (!path || path[0] == '\0')
-        dir = cwd;
+        dir = fs_get_cwd();
     else
         dir = fs_resolve(path);
 
@@ -380,36 +1800,456 @@ void fs_ls(const char *path) {
         return;
     }
 
-    if (dir->type == FS_FILE) {
+    if (dir->type != FS_DIR) {
         // ls on a file: just show the file
-        uart_puts(dir->name);
-        uart_puts("  (");
-        uart_put_dec(dir->size);
-        uart_puts(" bytes)\n");
+        fs_dirent_t e;
+        fill_dirent(&e, dir);
+        ls_print(&e, long_fmt);
         return;
     }
 
-    // List children
-    fs_node_t *child = dir->children;
-    if (!child) {
+    // List children in batches; printing happens outside the dir lock
+    fs_dirent_t ents[8];
+    fs_dir_cursor_t cur = {0};
+    int n, total = 0;
+    while ((n = fs_readdir(dir, &cur, ents, 8)) > 0) {
+        for (int i = 0; i < n; i++)
+            ls_print(&ents[i], long_fmt);
+        total += n;
+    }
+    if (total == 0)
         uart_puts("(empty)\n");
-        return;
+}
+
+int fs_set_compress(const char *path, int on) {
+    fs_node_t *node = fs_resolve_get(path);
+    if (!node) {
+        uart_puts("compress: not found\n");
+        return -1;
     }
 
-    while (child) {
-        if (child->type == FS_DIR) {
-            uart_puts("  ");
-            uart_puts(child->name);
-            uart_puts("/\n");
+    int rc = 0;
+    fs_write_lock(&node->lock);
+    if (node->flags & (FS_NODE_XIP | FS_NODE_EXT)) {
+        uart_puts("compress: read-only file\n");
+        rc = -1;
+    } else if (on) {
+        node->flags |= FS_NODE_COMPRESS;
+        if (node->type == FS_FILE) {
+            unsigned long n = (node->size + FS_CHUNK_SIZE - 1) >> FS_CHUNK_SHIFT;
+            for (unsigned long i = 0; i < n; i++)
+                file_pack(node, i);
+        }
+    } else {
+        if (node->type == FS_FILE) {
+            unsigned long n = (node->size + FS_CHUNK_SIZE - 1) >> FS_CHUNK_SHIFT;
+            for (unsigned long i = 0; i < n && rc == 0; i++) {
+                void **slot = chunk_slot(node, i, 0);
+                if (slot && ((unsigned long)*slot & CHUNK_Z))
+                    rc = chunk_unpack(node, slot);
+            }
+        }
+        if (rc == 0) node->flags &= ~FS_NODE_COMPRESS;
+        else uart_puts("compress: out of memory\n");
+    }
+    fs_write_unlock(&node->lock);
+    fs_node_put(node);
+    return rc;
+}
+
+int fs_checksum(const char *path, unsigned int *crc) {
+    fs_node_t *file = fs_resolve_get(path);
+    if (!file) {
+        uart_puts("cksum: not found\n");
+        return -1;
+    }
+    unsigned char *tmp = (unsigned char *)page_alloc();
+    int rc = -1;
+    if (file->type != FS_FILE) {
+        uart_puts("cksum: not a file\n");
+    } else if (!tmp) {
+        uart_puts("cksum: out of memory\n");
+    } else {
+        // Write lock: stale chunk CRCs are filled in on the way
+        fs_write_lock(&file->lock);
+        rc = file_checksum(file, crc, tmp);
+        fs_write_unlock(&file->lock);
+        if (rc < 0) uart_puts("cksum: read error\n");
+    }
+    if (tmp) page_free(tmp);
+    fs_node_put(file);
+    return rc;
+}
+
+void fs_set_verify(int on) {
+    verify_reads = on;
+}
+
+int fs_mount(const char *path, fs_ext_t *ext) {
+    fs_node_t *dir = fs_resolve(path);
+    if (!dir || dir->type != FS_DIR) {
+        uart_puts("mount: not a directory\n");
+        return -1;
+    }
+
+    int rc = 0;
+    fs_write_lock(&dir->lock);
+    if (dir == root || dir->children || (dir->flags & FS_NODE_EXT)) {
+        uart_puts("mount: mount point must be an empty directory\n");
+        rc = -1;
+    } else {
+        dir->ext = ext;
+        dir->flags = (dir->flags & ~(FS_NODE_COMPRESS | FS_NODE_LOADED)) | FS_NODE_EXT;
+        dcache_purge_dir(dir);      // Negative entries from before the mount
+    }
+    fs_write_unlock(&dir->lock);
+    return rc;
+}
+
+fs_node_t *fs_ext_add(fs_node_t *dir, const char *name, fs_node_type_t type,
+                      unsigned long size, fs_ext_t *ext) {
+    fs_node_t *node = find_child(dir, name, fs_hash(name));
+    if (node) return node;
+    node = alloc_node(name, type);
+    if (!node) return 0;
+    node->flags = FS_NODE_EXT;
+    node->ext = ext;
+    node->size = size;
+    add_child(dir, node);
+    return node;
+}
+
+// ---- Mappings ----
+//
+// While a file has mappings its chunks are neither packed nor freed
+// (shrinking is refused), so the page addresses handed out stay valid.
+// Shared writable mappings change pages behind the CRCs' back: their
+// chunks' CRCs go stale at map time and aren't cached again until the
+// last such mapping is gone.
+
+int fs_node_map(fs_node_t *file, unsigned long pgoff, unsigned long npages, int shared_write) {
+    int rc = 0;
+    fs_write_lock(&file->lock);
+    unsigned long end = pgoff + npages;
+    unsigned long last = (file->size + FS_CHUNK_SIZE - 1) >> FS_CHUNK_SHIFT;
+
+    if (file->type != FS_FILE || (file->flags & FS_NODE_EXT)) {
+        uart_puts("mmap: not a ramfs file\n");
+        rc = -1;
+    } else if (npages == 0 || end < pgoff || end > last) {
+        uart_puts("mmap: range is past the end of the file\n");
+        rc = -1;
+    } else if (file->flags & FS_NODE_XIP) {
+        if (shared_write || ((unsigned long)file->xip & (FS_CHUNK_SIZE - 1))) {
+            uart_puts("mmap: XIP file is read-only or not page-aligned\n");
+            rc = -1;
+        }
+    } else {
+        if ((file->flags & FS_NODE_INLINE) && inline_spill(file) < 0) rc = -1;
+        for (unsigned long idx = pgoff; rc == 0 && idx < end; idx++)
+            if (!file_chunk(file, idx, 1)) rc = -1;
+        if (rc < 0) uart_puts("mmap: out of memory\n");
+    }
+    if (rc == 0) {
+        file->maps++;
+        if (shared_write) file->wmaps++;
+    }
+    fs_write_unlock(&file->lock);
+    return rc;
+}
+
+void *fs_node_page(fs_node_t *file, unsigned long idx) {
+    if (file->flags & FS_NODE_XIP) return (void *)(file->xip + (idx << FS_CHUNK_SHIFT));
+    fs_read_lock(&file->lock);
+    void **slot = chunk_slot(file, idx, 0);
+    void *page = slot ? *slot : 0;
+    fs_read_unlock(&file->lock);
+    return page;
+}
+
+void fs_node_unmap(fs_node_t *file, int shared_write) {
+    fs_write_lock(&file->lock);
+    if (shared_write && --file->wmaps == 0) {
+        // Stores through the mapping may have landed past EOF in the
+        // last page; chunk tails are kept zero
+        unsigned long in = file->size & (FS_CHUNK_SIZE - 1);
+        void **slot = in ? chunk_slot(file, file->size >> FS_CHUNK_SHIFT, 0) : 0;
+        if (slot && *slot && !((unsigned long)*slot & CHUNK_Z))
+            fs_memset((char *)*slot + in, 0, FS_CHUNK_SIZE - in);
+    }
+    if (--file->maps == 0 && (file->flags & FS_NODE_COMPRESS) && file->size)
+        file_repack(file, 0, (file->size - 1) >> FS_CHUNK_SHIFT, 0);
+    fs_write_unlock(&file->lock);
+}
+
+// ---- Snapshot image ----
+//
+// A flat list of records in depth-first order. Each names its parent by
+// record number (0 = root, records count from 1), so the loader links
+// nodes without walking paths:
+//
+//   u32 parent, u8 type, u8 flags, u8 name length, name bytes
+//   files only: u32 size, then per chunk a u16 tag and its bytes:
+//     0               hole, reads as zeros (no bytes)
+//     SNAP_LZ4 | n    n bytes of LZ4 block
+//     n               the chunk's n raw bytes
+//
+// Integers are little-endian and nothing is padded.
+
+#define SNAP_DEPTH      64          // Deepest directory nesting saved
+#define SNAP_LZ4        0x8000U
+
+static int snap_put(unsigned char **p, unsigned char *end, unsigned long v, int bytes) {
+    if (end - *p < bytes) return -1;
+    for (int i = 0; i < bytes; i++, v >>= 8)
+        *(*p)++ = (unsigned char)v;
+    return 0;
+}
+
+// Caller has checked that bytes are left
+static unsigned long snap_get(const unsigned char **p, int bytes) {
+    unsigned long v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (unsigned long)*(*p)++ << (8 * i);
+    return v;
+}
+
+static int snap_zero(const unsigned char *buf, unsigned long n) {
+    const unsigned long *w = (const unsigned long *)buf;     // Page-aligned
+    unsigned long i;
+    for (i = 0; i < n / 8; i++)
+        if (w[i]) return 0;
+    for (i *= 8; i < n; i++)
+        if (buf[i]) return 0;
+    return 1;
+}
+
+// Append a file's size and chunks (caller holds the file's lock)
+static int snap_file(fs_node_t *file, unsigned char **p, unsigned char *end,
+                     unsigned char *tmp, void *work) {
+    if (snap_put(p, end, file->size, 4) < 0) return -1;
+    for (unsigned long off = 0; off < file->size; off += FS_CHUNK_SIZE) {
+        unsigned long n = file->size - off;
+        if (n > FS_CHUNK_SIZE) n = FS_CHUNK_SIZE;
+        if (end - *p < 2) return -1;
+        unsigned char *tag = *p;
+        *p += 2;
+
+        if (file_read(file, off, tmp, n) != (long)n) return -1;
+        unsigned long v = 0;
+        if (!snap_zero(tmp, n)) {
+            // Keep the packed form only if it is strictly smaller
+            unsigned long room = (unsigned long)(end - *p);
+            int z = lz4_compress(tmp, (int)n, *p, (int)(room < n ? room : n - 1), work);
+            if (z > 0) {
+                v = SNAP_LZ4 | (unsigned long)z;
+                *p += z;
+            } else {
+                if (room < n) return -1;
+                fs_memcpy(*p, tmp, n);
+                *p += n;
+                v = n;
+            }
+        }
+        tag[0] = (unsigned char)v;
+        tag[1] = (unsigned char)(v >> 8);
+    }
+    return 0;
+}
+
+long fs_snapshot(void *buf, unsigned long cap, unsigned long *nodes) {
+    unsigned char *tmp = (unsigned char *)page_alloc();
+    void *work = page_alloc_n(LZ4_WORK_SIZE / PAGE_SIZE);
+    if (!tmp || !work) {
+        if (tmp) page_free(tmp);
+        if (work) page_free_n(work, LZ4_WORK_SIZE / PAGE_SIZE);
+        uart_puts("snapshot: out of memory\n");
+        return -1;
+    }
+
+    // Directories being listed, root first. Each stays read-locked until
+    // its last child is written, so the image is one consistent tree.
+    struct {
+        fs_node_t *dir;
+        fs_node_t *next;            // Next child to write
+        unsigned long rec;          // The directory's record number
+    } stack[SNAP_DEPTH];
+    unsigned char *p = (unsigned char *)buf, *end = p + cap;
+    unsigned long nrec = 0;
+    int sp = 0, rc = 0;
+
+    fs_read_lock(&root->lock);
+    stack[sp].dir = root;
+    stack[sp].next = root->children;
+    stack[sp++].rec = 0;
+    while (sp > 0) {
+        fs_node_t *node = stack[sp - 1].next;
+        if (!node || rc < 0) {
+            fs_read_unlock(&stack[--sp].dir->lock);
+            continue;
+        }
+        stack[sp - 1].next = node->next_sibling;
+        if (node->flags & (FS_NODE_XIP | FS_NODE_EXT)) continue;
+        if (node->type == FS_DIR && sp == SNAP_DEPTH) {
+            rc = -2;
+            continue;
+        }
+
+        int len = fs_strlen(node->name);
+        if (snap_put(&p, end, stack[sp - 1].rec, 4) < 0 ||
+            snap_put(&p, end, node->type, 1) < 0 ||
+            snap_put(&p, end, node->flags & FS_NODE_COMPRESS, 1) < 0 ||
+            snap_put(&p, end, (unsigned long)len, 1) < 0 || end - p < len) {
+            rc = -1;
+            continue;
+        }
+        fs_memcpy(p, node->name, (unsigned long)len);
+        p += len;
+        nrec++;
+
+        if (node->type == FS_FILE) {
+            fs_read_lock(&node->lock);
+            rc = snap_file(node, &p, end, tmp, work);
+            fs_read_unlock(&node->lock);
+        } else if (node->type == FS_DIR) {
+            fs_read_lock(&node->lock);
+            stack[sp].dir = node;
+            stack[sp].next = node->children;
+            stack[sp++].rec = nrec;
+        }
+    }
+
+    page_free(tmp);
+    page_free_n(work, LZ4_WORK_SIZE / PAGE_SIZE);
+    if (rc < 0) {
+        uart_puts(rc == -2 ? "snapshot: directories nested too deep\n"
+                           : "snapshot: image too large\n");
+        return -1;
+    }
+    *nodes = nrec;
+    return (long)(p - (unsigned char *)buf);
+}
+
+// Fill a new (unlinked) file from its record
+static int snap_restore_file(fs_node_t *file, const unsigned char **pp,
+                             const unsigned char *end, unsigned char *tmp) {
+    const unsigned char *p = *pp;
+    if (end - p < 4) return -1;
+    unsigned long size = snap_get(&p, 4);
+    if (size > FS_MAX_FILE) return -1;
+
+    for (unsigned long off = 0; off < size; off += FS_CHUNK_SIZE) {
+        unsigned long n = size - off;
+        if (n > FS_CHUNK_SIZE) n = FS_CHUNK_SIZE;
+        if (end - p < 2) return -1;
+        unsigned long tag = snap_get(&p, 2);
+        const void *src;
+        if (tag == 0) continue;
+        if (tag & SNAP_LZ4) {
+            unsigned long z = tag & ~SNAP_LZ4;
+            if ((unsigned long)(end - p) < z ||
+                lz4_decompress(p, (int)z, tmp, (int)n) != (int)n) return -1;
+            src = tmp;
+            p += z;
         } else {
-            uart_puts("  ");
-            uart_puts(child->name);
-            uart_puts("  (");
-            uart_put_dec(child->size);
-            uart_puts(" bytes)\n");
+            if (tag != n || (unsigned long)(end - p) < n) return -1;
+            src = p;
+            p += n;
         }
-        child = child->next_sibling;
+        if (file_write(file, off, src, n) != (long)n) return -1;
+    }
+    if (file->size < size && file_trunc(file, size) < 0) return -1;  // Trailing hole
+    if (size && (file->flags & FS_NODE_COMPRESS))
+        file_pack(file, (size - 1) >> FS_CHUNK_SHIFT);
+    *pp = p;
+    return 0;
+}
+
+int fs_restore(const void *img, unsigned long len, unsigned long nodes) {
+    if (root->children) {
+        uart_puts("restore: filesystem not empty\n");
+        return -1;
+    }
+    if (nodes == 0) return 0;
+
+    // Record number -> node, for the directories records link into
+    unsigned int tpages = (unsigned int)(((nodes + 1) * sizeof(fs_node_t *) +
+                                          PAGE_SIZE - 1) / PAGE_SIZE);
+    fs_node_t **table = (fs_node_t **)page_alloc_n(tpages);
+    unsigned char *tmp = (unsigned char *)page_alloc();
+    fs_node_t *list = alloc_nodes(nodes);
+    if (!table || !tmp || !list) {
+        if (table) page_free_n(table, tpages);
+        if (tmp) page_free(tmp);
+        free_nodes(list);
+        uart_puts("restore: out of memory\n");
+        return -1;
+    }
+
+    const unsigned char *p = (const unsigned char *)img, *end = p + len;
+    unsigned long rec;
+    table[0] = root;
+    for (rec = 1; rec <= nodes; rec++) {
+        if (end - p < 7) break;
+        unsigned long parent = snap_get(&p, 4);
+        unsigned long type = snap_get(&p, 1);
+        unsigned long flags = snap_get(&p, 1);
+        unsigned long nlen = snap_get(&p, 1);
+        if (parent >= rec || !table[parent] || type > FS_FIFO ||
+            nlen == 0 || nlen >= FS_NAME_MAX || (unsigned long)(end - p) < nlen)
+            break;
+        char name[FS_NAME_MAX];
+        fs_memcpy(name, p, nlen);
+        name[nlen] = '\0';
+        p += nlen;
+
+        fs_node_t *node = list;
+        list = list->hash_next;
+        node_init(node, name, (fs_node_type_t)type);
+        node->flags = flags & FS_NODE_COMPRESS;
+        table[rec] = (type == FS_DIR) ? node : 0;
+
+        int bad = 0;
+        if (type == FS_FILE)
+            bad = snap_restore_file(node, &p, end, tmp) < 0;
+        else if (type == FS_FIFO)
+            bad = !(node->pipe = pipe_create());
+        if (bad) {
+            free_node(node);
+            break;
+        }
+
+        fs_node_t *dir = table[parent];
+        fs_write_lock(&dir->lock);
+        add_child(dir, node);
+        fs_write_unlock(&dir->lock);
     }
+
+    // Children were saved in list order and add_child() prepends: flip
+    // each list back so listings come out as they did before the save
+    for (unsigned long i = 0; i < rec; i++) {
+        fs_node_t *dir = table[i];
+        if (!dir) continue;
+        fs_write_lock(&dir->lock);
+        fs_node_t *prev = 0, *c = dir->children;
+        while (c) {
+            fs_node_t *next = c->next_sibling;
+            c->next_sibling = prev;
+            prev = c;
+            c = next;
+        }
+        dir->children = prev;
+        fs_write_unlock(&dir->lock);
+    }
+
+    free_nodes(list);
+    page_free(tmp);
+    page_free_n(table, tpages);
+    if (rec <= nodes) {
+        uart_puts("restore: damaged image or out of memory\n");
+        return -1;
+    }
+    return 0;
 }
 
 void fs_get_path(fs_node_t *node, char *buf, int bufsize) {
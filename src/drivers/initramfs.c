@@ -0,0 +1,164 @@
+// initramfs.c - Unpack a newc cpio archive into the ramfs at boot
+//
+// newc layout: a 110-byte ASCII header ("070701" + 13 fields of 8 hex
+// digits), the NUL-terminated name padded to 4 bytes, then the file data
+// padded to 4 bytes. The archive ends with an entry named "TRAILER!!!".
+//
+// Directories and regular files are imported; everything else (symlinks,
+// device nodes) is counted and skipped. File data is not copied: each
+// file becomes an XIP node pointing into the archive, which stays
+// resident (.rodata of the image, or the initrd region above the heap).
+
+#include "initramfs.h"
+#include "fs.h"
+#include "uart.h"
+#include "fdt.h"
+
+// Provided by linker.ld around the .initramfs section
+extern const char __initramfs_start[];
+extern const char __initramfs_end[];
+
+#define CPIO_HDR_SIZE   110
+
+#define CPIO_MODE_MASK  0170000
+#define CPIO_MODE_DIR   0040000
+#define CPIO_MODE_REG   0100000
+
+// Header field offsets (each 8 hex digits)
+#define CPIO_F_MODE     14
+#define CPIO_F_FILESIZE 54
+#define CPIO_F_NAMESIZE 94
+
+// ---- Helpers ----
+
+static int parse_hex8(const char *p, unsigned long *out) {
+    unsigned long v = 0;
+    for (int i = 0; i < 8; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')      v |= (unsigned long)(c - '0');
+        else if (c >= 'a' && c <= 'f') v |= (unsigned long)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v |= (unsigned long)(c - 'A' + 10);
+        else return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static unsigned long align4(unsigned long x) {
+    return (x + 3) & ~3UL;
+}
+
+static int name_is(const char *a, const char *b) {
+    while (*a && *a == *b) { a++; b++; }
+    return *a == *b;
+}
+
+// ---- Archive walker ----
+
+int initramfs_load(const void *archive, unsigned long size, initramfs_stats_t *stats) {
+    const char *base = (const char *)archive;
+    unsigned long off = 0;
+    char path[FS_PATH_MAX];
+
+    while (off + CPIO_HDR_SIZE <= size) {
+        const char *hdr = base + off;
+        if (hdr[0] != '0' || hdr[1] != '7' || hdr[2] != '0' || hdr[3] != '7' ||
+            hdr[4] != '0' || (hdr[5] != '1' && hdr[5] != '2'))
+            return -1;
+
+        unsigned long mode, filesize, namesize;
+        if (parse_hex8(hdr + CPIO_F_MODE, &mode) < 0 ||
+            parse_hex8(hdr + CPIO_F_FILESIZE, &filesize) < 0 ||
+            parse_hex8(hdr + CPIO_F_NAMESIZE, &namesize) < 0)
+            return -1;
+
+        const char *name = hdr + CPIO_HDR_SIZE;
+        unsigned long data_off = align4(off + CPIO_HDR_SIZE + namesize);
+        if (namesize == 0 || data_off > size || filesize > size - data_off)
+            return -1;
+        if (name[namesize - 1] != '\0') return -1;
+        off = align4(data_off + filesize);
+
+        if (name_is(name, "TRAILER!!!")) return 0;
+
+        // Archive names are relative ("./etc/x" or "etc/x"); root them
+        while (name[0] == '.' && name[1] == '/') name += 2;
+        while (name[0] == '/') name++;
+        if (name[0] == '\0' || name_is(name, ".")) continue;
+
+        int len = 0;
+        path[len++] = '/';
+        while (*name && len < FS_PATH_MAX - 1) path[len++] = *name++;
+        path[len] = '\0';
+        if (*name) { if (stats) stats->skipped++; continue; }  // Path too long
+
+        if ((mode & CPIO_MODE_MASK) == CPIO_MODE_DIR) {
+            fs_node_t *node = fs_resolve(path);
+            if (!node) node = fs_mkdir(path);
+            if (node && node->type == FS_DIR && stats) stats->dirs++;
+        } else if ((mode & CPIO_MODE_MASK) == CPIO_MODE_REG) {
+            if (!fs_create_static(path, base + data_off, filesize)) {
+                uart_puts("[initramfs] cannot create ");
+                uart_puts(path);
+                uart_puts("\n");
+                return -1;
+            }
+            if (stats) { stats->files++; stats->bytes += filesize; }
+        } else if (stats) {
+            stats->skipped++;
+        }
+    }
+    return 0;
+}
+
+// ---- Device tree lookup ----
+
+const void *initramfs_find_initrd(unsigned long dtb, unsigned long *size) {
+    unsigned int len;
+    const void *val = fdt_chosen(dtb, "linux,initrd-start", &len);
+    unsigned long start = val ? fdt_cell(val, len) : 0;
+    val = fdt_chosen(dtb, "linux,initrd-end", &len);
+    unsigned long stop = val ? fdt_cell(val, len) : 0;
+
+    if (!start || stop <= start) return 0;
+    if (size) *size = stop - start;
+    return (const void *)start;
+}
+
+// ---- Boot entry ----
+
+static void report(const char *what, int rc, initramfs_stats_t *st) {
+    uart_puts("  ");
+    uart_puts(what);
+    uart_puts(": ");
+    uart_put_dec(st->files);
+    uart_puts(" files, ");
+    uart_put_dec(st->dirs);
+    uart_puts(" dirs, ");
+    uart_put_dec(st->bytes);
+    uart_puts(" bytes");
+    if (st->skipped) {
+        uart_puts(" (");
+        uart_put_dec(st->skipped);
+        uart_puts(" skipped)");
+    }
+    if (rc < 0) uart_puts(" - archive truncated or corrupt");
+    uart_puts("\n");
+}
+
+void initramfs_init(unsigned long dtb) {
+    unsigned long size = (unsigned long)(__initramfs_end - __initramfs_start);
+    if (size > 0) {
+        initramfs_stats_t st = { 0, 0, 0, 0 };
+        int rc = initramfs_load(__initramfs_start, size, &st);
+        report("initramfs", rc, &st);
+    }
+
+    const void *initrd = initramfs_find_initrd(dtb, &size);
+    if (initrd) {
+        initramfs_stats_t st = { 0, 0, 0, 0 };
+        int rc = initramfs_load(initrd, size, &st);
+        report("initrd", rc, &st);
+    }
+}
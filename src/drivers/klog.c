@@ -0,0 +1,150 @@
+// klog.c - Kernel log: per-core lock-free rings, drained to the UART
+//
+// Each core's ring has a single producer, that core: klog() masks IRQs
+// for the few stores it does, so a preempting IRQ or task switch can't
+// interleave with it. The drain is the single consumer (drain_lock
+// serializes taking records, between klogd and klog_flush). Indices
+// are free-running:
+//   - the producer fills rec[head], then publishes it by storing
+//     seq = head + 1 after a write barrier, then advances head
+//   - the consumer takes rec[tail] once its seq says it is published,
+//     and advances tail only after copying it out, with a full barrier,
+//     so the producer never overwrites a record still being read
+// A record whose seq doesn't match is still being written; the drain
+// stops at it and picks the ring up again next pass.
+
+#include "klog.h"
+#include "uart.h"
+#include "task.h"
+#include "timer.h"
+#include "smp.h"
+#include "kprintf.h"
+
+typedef struct {
+    volatile unsigned long seq;     // Index + 1 once published
+    unsigned long stamp;            // CNTPCT at klog()
+    unsigned int len;
+    char text[KLOG_TEXT];
+} klog_rec_t;
+
+typedef struct {
+    volatile unsigned long head;    // Producer
+    volatile unsigned long tail;    // Consumer
+    unsigned long dropped;
+    klog_rec_t rec[KLOG_RECORDS];
+} klog_ring_t;
+
+static klog_ring_t rings[NUM_CORES];
+static spinlock_t drain_lock = SPINLOCK_INIT;
+
+#define KLOG_PERIOD_MS  100         // klogd wakeup interval
+#define KLOG_PREFIX     40          // Room for "[sssss.uuuuuu] c: "
+
+// ---- Producer ----
+
+void klog(const char *msg) {
+    unsigned long daif;
+    asm volatile("mrs %0, daif" : "=r"(daif));
+    asm volatile("msr daifset, #2" ::: "memory");
+
+    klog_ring_t *r = &rings[smp_core_id()];
+    unsigned long head = r->head;
+    if (head - r->tail >= KLOG_RECORDS) {
+        r->dropped++;
+    } else {
+        klog_rec_t *rec = &r->rec[head % KLOG_RECORDS];
+        asm volatile("mrs %0, cntpct_el0" : "=r"(rec->stamp));
+        unsigned int n = 0;
+        while (msg[n] && n < KLOG_TEXT) {
+            rec->text[n] = msg[n];
+            n++;
+        }
+        if (n && rec->text[n - 1] == '\n') n--;
+        rec->len = n;
+        smp_wmb();                  // Record before seq
+        rec->seq = head + 1;
+        r->head = head + 1;
+    }
+    asm volatile("msr daif, %0" :: "r"(daif) : "memory");
+}
+
+void klogf(const char *fmt, ...) {
+    char msg[KLOG_TEXT + 1];
+    va_list ap;
+    va_start(ap, fmt);
+    kvsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    klog(msg);
+}
+
+// ---- Consumer ----
+
+// Take the published record with the oldest stamp into line (as text
+// with its prefix). Returns 0 if every ring is empty.
+static int klog_take(char *line) {
+    unsigned long irq = spin_lock_irqsave(&drain_lock);
+    klog_ring_t *from = 0;
+    klog_rec_t *best = 0;
+    for (unsigned int c = 0; c < NUM_CORES; c++) {
+        klog_ring_t *r = &rings[c];
+        klog_rec_t *rec = &r->rec[r->tail % KLOG_RECORDS];
+        if (rec->seq != r->tail + 1) continue;
+        smp_rmb();                  // seq before the record
+        if (!best || rec->stamp < best->stamp) {
+            best = rec;
+            from = r;
+        }
+    }
+    if (best) {
+        unsigned long freq = timer_get_frequency();
+        unsigned long usec = (best->stamp % freq) * 1000000 / freq;
+        unsigned int n = (unsigned int)ksnprintf(line, KLOG_PREFIX + 1, "[%5lu.%06lu] %u: ",
+                                                 best->stamp / freq, usec,
+                                                 (unsigned int)(from - rings));
+        for (unsigned int i = 0; i < best->len; i++) line[n++] = best->text[i];
+        line[n++] = '\n';
+        line[n] = '\0';
+        asm volatile("dmb ish" ::: "memory");   // Copied out before the slot is freed
+        from->tail++;
+    }
+    spin_unlock_irqrestore(&drain_lock, irq);
+    return best != 0;
+}
+
+// Write out published records, oldest first; the UART is written
+// without drain_lock held. Returns how many.
+static int klog_drain(void) {
+    char line[KLOG_PREFIX + KLOG_TEXT + 2];
+    int count = 0;
+    while (klog_take(line)) {
+        uart_puts(line);
+        count++;
+    }
+    return count;
+}
+
+static void klogd(void) {
+    while (1) {
+        klog_drain();
+        task_sleep(KLOG_PERIOD_MS);
+    }
+}
+
+// ---- Public API ----
+
+void klog_init(void) {
+    task_create(klogd, "klogd");
+}
+
+void klog_flush(void) {
+    klog_drain();
+    uart_flush();
+}
+
+void klog_stats(unsigned int core, klog_stats_t *st) {
+    klog_ring_t *r = &rings[core < NUM_CORES ? core : 0];
+    unsigned long head = r->head, tail = r->tail;
+    st->logged = head;
+    st->dropped = r->dropped;
+    st->pending = (unsigned int)(head - tail);
+}
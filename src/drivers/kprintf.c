@@ -0,0 +1,235 @@
+// kprintf.c - Formatted output
+//
+// One formatter, two sinks: ksnprintf fills the caller's buffer and
+// counts what didn't fit; kprintf fills a stack buffer and hands it to
+// the UART each time it fills up, and once at the end.
+
+#include "kprintf.h"
+#include "uart.h"
+
+#define KPRINTF_BUF     256
+
+typedef struct {
+    char *buf;
+    unsigned long size;         // Room for text (excluding the NUL)
+    unsigned long pos;          // Bytes in buf
+    unsigned long total;        // Bytes produced
+    int to_uart;                // Flush to the UART when full (kprintf)
+} kout_t;
+
+static void out_flush(kout_t *o) {
+    o->buf[o->pos] = '\0';
+    uart_puts(o->buf);
+    o->pos = 0;
+}
+
+static void out_char(kout_t *o, char c) {
+    o->total++;
+    if (o->pos == o->size) {
+        if (!o->to_uart) return;
+        out_flush(o);
+    }
+    o->buf[o->pos++] = c;
+}
+
+static void out_mem(kout_t *o, const char *s, unsigned long n) {
+    while (n--) out_char(o, *s++);
+}
+
+static void out_pad(kout_t *o, char c, int n) {
+    while (n-- > 0) out_char(o, c);
+}
+
+// ---- Integer conversion ----
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// v / 100 for any 64-bit v: (v / 4) * ceil(2^68 / 100) / 2^68, which
+// is exact because v / 4 < 2^62 (one umulh and two shifts, no udiv)
+static inline unsigned long div100(unsigned long v) {
+    return (unsigned long)(((unsigned __int128)(v >> 2) * 0x28F5C28F5C28F5C3UL) >> 66);
+}
+
+// Write the digits of v so they end just before end; return the first
+static char *fmt_dec(char *end, unsigned long v) {
+    char *p = end;
+    while (v >= 100) {
+        unsigned long q = div100(v);
+        unsigned int r = (unsigned int)(v - q * 100);
+        p -= 2;
+        p[0] = digit_pairs[2 * r];
+        p[1] = digit_pairs[2 * r + 1];
+        v = q;
+    }
+    if (v >= 10) {
+        p -= 2;
+        p[0] = digit_pairs[2 * v];
+        p[1] = digit_pairs[2 * v + 1];
+    } else {
+        *--p = (char)('0' + v);
+    }
+    return p;
+}
+
+static char *fmt_hex(char *end, unsigned long v, int upper, int min_digits) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char *p = end;
+    do {
+        *--p = digits[v & 0xF];
+        v >>= 4;
+        min_digits--;
+    } while (v || min_digits > 0);
+    return p;
+}
+
+// ---- Formatter ----
+
+#define F_LEFT      0x1
+#define F_ZERO      0x2
+#define F_ALT       0x4
+
+// Emit prefix (sign or 0x) and body in a field of width
+static void out_field(kout_t *o, const char *prefix, const char *body,
+                      int len, int width, int flags) {
+    int plen = 0;
+    while (prefix[plen]) plen++;
+    int pad = width - plen - len;
+
+    if (!(flags & (F_LEFT | F_ZERO))) out_pad(o, ' ', pad);
+    out_mem(o, prefix, (unsigned long)plen);
+    if ((flags & (F_LEFT | F_ZERO)) == F_ZERO) out_pad(o, '0', pad);
+    out_mem(o, body, (unsigned long)len);
+    if (flags & F_LEFT) out_pad(o, ' ', pad);
+}
+
+static void kformat(kout_t *o, const char *fmt, va_list ap) {
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+
+    while (*fmt) {
+        if (*fmt != '%') {
+            const char *run = fmt;
+            while (*fmt && *fmt != '%') fmt++;
+            out_mem(o, run, (unsigned long)(fmt - run));
+            continue;
+        }
+        fmt++;
+
+        int flags = 0;
+        for (;; fmt++) {
+            if (*fmt == '-') flags |= F_LEFT;
+            else if (*fmt == '0') flags |= F_ZERO;
+            else if (*fmt == '#') flags |= F_ALT;
+            else break;
+        }
+
+        int width = 0;
+        if (*fmt == '*') {
+            width = va_arg(ap, int);
+            if (width < 0) {
+                flags |= F_LEFT;
+                width = -width;
+            }
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9') width = width * 10 + (*fmt++ - '0');
+        }
+
+        int prec = -1;
+        if (*fmt == '.') {
+            fmt++;
+            prec = 0;
+            if (*fmt == '*') {
+                prec = va_arg(ap, int);
+                fmt++;
+            } else {
+                while (*fmt >= '0' && *fmt <= '9') prec = prec * 10 + (*fmt++ - '0');
+            }
+        }
+
+        int is_long = 0;
+        while (*fmt == 'l' || *fmt == 'z') {
+            is_long = 1;
+            fmt++;
+        }
+
+        char conv = *fmt;
+        if (!conv) break;
+        fmt++;
+
+        char *p;
+        switch (conv) {
+        case 'd':
+        case 'i': {
+            long v = is_long ? va_arg(ap, long) : va_arg(ap, int);
+            unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+            p = fmt_dec(end, u);
+            out_field(o, v < 0 ? "-" : "", p, (int)(end - p), width, flags);
+            break;
+        }
+        case 'u': {
+            unsigned long v = is_long ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+            p = fmt_dec(end, v);
+            out_field(o, "", p, (int)(end - p), width, flags);
+            break;
+        }
+        case 'x':
+        case 'X': {
+            unsigned long v = is_long ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+            p = fmt_hex(end, v, conv == 'X', 1);
+            out_field(o, (flags & F_ALT) ? "0x" : "", p, (int)(end - p), width, flags);
+            break;
+        }
+        case 'p':
+            p = fmt_hex(end, (unsigned long)va_arg(ap, void *), 1, 16);
+            out_field(o, "0x", p, 16, width, flags & ~F_ZERO);
+            break;
+        case 'c':
+            tmp[0] = (char)va_arg(ap, int);
+            out_field(o, "", tmp, 1, width, flags & ~F_ZERO);
+            break;
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            if (!s) s = "(null)";
+            int len = 0;
+            while (s[len] && (prec < 0 || len < prec)) len++;
+            out_field(o, "", s, len, width, flags & ~F_ZERO);
+            break;
+        }
+        default:                        // "%%", or an unknown conversion as is
+            out_char(o, conv);
+            break;
+        }
+    }
+}
+
+// ---- Public API ----
+
+int kvsnprintf(char *buf, unsigned long size, const char *fmt, va_list ap) {
+    kout_t o = { buf, size ? size - 1 : 0, 0, 0, 0 };
+    kformat(&o, fmt, ap);
+    if (size) buf[o.pos] = '\0';
+    return (int)o.total;
+}
+
+int ksnprintf(char *buf, unsigned long size, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = kvsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+int kprintf(const char *fmt, ...) {
+    char buf[KPRINTF_BUF];
+    kout_t o = { buf, sizeof(buf) - 1, 0, 0, 1 };
+    va_list ap;
+    va_start(ap, fmt);
+    kformat(&o, fmt, ap);
+    va_end(ap);
+    if (o.pos) out_flush(&o);
+    return (int)o.total;
+}
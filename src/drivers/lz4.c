@@ -0,0 +1,155 @@
+// lz4.c - LZ4 block compression
+//
+// A block is a run of sequences: a token byte (literal length in the high
+// nibble, match length - 4 in the low nibble, 15 meaning "more bytes
+// follow"), the literals, a 16-bit little-endian match offset and any
+// extra match-length bytes. The last sequence is literals only, and the
+// format requires the final 5 bytes to be literals and the last match to
+// start at least 12 bytes before the end.
+//
+// The compressor is the single-pass greedy one: hash the next 4 bytes,
+// check the one candidate the table remembers, extend on a hit. Misses
+// speed up the scan so incompressible data is skipped quickly.
+
+#include "lz4.h"
+
+#define MINMATCH     4
+#define LASTLITERALS 5
+#define MFLIMIT      12
+#define MAX_OFFSET   65535
+
+static unsigned int read32(const unsigned char *p) {
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+           ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned int lz4_hash(unsigned int v) {
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Emit a length continuation (after the 15 in the token)
+static unsigned char *put_len(unsigned char *op, unsigned int n) {
+    while (n >= 255) { *op++ = 255; n -= 255; }
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+int lz4_compress(const void *src, int len, void *dst, int cap, void *work) {
+    if (len < 0 || len > LZ4_MAX_INPUT) return 0;
+
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *iend = base + len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + cap;
+    unsigned short *table = (unsigned short *)work;
+
+    for (int i = 0; i < (1 << LZ4_HASH_BITS); i++) table[i] = 0;
+
+    if (len >= MFLIMIT + 1) {
+        const unsigned char *mflimit = iend - MFLIMIT;
+        const unsigned char *matchlimit = iend - LASTLITERALS;
+        unsigned int misses = 0;
+
+        ip++;
+        while (ip <= mflimit) {
+            unsigned int h = lz4_hash(read32(ip));
+            const unsigned char *ref = base + table[h];
+            table[h] = (unsigned short)(ip - base);
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            // Extend backwards over literals, then forwards
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) { ip--; ref--; }
+            const unsigned char *mp = ip + MINMATCH;
+            const unsigned char *rp = ref + MINMATCH;
+            while (mp < matchlimit && *mp == *rp) { mp++; rp++; }
+
+            unsigned int lit = (unsigned int)(ip - anchor);
+            unsigned int mlen = (unsigned int)(mp - ip) - MINMATCH;
+            if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend)
+                return 0;
+
+            unsigned char *token = op++;
+            if (lit >= 15) { *token = 15 << 4; op = put_len(op, lit - 15); }
+            else           { *token = (unsigned char)(lit << 4); }
+            for (unsigned int i = 0; i < lit; i++) *op++ = anchor[i];
+
+            unsigned int off = (unsigned int)(ip - ref);
+            *op++ = (unsigned char)off;
+            *op++ = (unsigned char)(off >> 8);
+
+            if (mlen >= 15) { *token |= 15; op = put_len(op, mlen - 15); }
+            else            { *token |= (unsigned char)mlen; }
+
+            ip = mp;
+            anchor = ip;
+            // Remember a position inside the match too: helps runs
+            table[lz4_hash(read32(ip - 2))] = (unsigned short)(ip - 2 - base);
+        }
+    }
+
+    // Final literals
+    unsigned int lit = (unsigned int)(iend - anchor);
+    if (op + 1 + lit / 255 + 1 + lit > oend) return 0;
+    unsigned char *token = op++;
+    if (lit >= 15) { *token = 15 << 4; op = put_len(op, lit - 15); }
+    else           { *token = (unsigned char)(lit << 4); }
+    for (unsigned int i = 0; i < lit; i++) *op++ = anchor[i];
+
+    return (int)(op - (unsigned char *)dst);
+}
+
+int lz4_decompress(const void *src, int len, void *dst, int cap) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + len;
+    unsigned char *out = (unsigned char *)dst;
+    unsigned char *op = out;
+    unsigned char *oend = out + cap;
+
+    while (ip < iend) {
+        unsigned int token = *ip++;
+
+        unsigned long lit = token >> 4;
+        if (lit == 15) {
+            unsigned int b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (unsigned long)(iend - ip) || lit > (unsigned long)(oend - op))
+            return -1;
+        for (unsigned long i = 0; i < lit; i++) *op++ = *ip++;
+
+        if (ip == iend) break;      // Last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        unsigned long off = (unsigned long)ip[0] | ((unsigned long)ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (unsigned long)(op - out)) return -1;
+
+        unsigned long mlen = token & 15;
+        if (mlen == 15) {
+            unsigned int b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += MINMATCH;
+        if (mlen > (unsigned long)(oend - op)) return -1;
+
+        // Byte at a time: the match may overlap what it produces
+        const unsigned char *ref = op - off;
+        for (unsigned long i = 0; i < mlen; i++) *op++ = *ref++;
+    }
+    return (int)(op - out);
+}
@@ -1,25 +1,37 @@
 // memory.c - Physical page allocator and kmalloc/kfree
 //
 // Layout:
-//   0x00080000 - ~0x000A4000  : Kernel + BSS + stack
+//   0x00080000 - __kernel_end : Kernel + initramfs + BSS + stack
 //   0x00100000 - 0x00100800   : Bitmap (2KB)
 //   0x00101000+               : Free pages (heap + allocatable)
+//
+// If the image grows past 1MB (a large linked-in initramfs), the bitmap
+// and pages move up to start at the first page above __kernel_end.
 
 #include "memory.h"
 #include "uart.h"
+#include "klog.h"
+#include "smp.h"
 
 #define MANAGED_SIZE    (64UL * 1024 * 1024)
 #define MANAGED_PAGES   (MANAGED_SIZE / PAGE_SIZE)
 #define BITMAP_SIZE     (MANAGED_PAGES / 8)
 
-// Place bitmap at 1MB — safely above kernel region
-#define BITMAP_ADDR     0x100000UL
+// Place bitmap at 1MB, or above the kernel if it doesn't fit below
+#define BITMAP_MIN_ADDR 0x100000UL
+
+extern char __kernel_end[];             // linker.ld
 
-static unsigned char *page_bitmap = (unsigned char *)BITMAP_ADDR;
+static unsigned char *page_bitmap = (unsigned char *)BITMAP_MIN_ADDR;
 
 static unsigned long first_free_page = 0;
 static unsigned long total_pages = MANAGED_PAGES;
 static unsigned long used_pages = 0;
+static unsigned long search_hint = 0;   // No free page below this index
+
+// Guards the bitmap and the kmalloc heap. IRQs are masked while held so
+// a preempted task can't stall other allocators on the same core.
+static spinlock_t mem_lock = SPINLOCK_INIT;
 
 static inline void bitmap_set(unsigned long local) {
     if (local < MANAGED_PAGES)
@@ -55,16 +67,20 @@ static unsigned char *heap_brk = 0;
 static block_header_t *free_list = 0;
 
 void memory_init(void) {
+    unsigned long bitmap_addr = ((unsigned long)__kernel_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (bitmap_addr < BITMAP_MIN_ADDR) bitmap_addr = BITMAP_MIN_ADDR;
+    page_bitmap = (unsigned char *)bitmap_addr;
+
     // Pages start after bitmap, page-aligned
-    unsigned long pages_start = (BITMAP_ADDR + BITMAP_SIZE + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    unsigned long pages_start = (bitmap_addr + BITMAP_SIZE + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     first_free_page = pages_start / PAGE_SIZE;
 
     // Quick test: can we write to the bitmap region?
-    volatile unsigned char *test = (volatile unsigned char *)BITMAP_ADDR;
+    volatile unsigned char *test = (volatile unsigned char *)bitmap_addr;
     test[0] = 0xAA;
     if (test[0] != 0xAA) {
         uart_puts("  ERROR: Cannot write to bitmap at ");
-        uart_put_hex(BITMAP_ADDR);
+        uart_put_hex(bitmap_addr);
         uart_puts("!\n");
         return;
     }
@@ -93,48 +109,69 @@ void memory_init(void) {
         bitmap_set(i);
         used_pages++;
     }
+    search_hint = HEAP_PAGES;
     heap_end = heap_start + HEAP_SIZE;
     heap_brk = heap_start;
     free_list = 0;
 }
 
-void *page_alloc(void) { return page_alloc_n(1); }
-
-void *page_alloc_n(unsigned int count) {
+// Unlocked page allocation (caller holds mem_lock)
+static void *pages_alloc(unsigned int count) {
     if (count == 0) return 0;
-    unsigned long i = 0;
+    unsigned long i = search_hint;
     while (i + count <= total_pages) {
+        // Skip fully-used bitmap bytes
+        if ((i % 8) == 0 && page_bitmap[i / 8] == 0xFF) { i += 8; continue; }
         int found = 1;
         for (unsigned long j = 0; j < count; j++) {
             if (bitmap_test(i + j)) { i = i + j + 1; found = 0; break; }
         }
         if (found) {
             for (unsigned long j = 0; j < count; j++) { bitmap_set(i + j); used_pages++; }
+            if (count == 1 || i == search_hint) search_hint = i + count;
             return (void *)((first_free_page + i) * PAGE_SIZE);
         }
     }
     return 0;
 }
 
-void page_free(void *addr) { page_free_n(addr, 1); }
-
-void page_free_n(void *addr, unsigned int count) {
+static void pages_free(void *addr, unsigned int count) {
     unsigned long page = (unsigned long)addr / PAGE_SIZE;
     if (page < first_free_page) return;
     unsigned long local = page - first_free_page;
     for (unsigned long i = 0; i < count; i++) {
-        if (bitmap_test(local + i)) { bitmap_clear(local + i); used_pages--; }
+        if (bitmap_test(local + i)) {
+            bitmap_clear(local + i); used_pages--;
+            if (local + i < search_hint) search_hint = local + i;
+        }
     }
 }
 
-void *kmalloc(unsigned long size) {
+void *page_alloc(void) { return page_alloc_n(1); }
+
+void *page_alloc_n(unsigned int count) {
+    unsigned long irq = spin_lock_irqsave(&mem_lock);
+    void *p = pages_alloc(count);
+    spin_unlock_irqrestore(&mem_lock, irq);
+    return p;
+}
+
+void page_free(void *addr) { page_free_n(addr, 1); }
+
+void page_free_n(void *addr, unsigned int count) {
+    unsigned long irq = spin_lock_irqsave(&mem_lock);
+    pages_free(addr, count);
+    spin_unlock_irqrestore(&mem_lock, irq);
+}
+
+static void *kmalloc_locked(unsigned long size) {
     if (size == 0) return 0;
     size = (size + 15) & ~15UL;
     unsigned long total = size + HEADER_SIZE;
 
     if (size > PAGE_SIZE / 2) {
         unsigned int pages = (total + PAGE_SIZE - 1) / PAGE_SIZE;
-        void *p = page_alloc_n(pages);
+        void *p = pages_alloc(pages);
         if (!p) return 0;
         block_header_t *hdr = (block_header_t *)p;
         hdr->size = size; hdr->magic = BLOCK_MAGIC; hdr->next = 0; hdr->is_page_alloc = pages;
@@ -154,7 +191,7 @@ void *kmalloc(unsigned long size) {
 
     if (heap_brk + total > heap_end) {
         unsigned int pages = (total + PAGE_SIZE - 1) / PAGE_SIZE;
-        void *p = page_alloc_n(pages);
+        void *p = pages_alloc(pages);
         if (!p) return 0;
         block_header_t *hdr = (block_header_t *)p;
         hdr->size = size; hdr->magic = BLOCK_MAGIC; hdr->next = 0; hdr->is_page_alloc = pages;
@@ -167,15 +204,27 @@ void *kmalloc(unsigned long size) {
     return (void *)((unsigned char *)hdr + HEADER_SIZE);
 }
 
+void *kmalloc(unsigned long size) {
+    unsigned long irq = spin_lock_irqsave(&mem_lock);
+    void *p = kmalloc_locked(size);
+    spin_unlock_irqrestore(&mem_lock, irq);
+    return p;
+}
+
 void kfree(void *ptr) {
     if (!ptr) return;
     block_header_t *hdr = (block_header_t *)((unsigned char *)ptr - HEADER_SIZE);
-    if (hdr->magic != BLOCK_MAGIC) { uart_puts("[kfree] bad magic\n"); return; }
+    if (hdr->magic != BLOCK_MAGIC) { klog("[kfree] bad magic"); return; }
+
+    unsigned long irq = spin_lock_irqsave(&mem_lock);
     hdr->magic = 0;
-    if (hdr->is_page_alloc > 0) { page_free_n((void *)hdr, hdr->is_page_alloc); return; }
-    hdr->next = free_list; free_list = hdr;
+    if (hdr->is_page_alloc > 0) pages_free((void *)hdr, hdr->is_page_alloc);
+    else { hdr->next = free_list; free_list = hdr; }
+    spin_unlock_irqrestore(&mem_lock, irq);
 }
 
 unsigned long memory_get_total_pages(void) { return total_pages; }
 unsigned long memory_get_free_pages(void)  { return total_pages - used_pages; }
 unsigned long memory_get_used_pages(void)  { return used_pages; }
+unsigned long memory_get_heap_size(void)   { return HEAP_SIZE; }
+unsigned long memory_get_heap_used(void)   { return (unsigned long)(heap_brk - heap_start); }
@@ -0,0 +1,224 @@
+// mmap.c - Memory-mapped ramfs files
+//
+// Every task runs on the one set of translation tables, so a mapping is
+// a stretch of the window given to one task: the address works from
+// anywhere, but only its owner is meant to use it. Stretches are handed
+// out first-fit with an unmapped guard page after each, so running off
+// the end of a mapping faults.
+//
+// All of a mapping's pages are mapped up front (the file pins them, see
+// fs_node_map). Private writable mappings start read-only; the store
+// fault lands in mmap_fault(), which swaps in a copy mapped read-write.
+// A writable page in a private mapping is therefore always a copy, and
+// is freed on unmap.
+
+#include "mmap.h"
+#include "mmu.h"
+#include "fd.h"
+#include "memory.h"
+#include "smp.h"
+#include "uart.h"
+
+typedef struct {
+    unsigned long va;               // 0 = free slot
+    unsigned long pages;
+    unsigned long pgoff;            // File page mapped at va
+    fs_node_t *node;                // Pinned: fs_node_get + fs_node_map
+    unsigned int owner;             // Task id
+    int prot;
+    int flags;
+} mapping_t;
+
+static mapping_t maps[MMAP_MAX];
+static spinlock_t mmap_lock = SPINLOCK_INIT;    // The table, with IRQs masked
+
+// ---- Helpers ----
+
+static int shared_write(const mapping_t *m) {
+    return (m->flags & MAP_SHARED) && (m->prot & PROT_WRITE);
+}
+
+// Lowest window address with room for pages plus a guard page (caller
+// holds mmap_lock). 0 if the window is full.
+static unsigned long va_alloc(unsigned long pages) {
+    unsigned long va = MMU_MAP_BASE;
+    unsigned long len = (pages + 1) << PAGE_SHIFT;
+    for (int i = 0; i < MMAP_MAX; i++) {
+        const mapping_t *m = &maps[i];
+        unsigned long end = m->va + ((m->pages + 1) << PAGE_SHIFT);
+        if (m->va && va < end && m->va < va + len) {
+            va = end;
+            i = -1;                 // Moved past it: check all again
+        }
+    }
+    return va + len <= MMU_MAP_BASE + MMU_MAP_SIZE ? va : 0;
+}
+
+// The mapping containing addr (caller holds mmap_lock)
+static mapping_t *find(unsigned long addr) {
+    for (int i = 0; i < MMAP_MAX; i++) {
+        mapping_t *m = &maps[i];
+        if (m->va && addr >= m->va && addr < m->va + (m->pages << PAGE_SHIFT))
+            return m;
+    }
+    return 0;
+}
+
+// Tear down a mapping already taken out of the table (m is a copy)
+static void unmap_region(const mapping_t *m, unsigned long mapped) {
+    for (unsigned long i = 0; i < mapped; i++) {
+        unsigned long va = m->va + (i << PAGE_SHIFT);
+        int writable;
+        unsigned long pa = mmu_lookup_page(va, &writable);
+        if (!pa) continue;
+        mmu_unmap_page(va);
+        if ((m->flags & MAP_PRIVATE) && writable)
+            page_free((void *)pa);  // Our copy
+    }
+    fs_node_unmap(m->node, shared_write(m));
+    fs_node_put(m->node);
+}
+
+// ---- Public API ----
+
+void *fs_mmap(int fd, unsigned long off, unsigned long len, int prot, int flags) {
+    if (len == 0 || (off & (PAGE_SIZE - 1)) || !(prot & PROT_READ) ||
+        (flags != MAP_SHARED && flags != MAP_PRIVATE)) {
+        uart_puts("mmap: bad arguments\n");
+        return 0;
+    }
+    int oflags;
+    fs_node_t *node = fd_node_get(fd, &oflags);
+    if (!node) {
+        uart_puts("mmap: bad descriptor\n");
+        return 0;
+    }
+    int mode = oflags & O_ACCMODE;
+    int sw = flags == MAP_SHARED && (prot & PROT_WRITE);
+    if (mode == O_WRONLY || (sw && mode != O_RDWR)) {
+        uart_puts("mmap: descriptor not open for that access\n");
+        fs_node_put(node);
+        return 0;
+    }
+
+    mapping_t m;
+    m.pages = (len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    m.pgoff = off >> PAGE_SHIFT;
+    m.node = node;
+    m.prot = prot;
+    m.flags = flags;
+    task_t *task = get_current_task();
+    m.owner = task ? task->id : 0;
+    if (fs_node_map(node, m.pgoff, m.pages, sw) < 0) {
+        fs_node_put(node);
+        return 0;
+    }
+
+    // Claim a slot and a stretch of the window
+    unsigned long irq = spin_lock_irqsave(&mmap_lock);
+    mapping_t *slot = 0;
+    for (int i = 0; i < MMAP_MAX && !slot; i++)
+        if (!maps[i].va) slot = &maps[i];
+    m.va = slot ? va_alloc(m.pages) : 0;
+    if (m.va) *slot = m;
+    spin_unlock_irqrestore(&mmap_lock, irq);
+    if (!m.va) {
+        uart_puts("mmap: no room for another mapping\n");
+        unmap_region(&m, 0);
+        return 0;
+    }
+
+    for (unsigned long i = 0; i < m.pages; i++) {
+        void *page = fs_node_page(node, m.pgoff + i);
+        if (mmu_map_page(m.va + (i << PAGE_SHIFT), (unsigned long)page, sw) < 0) {
+            uart_puts("mmap: out of memory for page tables\n");
+            irq = spin_lock_irqsave(&mmap_lock);
+            slot->va = 0;
+            spin_unlock_irqrestore(&mmap_lock, irq);
+            unmap_region(&m, i);
+            return 0;
+        }
+    }
+    return (void *)m.va;
+}
+
+int fs_munmap(void *addr, unsigned long len) {
+    mapping_t m;
+    unsigned long irq = spin_lock_irqsave(&mmap_lock);
+    mapping_t *slot = find((unsigned long)addr);
+    int ok = slot && slot->va == (unsigned long)addr &&
+             slot->pages == (len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    if (ok) {
+        m = *slot;
+        slot->va = 0;
+    }
+    spin_unlock_irqrestore(&mmap_lock, irq);
+    if (!ok) return -1;
+
+    unmap_region(&m, m.pages);
+    return 0;
+}
+
+void mmap_task_exit(task_t *task) {
+    for (int i = 0; i < MMAP_MAX; i++) {
+        mapping_t m;
+        unsigned long irq = spin_lock_irqsave(&mmap_lock);
+        int mine = maps[i].va && maps[i].owner == task->id;
+        if (mine) {
+            m = maps[i];
+            maps[i].va = 0;
+        }
+        spin_unlock_irqrestore(&mmap_lock, irq);
+        if (mine) unmap_region(&m, m.pages);
+    }
+}
+
+int mmap_fault(unsigned long far, unsigned long esr) {
+    // Data abort at EL1, caused by a write, permission fault (any level)
+    unsigned long ec = esr >> 26, dfsc = esr & 0x3F;
+    if (ec != 0x25 || !(esr & (1UL << 6)) || (dfsc & 0x3C) != 0x0C) return -1;
+
+    int rc = -1;
+    unsigned long irq = spin_lock_irqsave(&mmap_lock);
+    mapping_t *m = find(far);
+    if (m && (m->flags & MAP_PRIVATE) && (m->prot & PROT_WRITE)) {
+        unsigned long va = far & ~(PAGE_SIZE - 1);
+        int writable;
+        unsigned long pa = mmu_lookup_page(va, &writable);
+        unsigned long *copy = pa && !writable ? (unsigned long *)page_alloc() : 0;
+        if (copy) {
+            const unsigned long *src = (const unsigned long *)pa;
+            for (unsigned long i = 0; i < PAGE_SIZE / 8; i++) copy[i] = src[i];
+            rc = mmu_map_page(va, (unsigned long)copy, 1);
+            if (rc < 0) page_free(copy);
+        } else if (pa && writable) {
+            rc = 0;                 // Already copied (stale TLB entry): retry
+        }
+    }
+    spin_unlock_irqrestore(&mmap_lock, irq);
+    return rc;
+}
+
+void mmap_dump(void) {
+    uart_puts("ADDRESS\t\t\tPAGES\tOFFSET\tMODE\t\tTASK\tFILE\n");
+    unsigned long irq = spin_lock_irqsave(&mmap_lock);
+    for (int i = 0; i < MMAP_MAX; i++) {
+        const mapping_t *m = &maps[i];
+        if (!m->va) continue;
+        char path[FS_PATH_MAX];
+        fs_get_path(m->node, path, sizeof(path));
+        uart_put_hex(m->va);
+        uart_puts("\t");
+        uart_put_dec(m->pages);
+        uart_puts("\t");
+        uart_put_dec(m->pgoff << PAGE_SHIFT);
+        uart_puts("\t");
+        uart_puts((m->prot & PROT_WRITE) ? "rw" : "r-");
+        uart_puts((m->flags & MAP_SHARED) ? " shared\t" : " private\t");
+        uart_put_dec(m->owner);
+        uart_puts("\t");
+        uart_puts(path);
+        uart_puts("\n");
+    }
+    spin_unlock_irqrestore(&mmap_lock, irq);
+}
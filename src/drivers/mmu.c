@@ -7,7 +7,8 @@
 //
 // Memory map (1GB RAM + peripherals):
 //   0x00000000 - 0x3FFFFFFF  : RAM (1GB) — Normal, cacheable
-//   0x40000000 - 0xFBFFFFFF  : unmapped
+//   0x40000000 - 0x7FFFFFFF  : page-mapped window (mmap) — 4KB pages
+//   0x80000000 - 0xFBFFFFFF  : unmapped
 //   0xFC000000 - 0xFFFFFFFF  : Peripherals — Device memory
 //     0xFE000000 : BCM2711 peripherals (UART, GPIO, etc.)
 //     0xFF800000 : ARM Local peripherals (timer IRQ routing)
@@ -15,18 +16,24 @@
 //
 // Page table structure (4KB granule, 48-bit VA):
 //   L0: 512 entries, each covers 512GB — we use entry 0
-//   L1: 512 entries, each covers 1GB  — we use entries 0 and 3
-//   L2: 512 entries, each covers 2MB  — block descriptors
+//   L1: 512 entries, each covers 1GB  — we use entries 0, 1 and 3
+//   L2: 512 entries, each covers 2MB  — block descriptors, or (window)
+//       tables
+//   L3: 512 entries, each covers 4KB  — window pages only
 //
 // We need:
 //   1 x L0 table (4KB)
 //   1 x L1 table (4KB)
 //   1 x L2 table for RAM region   (4KB) — maps 0x00000000-0x3FFFFFFF
 //   1 x L2 table for device region (4KB) — maps 0xC0000000-0xFFFFFFFF
-// Total: 16KB of page tables
+//   1 x L2 table for the window (4KB)    — 0x40000000-0x7FFFFFFF
+// Total: 20KB of page tables, plus an L3 table per 2MB of window in use
+// (allocated on demand, never freed)
 
 #include "mmu.h"
 #include "uart.h"
+#include "memory.h"
+#include "smp.h"
 
 // ---- Page table entry bits ----
 
@@ -62,6 +69,12 @@
 #define BLOCK_NORMAL    (PT_VALID | PT_BLOCK | PT_AF | PT_ATTR(MT_NORMAL) | PT_ISH | PT_AP_RW_EL1)
 #define TABLE_ENTRY     (PT_VALID | PT_TABLE)
 
+// Window pages: never executable
+#define PT_PXN          (1UL << 53)
+#define PT_UXN          (1UL << 54)
+#define PAGE_NORMAL     (PT_VALID | PT_PAGE | PT_AF | PT_ATTR(MT_NORMAL) | PT_ISH | PT_PXN | PT_UXN)
+#define PT_ADDR_MASK    0x0000FFFFFFFFF000UL
+
 // ---- Page tables (16KB-aligned, in BSS) ----
 // Using __attribute__((aligned)) puts them in BSS with proper alignment
 
@@ -69,6 +82,11 @@ static unsigned long l0_table[512] __attribute__((aligned(4096)));
 static unsigned long l1_table[512] __attribute__((aligned(4096)));
 static unsigned long l2_ram_table[512] __attribute__((aligned(4096)));
 static unsigned long l2_dev_table[512] __attribute__((aligned(4096)));
+static unsigned long l2_map_table[512] __attribute__((aligned(4096)));
+
+static spinlock_t map_lock = SPINLOCK_INIT;     // Window tables
+static unsigned int map_l3_tables;
+static unsigned long map_pages;
 
 static int mmu_enabled = 0;
 
@@ -83,6 +101,7 @@ void mmu_init(void) {
         l1_table[i] = 0;
         l2_ram_table[i] = 0;
         l2_dev_table[i] = 0;
+        l2_map_table[i] = 0;
     }
 
     // ---- L2 RAM table: map 0x00000000 - 0x3FFFFFFF (1GB) as Normal ----
@@ -101,8 +120,10 @@ void mmu_init(void) {
 
     // ---- L1 table: 512 entries, each covers 1GB ----
     // Entry 0: points to l2_ram_table  (covers 0x00000000 - 0x3FFFFFFF)
+    // Entry 1: points to l2_map_table  (covers 0x40000000 - 0x7FFFFFFF)
     // Entry 3: points to l2_dev_table  (covers 0xC0000000 - 0xFFFFFFFF)
     l1_table[0] = (unsigned long)l2_ram_table | TABLE_ENTRY;
+    l1_table[1] = (unsigned long)l2_map_table | TABLE_ENTRY;
     l1_table[3] = (unsigned long)l2_dev_table | TABLE_ENTRY;
 
     // ---- L0 table: 512 entries, each covers 512GB ----
@@ -172,6 +193,72 @@ int mmu_is_enabled(void) {
     return mmu_enabled;
 }
 
+// ---- Page-mapped window ----
+
+// L3 entry for va, allocating its table if create (caller holds map_lock)
+static unsigned long *map_pte(unsigned long va, int create) {
+    unsigned long off = va - MMU_MAP_BASE;
+    if (va < MMU_MAP_BASE || off >= MMU_MAP_SIZE) return 0;
+    unsigned long *l2e = &l2_map_table[off >> 21];
+    if (!(*l2e & PT_VALID)) {
+        if (!create) return 0;
+        unsigned long *l3 = (unsigned long *)page_alloc();
+        if (!l3) return 0;
+        for (int i = 0; i < 512; i++) l3[i] = 0;
+        asm volatile("dsb ishst");      // Table zeroed before it's reachable
+        *l2e = (unsigned long)l3 | TABLE_ENTRY;
+        map_l3_tables++;
+    }
+    unsigned long *l3 = (unsigned long *)(*l2e & PT_ADDR_MASK);
+    return &l3[(off >> 12) & 511];
+}
+
+// Remove a valid entry and flush it from every core's TLB
+static void map_clear(unsigned long *pte, unsigned long va) {
+    *pte = 0;
+    asm volatile("dsb ishst");
+    asm volatile("tlbi vae1is, %0" :: "r"(va >> 12));
+    asm volatile("dsb ish");
+    map_pages--;
+}
+
+int mmu_map_page(unsigned long va, unsigned long pa, int writable) {
+    unsigned long irq = spin_lock_irqsave(&map_lock);
+    unsigned long *pte = map_pte(va, 1);
+    if (!pte) {
+        spin_unlock_irqrestore(&map_lock, irq);
+        return -1;
+    }
+    // Break-before-make: a live entry is invalidated before the new one
+    if (*pte & PT_VALID) map_clear(pte, va);
+    *pte = (pa & PT_ADDR_MASK) | PAGE_NORMAL | (writable ? PT_AP_RW_EL1 : PT_AP_RO_EL1);
+    asm volatile("dsb ishst");
+    asm volatile("isb");
+    map_pages++;
+    spin_unlock_irqrestore(&map_lock, irq);
+    return 0;
+}
+
+void mmu_unmap_page(unsigned long va) {
+    unsigned long irq = spin_lock_irqsave(&map_lock);
+    unsigned long *pte = map_pte(va, 0);
+    if (pte && (*pte & PT_VALID)) {
+        map_clear(pte, va);
+        asm volatile("isb");
+    }
+    spin_unlock_irqrestore(&map_lock, irq);
+}
+
+unsigned long mmu_lookup_page(unsigned long va, int *writable) {
+    unsigned long irq = spin_lock_irqsave(&map_lock);
+    unsigned long *pte = map_pte(va, 0);
+    unsigned long e = pte ? *pte : 0;
+    spin_unlock_irqrestore(&map_lock, irq);
+    if (!(e & PT_VALID)) return 0;
+    if (writable) *writable = (e & PT_AP_RO_EL1) == 0;
+    return e & PT_ADDR_MASK;
+}
+
 void mmu_dump_config(void) {
     unsigned long sctlr, tcr, mair, ttbr0;
     asm volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
@@ -227,9 +314,14 @@ void mmu_dump_config(void) {
     // Show mapping summary
     uart_puts("\nMemory map:\n");
     uart_puts("  0x00000000-0x3FFFFFFF  1GB RAM    (Normal, cacheable)\n");
+    uart_puts("  0x40000000-0x7FFFFFFF  1GB window (4KB pages, ");
+    uart_put_dec(map_pages);
+    uart_puts(" mapped)\n");
     uart_puts("  0xC0000000-0xFFFFFFFF  1GB Device (UART, GIC, timers)\n");
 
     uart_puts("\nPage tables: ");
-    uart_put_dec(4 * 4);
-    uart_puts(" KB (4 tables x 4KB)\n");
+    uart_put_dec((5 + map_l3_tables) * 4);
+    uart_puts(" KB (");
+    uart_put_dec(5 + map_l3_tables);
+    uart_puts(" tables x 4KB)\n");
 }
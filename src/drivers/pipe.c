@@ -0,0 +1,135 @@
+// pipe.c - Bounded byte pipes between tasks
+//
+// head and tail count bytes ever written and read, so head - tail is the
+// fill level and (count % PIPE_SIZE) the ring position. Everything is
+// guarded by the pipe's lock with IRQs masked; a task that must wait
+// hands the lock to task_wait(), which queues it before unlocking, and
+// re-checks once woken. Both ends wake the other side on every change.
+
+#include "pipe.h"
+#include "memory.h"
+
+pipe_t *pipe_create(void) {
+    pipe_t *p = (pipe_t *)kmalloc(sizeof(pipe_t));
+    if (!p) return 0;
+    p->buf = (unsigned char *)page_alloc();
+    if (!p->buf) {
+        kfree(p);
+        return 0;
+    }
+    p->lock.lock = 0;
+    p->head = 0;
+    p->tail = 0;
+    p->readers = 0;
+    p->writers = 0;
+    p->rd_opens = 0;
+    p->wr_opens = 0;
+    p->rd_wait.head = p->rd_wait.tail = 0;
+    p->wr_wait.head = p->wr_wait.tail = 0;
+    return p;
+}
+
+void pipe_destroy(pipe_t *p) {
+    page_free(p->buf);
+    kfree(p);
+}
+
+unsigned int pipe_open(pipe_t *p, int writer) {
+    unsigned long irq = spin_lock_irqsave(&p->lock);
+    unsigned int token;
+    if (writer) {
+        p->writers++;
+        p->wr_opens++;
+        token = p->rd_opens;
+        wake_up_all(&p->rd_wait);
+    } else {
+        p->readers++;
+        p->rd_opens++;
+        token = p->wr_opens;
+        wake_up_all(&p->wr_wait);
+    }
+    spin_unlock_irqrestore(&p->lock, irq);
+    return token;
+}
+
+void pipe_wait_peer(pipe_t *p, int writer, unsigned int token) {
+    unsigned long irq = spin_lock_irqsave(&p->lock);
+    // A peer that opened and closed again while we slept still counts
+    while (writer ? (p->readers == 0 && p->rd_opens == token)
+                  : (p->writers == 0 && p->wr_opens == token)) {
+        task_wait(writer ? &p->wr_wait : &p->rd_wait, &p->lock, irq);
+        irq = spin_lock_irqsave(&p->lock);
+    }
+    spin_unlock_irqrestore(&p->lock, irq);
+}
+
+void pipe_close(pipe_t *p, int writer) {
+    unsigned long irq = spin_lock_irqsave(&p->lock);
+    if (writer) p->writers--;
+    else        p->readers--;
+    // Readers may now see EOF, writers a broken pipe
+    wake_up_all(&p->rd_wait);
+    wake_up_all(&p->wr_wait);
+    spin_unlock_irqrestore(&p->lock, irq);
+}
+
+long pipe_read(pipe_t *p, void *buf, unsigned long len) {
+    if (len == 0) return 0;
+
+    unsigned long irq = spin_lock_irqsave(&p->lock);
+    while (p->head == p->tail) {
+        if (p->writers == 0) {
+            spin_unlock_irqrestore(&p->lock, irq);
+            return 0;
+        }
+        task_wait(&p->rd_wait, &p->lock, irq);
+        irq = spin_lock_irqsave(&p->lock);
+    }
+
+    unsigned long n = p->head - p->tail;
+    if (n > len) n = len;
+    unsigned char *dst = (unsigned char *)buf;
+    for (unsigned long i = 0; i < n; i++)
+        dst[i] = p->buf[(p->tail + i) % PIPE_SIZE];
+    p->tail += n;
+
+    wake_up_all(&p->wr_wait);
+    spin_unlock_irqrestore(&p->lock, irq);
+    return (long)n;
+}
+
+long pipe_write(pipe_t *p, const void *buf, unsigned long len) {
+    const unsigned char *src = (const unsigned char *)buf;
+    unsigned long done = 0;
+
+    unsigned long irq = spin_lock_irqsave(&p->lock);
+    while (done < len) {
+        if (p->readers == 0) {
+            spin_unlock_irqrestore(&p->lock, irq);
+            return done ? (long)done : -1;
+        }
+        unsigned long space = PIPE_SIZE - (p->head - p->tail);
+        if (space == 0) {
+            task_wait(&p->wr_wait, &p->lock, irq);
+            irq = spin_lock_irqsave(&p->lock);
+            continue;
+        }
+
+        unsigned long n = len - done;
+        if (n > space) n = space;
+        for (unsigned long i = 0; i < n; i++)
+            p->buf[(p->head + i) % PIPE_SIZE] = src[done + i];
+        p->head += n;
+        done += n;
+        wake_up_all(&p->rd_wait);
+    }
+    spin_unlock_irqrestore(&p->lock, irq);
+    return (long)done;
+}
+
+unsigned long pipe_used(pipe_t *p) {
+    unsigned long irq = spin_lock_irqsave(&p->lock);
+    unsigned long n = p->head - p->tail;
+    spin_unlock_irqrestore(&p->lock, irq);
+    return n;
+}
@@ -0,0 +1,238 @@
+// procfs.c - Live kernel statistics as files under /proc
+//
+// Each file is a show() function that prints into a page-sized buffer.
+// Every read regenerates it (see procfs.h) into a page of its own, so
+// concurrent readers can't see each other's half-written output. show()
+// runs with IRQs enabled: some statistics sit behind locks that tasks
+// hold while preemptible, and masking the timer would spin forever on
+// one held by a preempted task. Output longer than a page is cut off.
+
+#include "procfs.h"
+#include "fs.h"
+#include "task.h"
+#include "memory.h"
+#include "timer.h"
+#include "smp.h"
+#include "uart.h"
+#include "klog.h"
+
+#define PROC_BUF_SIZE   PAGE_SIZE
+
+typedef struct {
+    char *buf;
+    unsigned long len;
+} proc_buf_t;
+
+typedef struct {
+    fs_ext_t ext;                       // Must be first
+    const char *name;
+    void (*show)(proc_buf_t *b);
+} proc_file_t;
+
+static int proc_populate(fs_node_t *dir);
+static long proc_read(fs_node_t *file, unsigned long off, void *buf, unsigned long len);
+
+static const fs_ops_t proc_ops = {
+    .populate = proc_populate,
+    .read = proc_read,
+    .unsized = 1,
+};
+
+static fs_ext_t proc_root = { &proc_ops };
+
+// ---- Formatting ----
+
+static void put_str(proc_buf_t *b, const char *s) {
+    while (*s && b->len < PROC_BUF_SIZE) b->buf[b->len++] = *s++;
+}
+
+// s left-aligned in a column of width characters plus a separating
+// space (width 0: just s)
+static void put_col(proc_buf_t *b, const char *s, int width) {
+    int n = 0;
+    while (s[n]) n++;
+    put_str(b, s);
+    if (!width) return;
+    for (; n < width; n++) put_str(b, " ");
+    put_str(b, " ");
+}
+
+static void put_dec(proc_buf_t *b, unsigned long v, int width) {
+    char tmp[21];
+    int i = 20;
+    tmp[i] = '\0';
+    do {
+        tmp[--i] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    put_col(b, &tmp[i], width);
+}
+
+// "name: value unit" line, values aligned
+static void put_kv(proc_buf_t *b, const char *name, unsigned long v, const char *unit) {
+    put_col(b, name, 16);
+    put_dec(b, v, 0);
+    if (unit[0]) {
+        put_str(b, " ");
+        put_str(b, unit);
+    }
+    put_str(b, "\n");
+}
+
+// ---- Files ----
+
+static const char *state_name(task_state_t s) {
+    switch (s) {
+        case TASK_READY:   return "READY";
+        case TASK_RUNNING: return "RUNNING";
+        case TASK_BLOCKED: return "BLOCKED";
+        case TASK_DEAD:    return "DEAD";
+        default:           return "?";
+    }
+}
+
+static void show_tasks(proc_buf_t *b) {
+    task_t *pool = get_task_pool();
+    put_str(b, "ID   NAME             STATE    TICKS      SWITCHES   FDS\n");
+    for (int i = 0; i < MAX_TASKS; i++) {
+        task_t *t = &pool[i];
+        if (t->state == TASK_DEAD && i != 0) continue;
+        if (t->state == TASK_DEAD && t->name[0] == '\0') continue;
+        int fds = 0;
+        for (int f = 0; f < TASK_MAX_FILES; f++)
+            if (t->files[f]) fds++;
+        put_dec(b, t->id, 4);
+        put_col(b, t->name, 16);
+        put_col(b, state_name(t->state), 8);
+        put_dec(b, t->ticks, 10);
+        put_dec(b, t->switches, 10);
+        put_dec(b, fds, 0);
+        put_str(b, "\n");
+    }
+}
+
+static void show_cpus(proc_buf_t *b) {
+    put_str(b, "CORE STATUS   TICKS      AIO\n");
+    for (unsigned int i = 0; i < NUM_CORES; i++) {
+        core_info_t *ci = smp_get_core_info(i);
+        put_dec(b, i, 4);
+        put_col(b, ci->online ? "online" : "offline", 8);
+        put_dec(b, ci->ticks, 10);
+        put_dec(b, ci->aio_served, 0);
+        put_str(b, "\n");
+    }
+}
+
+static void show_meminfo(proc_buf_t *b) {
+    fs_data_stats_t st;
+    fs_data_stats(&st);
+    put_kv(b, "PagesTotal:", memory_get_total_pages(), "");
+    put_kv(b, "PagesUsed:", memory_get_used_pages(), "");
+    put_kv(b, "PagesFree:", memory_get_free_pages(), "");
+    put_kv(b, "HeapSize:", memory_get_heap_size(), "bytes");
+    put_kv(b, "HeapUsed:", memory_get_heap_used(), "bytes");
+    put_kv(b, "FsNodes:", fs_nodes_used(), "");
+    put_kv(b, "FsNodesTotal:", fs_nodes_total(), "");
+    put_kv(b, "FsRawChunks:", st.raw_chunks, "");
+    put_kv(b, "FsZChunks:", st.zchunks, "");
+    put_kv(b, "FsZBytes:", st.zbytes, "bytes");
+    put_kv(b, "FsZShared:", st.zshared, "");
+}
+
+static void show_locks(proc_buf_t *b) {
+    put_str(b, "CORE ACQUIRES   CONTENDED  SPINS\n");
+    for (unsigned int i = 0; i < NUM_CORES; i++) {
+        core_info_t *ci = smp_get_core_info(i);
+        put_dec(b, i, 4);
+        put_dec(b, ci->lock_acquires, 10);
+        put_dec(b, ci->lock_contended, 10);
+        put_dec(b, ci->lock_spins, 0);
+        put_str(b, "\n");
+    }
+}
+
+static void show_interrupts(proc_buf_t *b) {
+    put_str(b, "CORE IRQS       TIMER      FAULTS\n");
+    for (unsigned int i = 0; i < NUM_CORES; i++) {
+        core_info_t *ci = smp_get_core_info(i);
+        put_dec(b, i, 4);
+        put_dec(b, ci->irqs, 10);
+        put_dec(b, ci->ticks, 10);
+        put_dec(b, ci->faults, 0);
+        put_str(b, "\n");
+    }
+}
+
+static void show_klog(proc_buf_t *b) {
+    put_str(b, "CORE LOGGED     DROPPED    PENDING\n");
+    for (unsigned int i = 0; i < NUM_CORES; i++) {
+        klog_stats_t st;
+        klog_stats(i, &st);
+        put_dec(b, i, 4);
+        put_dec(b, st.logged, 10);
+        put_dec(b, st.dropped, 10);
+        put_dec(b, st.pending, 0);
+        put_str(b, "\n");
+    }
+}
+
+static void show_uart(proc_buf_t *b) {
+    uart_stats_t st;
+    uart_stats(&st);
+    put_kv(b, "Baud:", uart_get_baud(0), "");
+    put_kv(b, "TxDmaRuns:", st.dma_runs, "");
+    put_kv(b, "TxDmaBytes:", st.dma_bytes, "bytes");
+    put_kv(b, "TxDmaErrors:", st.dma_errors, "");
+    put_kv(b, "RxDropped:", st.rx_dropped, "bytes");
+}
+
+static void show_uptime(proc_buf_t *b) {
+    unsigned long ticks = timer_get_tick_count();
+    put_kv(b, "Seconds:", ticks * TIMER_TICK_MS / 1000, "");
+    put_kv(b, "Ticks:", ticks, "");
+}
+
+static proc_file_t proc_files[] = {
+    { { &proc_ops }, "tasks",      show_tasks },
+    { { &proc_ops }, "cpus",       show_cpus },
+    { { &proc_ops }, "meminfo",    show_meminfo },
+    { { &proc_ops }, "locks",      show_locks },
+    { { &proc_ops }, "interrupts", show_interrupts },
+    { { &proc_ops }, "klog",       show_klog },
+    { { &proc_ops }, "uart",       show_uart },
+    { { &proc_ops }, "uptime",     show_uptime },
+};
+
+#define PROC_NFILES (sizeof(proc_files) / sizeof(proc_files[0]))
+
+// ---- Filesystem hooks ----
+
+static int proc_populate(fs_node_t *dir) {
+    for (unsigned long i = 0; i < PROC_NFILES; i++)
+        if (!fs_ext_add(dir, proc_files[i].name, FS_FILE, 0, &proc_files[i].ext))
+            return -1;
+    return 0;
+}
+
+static long proc_read(fs_node_t *file, unsigned long off, void *buf, unsigned long len) {
+    proc_file_t *pf = (proc_file_t *)file->ext;
+    proc_buf_t snap = { (char *)page_alloc(), 0 };
+    if (!snap.buf) return -1;
+    pf->show(&snap);
+    unsigned long n = 0;
+    if (off < snap.len) {
+        n = snap.len - off;
+        if (n > len) n = len;
+        for (unsigned long i = 0; i < n; i++)
+            ((char *)buf)[i] = snap.buf[off + i];
+    }
+    page_free(snap.buf);
+    return (long)n;
+}
+
+// ---- Public API ----
+
+int procfs_init(void) {
+    if (!fs_resolve("/proc") && !fs_mkdir("/proc")) return -1;
+    return fs_mount("/proc", &proc_root);
+}
@@ -0,0 +1,422 @@
+// sdhci.c - SD card driver for the BCM2711 EMMC2 controller
+//
+// Polled: the controller's interrupt is not routed, the driver spins on
+// the interrupt status register with a timeout instead. Transfers are
+// only issued by the buffer cache, under its lock, so the driver keeps
+// no lock of its own.
+//
+// ADMA2 (32-bit descriptors) needs the controller to advertise it in
+// CAPABILITIES; QEMU's model doesn't, and gets the data-port path.
+
+#include "sdhci.h"
+#include "block.h"
+#include "memory.h"
+#include "timer.h"
+#include "uart.h"
+
+#define EMMC2_BASE      0xFE340000
+
+#define SD_BLKSIZECNT   ((volatile unsigned int*)(EMMC2_BASE + 0x04))
+#define SD_ARG1         ((volatile unsigned int*)(EMMC2_BASE + 0x08))
+#define SD_CMDTM        ((volatile unsigned int*)(EMMC2_BASE + 0x0C))
+#define SD_RESP0        ((volatile unsigned int*)(EMMC2_BASE + 0x10))
+#define SD_RESP1        ((volatile unsigned int*)(EMMC2_BASE + 0x14))
+#define SD_RESP2        ((volatile unsigned int*)(EMMC2_BASE + 0x18))
+#define SD_RESP3        ((volatile unsigned int*)(EMMC2_BASE + 0x1C))
+#define SD_DATA         ((volatile unsigned int*)(EMMC2_BASE + 0x20))
+#define SD_STATUS       ((volatile unsigned int*)(EMMC2_BASE + 0x24))
+#define SD_CONTROL0     ((volatile unsigned int*)(EMMC2_BASE + 0x28))
+#define SD_CONTROL1     ((volatile unsigned int*)(EMMC2_BASE + 0x2C))
+#define SD_INTERRUPT    ((volatile unsigned int*)(EMMC2_BASE + 0x30))
+#define SD_IRPT_MASK    ((volatile unsigned int*)(EMMC2_BASE + 0x34))
+#define SD_IRPT_EN      ((volatile unsigned int*)(EMMC2_BASE + 0x38))
+#define SD_CAPS         ((volatile unsigned int*)(EMMC2_BASE + 0x40))
+#define SD_ADMA_ADDR    ((volatile unsigned int*)(EMMC2_BASE + 0x58))
+#define SD_VERSION      ((volatile unsigned int*)(EMMC2_BASE + 0xFC))
+
+// STATUS (present state)
+#define SR_CMD_INHIBIT  (1 << 0)
+#define SR_DAT_INHIBIT  (1 << 1)
+#define SR_CARD_PRESENT (1 << 16)
+
+// CONTROL0: host control, power control
+#define C0_DWIDTH_4     (1 << 1)
+#define C0_DMA_ADMA2    (2 << 3)
+#define C0_DMA_MASK     (3 << 3)
+#define C0_POWER_3V3    (0x0F << 8)     // 3.3V, bus power on
+
+// CONTROL1: clock control, timeout, software reset
+#define C1_CLK_INTLEN   (1 << 0)
+#define C1_CLK_STABLE   (1 << 1)
+#define C1_CLK_EN       (1 << 2)
+#define C1_CLK_MASK     0xFFC0          // 10-bit divider
+#define C1_TOUNIT_MAX   (0xE << 16)
+#define C1_SRST_HC      (1 << 24)
+#define C1_SRST_CMD     (1 << 25)
+#define C1_SRST_DATA    (1 << 26)
+
+// INTERRUPT
+#define INT_CMD_DONE    (1 << 0)
+#define INT_DATA_DONE   (1 << 1)
+#define INT_WRITE_RDY   (1 << 4)
+#define INT_READ_RDY    (1 << 5)
+#define INT_ERROR       0xFFFF8000      // Error summary + error bits
+
+#define CAPS_ADMA2      (1 << 19)
+
+// CMDTM: transfer mode (low half) and command (high half)
+#define TM_DMA          (1 << 0)
+#define TM_BLKCNT_EN    (1 << 1)
+#define TM_AUTO_CMD12   (1 << 2)
+#define TM_READ         (1 << 4)
+#define TM_MULTI        (1 << 5)
+#define CMD_RSP_136     (1 << 16)
+#define CMD_RSP_48      (2 << 16)
+#define CMD_RSP_BUSY    (3 << 16)
+#define CMD_CRC_CHK     (1 << 19)
+#define CMD_IDX_CHK     (1 << 20)
+#define CMD_DATA        (1 << 21)
+#define CMD(idx, flags) (((unsigned int)(idx) << 24) | (flags))
+
+#define R1              (CMD_RSP_48 | CMD_CRC_CHK | CMD_IDX_CHK)
+#define R1B             (CMD_RSP_BUSY | CMD_CRC_CHK | CMD_IDX_CHK)
+#define R2              (CMD_RSP_136 | CMD_CRC_CHK)
+#define R3              CMD_RSP_48
+
+#define GO_IDLE_STATE       CMD(0, 0)
+#define ALL_SEND_CID        CMD(2, R2)
+#define SEND_RELATIVE_ADDR  CMD(3, R1)
+#define SELECT_CARD         CMD(7, R1B)
+#define SEND_IF_COND        CMD(8, R1)
+#define SEND_CSD            CMD(9, R2)
+#define SET_BLOCKLEN        CMD(16, R1)
+#define READ_SINGLE         CMD(17, R1 | CMD_DATA)
+#define READ_MULTIPLE       CMD(18, R1 | CMD_DATA)
+#define WRITE_SINGLE        CMD(24, R1 | CMD_DATA)
+#define WRITE_MULTIPLE      CMD(25, R1 | CMD_DATA)
+#define APP_CMD             CMD(55, R1)
+#define SET_BUS_WIDTH       CMD(6, R1)      // After APP_CMD
+#define SD_SEND_OP_COND     CMD(41, R3)     // After APP_CMD
+
+#define OCR_BUSY        (1u << 31)          // Clear while powering up
+#define OCR_CCS         (1u << 30)          // High capacity (block addressed)
+#define OCR_VOLTAGES    0x00FF8000          // 2.7-3.6V
+
+// ADMA2 32-bit descriptor
+typedef struct {
+    unsigned short attr;
+    unsigned short len;
+    unsigned int addr;
+} adma_desc_t;
+
+#define ADMA_VALID      (1 << 0)
+#define ADMA_END        (1 << 1)
+#define ADMA_TRAN       (2 << 4)
+
+#define CACHE_LINE      64
+
+typedef struct {
+    unsigned int rca;               // Relative card address << 16
+    int sdhc;                       // Block (not byte) addressed
+    int host_v3;                    // 10-bit clock divider
+    unsigned int base_hz;           // Controller base clock
+    adma_desc_t *desc;              // ADMA2 table (0 = data port)
+} sd_card_t;
+
+static sd_card_t card;
+static block_dev_t sd_dev = { .name = "sd0" };
+
+// ---- Helpers ----
+
+// EMMC2 masters the full 35-bit bus: RAM is at its physical address
+static unsigned int bus_addr(const void *p) {
+    return (unsigned int)(unsigned long)p;
+}
+
+static void dcache_clean(const void *p, unsigned long len) {
+    unsigned long a = (unsigned long)p & ~(unsigned long)(CACHE_LINE - 1);
+    for (; a < (unsigned long)p + len; a += CACHE_LINE)
+        asm volatile("dc cvac, %0" :: "r"(a) : "memory");
+    asm volatile("dsb sy" ::: "memory");
+}
+
+static void dcache_inval(const void *p, unsigned long len) {
+    unsigned long a = (unsigned long)p & ~(unsigned long)(CACHE_LINE - 1);
+    for (; a < (unsigned long)p + len; a += CACHE_LINE)
+        asm volatile("dc civac, %0" :: "r"(a) : "memory");
+    asm volatile("dsb sy" ::: "memory");
+}
+
+static unsigned long deadline(unsigned int ms) {
+    return timer_get_ticks() + timer_get_frequency() / 1000 * ms;
+}
+
+static int expired(unsigned long until) {
+    return (long)(timer_get_ticks() - until) > 0;
+}
+
+// Wait for any bit in mask, and acknowledge it. -1 on error or timeout.
+static int wait_int(unsigned int mask, unsigned int ms) {
+    unsigned long until = deadline(ms);
+    while (1) {
+        unsigned int irq = *SD_INTERRUPT;
+        if (irq & INT_ERROR) {
+            *SD_INTERRUPT = irq;
+            return -1;
+        }
+        if (irq & mask) {
+            *SD_INTERRUPT = irq & mask;
+            return 0;
+        }
+        if (expired(until)) return -1;
+    }
+}
+
+static int wait_clear(volatile unsigned int *reg, unsigned int mask, unsigned int ms) {
+    unsigned long until = deadline(ms);
+    while (*reg & mask)
+        if (expired(until)) return -1;
+    return 0;
+}
+
+// Recover the command and data lines after an error
+static void reset_lines(void) {
+    *SD_CONTROL1 |= C1_SRST_CMD | C1_SRST_DATA;
+    wait_clear(SD_CONTROL1, C1_SRST_CMD | C1_SRST_DATA, 100);
+    *SD_INTERRUPT = 0xFFFFFFFF;
+}
+
+// Issue a command and wait for its response (and busy end for R1b).
+// tm carries the transfer-mode bits for data commands.
+static int sd_cmd(unsigned int cmd, unsigned int arg, unsigned int tm) {
+    unsigned int inhibit = SR_CMD_INHIBIT;
+    if ((cmd & CMD_DATA) || (cmd & CMD_RSP_BUSY) == CMD_RSP_BUSY)
+        inhibit |= SR_DAT_INHIBIT;
+    if (wait_clear(SD_STATUS, inhibit, 500) < 0) {
+        reset_lines();
+        return -1;
+    }
+
+    *SD_INTERRUPT = 0xFFFFFFFF;
+    *SD_ARG1 = arg;
+    *SD_CMDTM = cmd | tm;
+
+    if (wait_int(INT_CMD_DONE, 500) < 0) {
+        reset_lines();
+        return -1;
+    }
+    if ((cmd & CMD_RSP_BUSY) == CMD_RSP_BUSY && wait_int(INT_DATA_DONE, 500) < 0) {
+        reset_lines();
+        return -1;
+    }
+    return 0;
+}
+
+static int sd_app_cmd(unsigned int cmd, unsigned int arg) {
+    if (sd_cmd(APP_CMD, card.rca, 0) < 0) return -1;
+    return sd_cmd(cmd, arg, 0);
+}
+
+static int sd_set_clock(unsigned int hz) {
+    if (wait_clear(SD_STATUS, SR_CMD_INHIBIT | SR_DAT_INHIBIT, 100) < 0)
+        return -1;
+
+    *SD_CONTROL1 &= ~C1_CLK_EN;
+
+    // SDCLK = base / (2 * N), never faster than asked
+    unsigned int field;
+    if (card.host_v3) {
+        unsigned int n = (card.base_hz + 2 * hz - 1) / (2 * hz);
+        if (n > 0x3FF) n = 0x3FF;
+        field = ((n & 0xFF) << 8) | ((n >> 8) << 6);
+    } else {
+        unsigned int n = 1;     // Power of two up to 128
+        while (n < 0x80 && card.base_hz / (2 * n) > hz) n <<= 1;
+        field = n << 8;
+    }
+
+    unsigned int c1 = *SD_CONTROL1 & ~C1_CLK_MASK;
+    *SD_CONTROL1 = c1 | field | C1_CLK_INTLEN | C1_TOUNIT_MAX;
+    unsigned long until = deadline(100);
+    while (!(*SD_CONTROL1 & C1_CLK_STABLE))
+        if (expired(until)) return -1;
+
+    *SD_CONTROL1 |= C1_CLK_EN;
+    timer_delay_ms(2);
+    return 0;
+}
+
+// Card capacity in sectors from the CSD. The controller strips the CRC,
+// so CSD bit n is response bit n - 8.
+static unsigned long csd_sectors(void) {
+    unsigned int r1 = *SD_RESP1, r2 = *SD_RESP2, r3 = *SD_RESP3;
+
+    if (((r3 >> 22) & 3) == 1) {
+        // CSD v2: C_SIZE[69:48], capacity (C_SIZE + 1) * 512 KB
+        unsigned long c_size = (r1 >> 8) & 0x3FFFFF;
+        return (c_size + 1) * 1024;
+    }
+    // CSD v1: C_SIZE[73:62], C_SIZE_MULT[49:47], READ_BL_LEN[83:80]
+    unsigned long c_size = ((r2 & 0x3) << 10) | (r1 >> 22);
+    unsigned int mult = (r1 >> 7) & 0x7;
+    unsigned int bl_len = (r2 >> 8) & 0xF;
+    unsigned long bytes = (c_size + 1) << (mult + 2 + bl_len);
+    return bytes / BLOCK_SIZE;
+}
+
+// ---- Block device hook ----
+
+static int sd_xfer(block_dev_t *dev, int write, unsigned long lba,
+                   unsigned int count, void *const *segs) {
+    (void)dev;
+    unsigned int nsegs = (count + BCACHE_BUF_SECTORS - 1) / BCACHE_BUF_SECTORS;
+    unsigned int arg = card.sdhc ? (unsigned int)lba : (unsigned int)(lba * BLOCK_SIZE);
+
+    unsigned int cmd, tm = 0;
+    if (count == 1) {
+        cmd = write ? WRITE_SINGLE : READ_SINGLE;
+    } else {
+        cmd = write ? WRITE_MULTIPLE : READ_MULTIPLE;
+        tm = TM_BLKCNT_EN | TM_MULTI | TM_AUTO_CMD12;
+    }
+    if (!write) tm |= TM_READ;
+
+    if (card.desc) {
+        unsigned long left = (unsigned long)count * BLOCK_SIZE;
+        for (unsigned int i = 0; i < nsegs; i++) {
+            unsigned int len = left > BCACHE_BUF_SIZE ? BCACHE_BUF_SIZE : (unsigned int)left;
+            card.desc[i].attr = ADMA_VALID | ADMA_TRAN | (i == nsegs - 1 ? ADMA_END : 0);
+            card.desc[i].len = (unsigned short)len;
+            card.desc[i].addr = bus_addr(segs[i]);
+            // Push out dirty lines either way: for reads, so no eviction
+            // lands on top of the DMA'd data later
+            if (write) dcache_clean(segs[i], len);
+            else dcache_inval(segs[i], len);
+            left -= len;
+        }
+        dcache_clean(card.desc, nsegs * sizeof(adma_desc_t));
+        *SD_ADMA_ADDR = bus_addr(card.desc);
+        tm |= TM_DMA;
+    }
+
+    *SD_BLKSIZECNT = (count << 16) | BLOCK_SIZE;
+    if (sd_cmd(cmd, arg, tm) < 0) return -1;
+
+    if (!card.desc) {
+        for (unsigned int b = 0; b < count; b++) {
+            unsigned int *p = (unsigned int *)((char *)segs[b / BCACHE_BUF_SECTORS] +
+                                               (b % BCACHE_BUF_SECTORS) * BLOCK_SIZE);
+            if (wait_int(write ? INT_WRITE_RDY : INT_READ_RDY, 500) < 0) {
+                reset_lines();
+                return -1;
+            }
+            for (int w = 0; w < BLOCK_SIZE / 4; w++) {
+                if (write) *SD_DATA = p[w];
+                else p[w] = *SD_DATA;
+            }
+        }
+    }
+
+    if (wait_int(INT_DATA_DONE, 1000) < 0) {
+        reset_lines();
+        return -1;
+    }
+
+    // Drop lines the CPU may have speculatively refetched during the DMA
+    if (card.desc && !write) {
+        unsigned long left = (unsigned long)count * BLOCK_SIZE;
+        for (unsigned int i = 0; i < nsegs; i++) {
+            unsigned long len = left > BCACHE_BUF_SIZE ? BCACHE_BUF_SIZE : left;
+            dcache_inval(segs[i], len);
+            left -= len;
+        }
+    }
+    return 0;
+}
+
+// ---- Init ----
+
+int sdhci_init(void) {
+    *SD_CONTROL1 = C1_SRST_HC;
+    if (wait_clear(SD_CONTROL1, C1_SRST_HC, 100) < 0) {
+        uart_puts("  sd: controller reset timed out\n");
+        return -1;
+    }
+
+    unsigned long until = deadline(100);
+    while (!(*SD_STATUS & SR_CARD_PRESENT)) {
+        if (expired(until)) {
+            uart_puts("  sd: no card\n");
+            return -1;
+        }
+    }
+
+    card.host_v3 = ((*SD_VERSION >> 16) & 0xFF) >= 2;
+    unsigned int caps = *SD_CAPS;
+    card.base_hz = ((caps >> 8) & 0xFF) * 1000000;
+    if (!card.base_hz) card.base_hz = 100000000;    // Not reported: firmware default
+    card.rca = 0;
+    card.desc = 0;
+
+    *SD_CONTROL0 = C0_POWER_3V3;
+    *SD_IRPT_MASK = 0xFFFFFFFF;     // Latch every status bit...
+    *SD_IRPT_EN = 0;                // ...but raise no interrupt
+    if (sd_set_clock(400000) < 0) {
+        uart_puts("  sd: clock didn't stabilize\n");
+        return -1;
+    }
+
+    // Identification: CMD0, CMD8, ACMD41 until powered up, CID, RCA
+    sd_cmd(GO_IDLE_STATE, 0, 0);
+    int v2 = sd_cmd(SEND_IF_COND, 0x1AA, 0) == 0 && (*SD_RESP0 & 0xFFF) == 0x1AA;
+
+    until = deadline(1000);
+    unsigned int ocr = 0;
+    do {
+        if (expired(until) ||
+            sd_app_cmd(SD_SEND_OP_COND, OCR_VOLTAGES | (v2 ? OCR_CCS : 0)) < 0) {
+            uart_puts("  sd: card didn't power up\n");
+            return -1;
+        }
+        ocr = *SD_RESP0;
+    } while (!(ocr & OCR_BUSY));
+    card.sdhc = (ocr & OCR_CCS) != 0;
+
+    if (sd_cmd(ALL_SEND_CID, 0, 0) < 0 || sd_cmd(SEND_RELATIVE_ADDR, 0, 0) < 0) {
+        uart_puts("  sd: identification failed\n");
+        return -1;
+    }
+    card.rca = *SD_RESP0 & 0xFFFF0000;
+
+    if (sd_cmd(SEND_CSD, card.rca, 0) < 0) return -1;
+    unsigned long sectors = csd_sectors();
+
+    if (sd_cmd(SELECT_CARD, card.rca, 0) < 0) return -1;
+    if (!card.sdhc && sd_cmd(SET_BLOCKLEN, BLOCK_SIZE, 0) < 0) return -1;
+
+    // Data transfer mode: 4-bit bus at 25 MHz
+    if (sd_app_cmd(SET_BUS_WIDTH, 2) == 0)
+        *SD_CONTROL0 |= C0_DWIDTH_4;
+    if (sd_set_clock(25000000) < 0) return -1;
+
+    if (caps & CAPS_ADMA2) {
+        card.desc = (adma_desc_t *)page_alloc();
+        if (card.desc)
+            *SD_CONTROL0 = (*SD_CONTROL0 & ~C0_DMA_MASK) | C0_DMA_ADMA2;
+    }
+
+    sd_dev.nsectors = sectors;
+    sd_dev.xfer = sd_xfer;
+    sd_dev.priv = &card;
+    if (block_register(&sd_dev) < 0) {
+        uart_puts("  sd: cannot register block device\n");
+        return -1;
+    }
+
+    uart_puts("  sd0: ");
+    uart_put_dec(sectors / 2048);
+    uart_puts(" MB, ");
+    uart_puts(card.sdhc ? "SDHC" : "SDSC");
+    uart_puts(card.desc ? ", ADMA2\n" : ", PIO\n");
+    return 0;
+}
@@ -7,22 +7,42 @@
 #include "uart.h"
 #include "timer.h"
 #include "gic.h"
+#include "aio.h"
+
+// ---- Lock statistics ----
+
+static core_info_t cores[NUM_CORES];
+
+// Count an acquisition that waited through spins wakeups
+static inline void lock_account(unsigned long spins) {
+    core_info_t *ci = &cores[smp_core_id()];
+    ci->lock_acquires++;
+    if (spins) {
+        ci->lock_contended++;
+        ci->lock_spins += spins;
+    }
+}
 
 // ---- Spinlock implementation (ARMv8 exclusives) ----
 
 void spin_lock(spinlock_t *lk) {
     unsigned int tmp, val;
+    unsigned long spins;
     asm volatile(
+        "   mov     %2, #0\n"
         "   sevl\n"
         "1: wfe\n"
-        "2: ldaxr   %w0, [%2]\n"
-        "   cbnz    %w0, 1b\n"
-        "   stxr    %w1, %w3, [%2]\n"
+        "2: ldaxr   %w0, [%3]\n"
+        "   cbz     %w0, 3f\n"
+        "   add     %2, %2, #1\n"         // Held: count a wait
+        "   b       1b\n"
+        "3: stxr    %w1, %w4, [%3]\n"
         "   cbnz    %w1, 2b\n"
-        : "=&r"(val), "=&r"(tmp)
+        : "=&r"(val), "=&r"(tmp), "=&r"(spins)
         : "r"(&lk->lock), "r"(1)
         : "memory"
     );
+    lock_account(spins);
 }
 
 void spin_unlock(spinlock_t *lk) {
@@ -35,14 +55,96 @@ void spin_unlock(spinlock_t *lk) {
     );
 }
 
+// ---- Reader-writer lock ----
+
+#define RW_WRITER   0x80000000U
+
+void read_lock(rwlock_t *rw) {
+    unsigned int tmp, val;
+    unsigned long spins;
+    asm volatile(
+        "   mov     %2, #0\n"
+        "   sevl\n"
+        "1: wfe\n"
+        "2: ldaxr   %w0, [%3]\n"
+        "   tbz     %w0, #31, 3f\n"
+        "   add     %2, %2, #1\n"         // Writer holds it: wait
+        "   b       1b\n"
+        "3: add     %w0, %w0, #1\n"
+        "   stxr    %w1, %w0, [%3]\n"
+        "   cbnz    %w1, 2b\n"
+        : "=&r"(val), "=&r"(tmp), "=&r"(spins)
+        : "r"(&rw->cnt)
+        : "memory"
+    );
+    lock_account(spins);
+}
+
+void read_unlock(rwlock_t *rw) {
+    unsigned int tmp, val;
+    asm volatile(
+        "1: ldxr    %w0, [%2]\n"
+        "   sub     %w0, %w0, #1\n"
+        "   stlxr   %w1, %w0, [%2]\n"
+        "   cbnz    %w1, 1b\n"
+        "   cbnz    %w0, 2f\n"           // Last reader wakes writers
+        "   sev\n"
+        "2:\n"
+        : "=&r"(val), "=&r"(tmp)
+        : "r"(&rw->cnt)
+        : "memory"
+    );
+}
+
+void write_lock(rwlock_t *rw) {
+    unsigned int tmp, val;
+    unsigned long spins;
+    asm volatile(
+        "   mov     %2, #0\n"
+        "   sevl\n"
+        "1: wfe\n"
+        "2: ldaxr   %w0, [%3]\n"
+        "   cbz     %w0, 3f\n"
+        "   add     %2, %2, #1\n"         // Readers or a writer: wait
+        "   b       1b\n"
+        "3: stxr    %w1, %w4, [%3]\n"
+        "   cbnz    %w1, 2b\n"
+        : "=&r"(val), "=&r"(tmp), "=&r"(spins)
+        : "r"(&rw->cnt), "r"(RW_WRITER)
+        : "memory"
+    );
+    lock_account(spins);
+}
+
+void write_unlock(rwlock_t *rw) {
+    asm volatile(
+        "   stlr    %w0, [%1]\n"
+        "   sev\n"
+        :
+        : "r"(0), "r"(&rw->cnt)
+        : "memory"
+    );
+}
+
+unsigned long spin_lock_irqsave(spinlock_t *lk) {
+    unsigned long flags;
+    asm volatile("mrs %0, daif" : "=r"(flags));
+    asm volatile("msr daifset, #2" ::: "memory");
+    spin_lock(lk);
+    return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t *lk, unsigned long flags) {
+    spin_unlock(lk);
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
 // ---- Global scheduler lock ----
 
 spinlock_t scheduler_lock = SPINLOCK_INIT;
 
 // ---- Per-core state ----
 
-static core_info_t cores[NUM_CORES];
-
 core_info_t *smp_get_core_info(unsigned int core_id) {
     if (core_id >= NUM_CORES) return &cores[0];
     return &cores[core_id];
@@ -65,7 +167,7 @@ unsigned long smp_shared_mair;
 
 void secondary_core_main(unsigned int core_id) {
     // Set up this core's timer
-    timer_init(100);
+    timer_init(TIMER_TICK_MS);
 
     // Enable timer IRQ routing for this core
     gic_enable_timer_irq_core(core_id);
@@ -76,7 +178,7 @@ void secondary_core_main(unsigned int core_id) {
     // Mark online
     cores[core_id].online = 1;
     cores[core_id].ticks = 0;
-    cores[core_id].tasks_run = 0;
+    cores[core_id].aio_served = 0;
 
     // On QEMU raspi4b, the ARM local peripheral timer IRQ only wakes
     // core 0 via interrupt. Secondary cores poll the timer ISTATUS bit.
@@ -89,7 +191,7 @@ void secondary_core_main(unsigned int core_id) {
         if (ctl & 0x4) {  // ISTATUS = timer expired
             // Re-arm timer
             unsigned long interval = timer_get_frequency();
-            interval = (interval / 1000) * 100;
+            interval = (interval / 1000) * TIMER_TICK_MS;
             asm volatile("msr cntp_tval_el0, %0" :: "r"(interval));
 
             // Update per-core stats
@@ -98,6 +200,10 @@ void secondary_core_main(unsigned int core_id) {
             // Run scheduler if enabled
             // (For now secondary cores just idle — task migration comes next)
         }
+
+        // Serve queued async fs requests between timer polls
+        if (aio_worker_poll(core_id))
+            cores[core_id].aio_served++;
     }
 }
 
@@ -110,12 +216,12 @@ void smp_init(void) {
     // Init core 0 info
     cores[0].online = 1;
     cores[0].ticks = 0;
-    cores[0].tasks_run = 0;
+    cores[0].aio_served = 0;
 
     for (int i = 1; i < NUM_CORES; i++) {
         cores[i].online = 0;
         cores[i].ticks = 0;
-        cores[i].tasks_run = 0;
+        cores[i].aio_served = 0;
     }
 
     // Set up stack top pointers (stacks grow down)
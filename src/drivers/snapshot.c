@@ -0,0 +1,169 @@
+// snapshot.c - ramfs image in RAM kept across warm reset
+//
+// Layout of the region: a header in the first cache line, then two image
+// slots. A save writes fs_snapshot() into the slot the current image
+// doesn't use and only then rewrites the header to point at it, so a
+// failed save (or a reset midway) leaves the previous image in place.
+// The header is checked on its own (magic, version, CRC-32C) before the
+// image CRC is computed, so random RAM after a cold boot is rejected
+// without reading the whole image.
+//
+// The image is cleaned to the point of coherency after every save: a
+// reset discards dirty cache lines, and the next boot must see the data
+// in DRAM.
+
+#include "snapshot.h"
+#include "crc32c.h"
+#include "fs.h"
+#include "timer.h"
+#include "uart.h"
+#include "klog.h"
+
+#define SNAPSHOT_MAGIC      0x50414E53U     // "SNAP"
+#define SNAPSHOT_VERSION    2
+#define SNAPSHOT_HDR_SIZE   64              // Header slot (one cache line)
+#define SNAPSHOT_SLOT_SIZE  ((SNAPSHOT_SIZE - SNAPSHOT_HDR_SIZE) / 2)
+#define CACHE_LINE          64
+
+// Power management block: a watchdog whose expiry resets the SoC
+#define PM_BASE             0xFE100000
+#define PM_RSTC             ((volatile unsigned int*)(PM_BASE + 0x1C))
+#define PM_WDOG             ((volatile unsigned int*)(PM_BASE + 0x24))
+#define PM_PASSWORD         0x5A000000
+#define PM_RSTC_WRCFG_MASK  0x00000030
+#define PM_RSTC_FULL_RESET  0x00000020
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long slot;             // Image slot in use (0 or 1)
+    unsigned long nodes;            // Records in the image
+    unsigned long length;           // Image bytes
+    unsigned int crc;               // CRC-32C of the image
+    unsigned int hdr_crc;           // CRC-32C of the fields above
+} snapshot_hdr_t;
+
+#define HDR     ((snapshot_hdr_t *)SNAPSHOT_BASE)
+#define IMAGE(slot) ((void *)(SNAPSHOT_BASE + SNAPSHOT_HDR_SIZE + (slot) * SNAPSHOT_SLOT_SIZE))
+
+static unsigned int hdr_crc(const snapshot_hdr_t *h) {
+    return crc32c(0, h, sizeof(*h) - sizeof(h->hdr_crc));
+}
+
+// Header is ours and self-consistent (the image may still be damaged)
+static int hdr_valid(const snapshot_hdr_t *h) {
+    return h->magic == SNAPSHOT_MAGIC && h->version == SNAPSHOT_VERSION &&
+           h->slot < 2 && h->length <= SNAPSHOT_SLOT_SIZE && h->hdr_crc == hdr_crc(h);
+}
+
+static void dcache_clean(const void *p, unsigned long len) {
+    unsigned long a = (unsigned long)p & ~(unsigned long)(CACHE_LINE - 1);
+    for (; a < (unsigned long)p + len; a += CACHE_LINE)
+        asm volatile("dc cvac, %0" :: "r"(a) : "memory");
+    asm volatile("dsb sy" ::: "memory");
+}
+
+static unsigned long elapsed_ms(unsigned long t0) {
+    return (timer_get_ticks() - t0) * 1000 / timer_get_frequency();
+}
+
+static void put_kb(unsigned long bytes) {
+    uart_put_dec((bytes + 1023) / 1024);
+    uart_puts(" KB");
+}
+
+int snapshot_save(void) {
+    snapshot_hdr_t *h = HDR;
+    unsigned long t0 = timer_get_ticks();
+
+    // Write into the slot the current image doesn't use
+    int had_image = hdr_valid(h);
+    unsigned long slot = had_image ? 1 - h->slot : 0;
+    unsigned long nodes;
+    long len = fs_snapshot(IMAGE(slot), SNAPSHOT_SLOT_SIZE, &nodes);
+    if (len < 0) {
+        uart_puts(had_image ? "snapshot: not saved, previous image kept\n"
+                            : "snapshot: not saved\n");
+        return -1;
+    }
+    unsigned int crc = crc32c(0, IMAGE(slot), (unsigned long)len);
+    dcache_clean(IMAGE(slot), (unsigned long)len);
+
+    // Switch over: the header is one cache line, and its CRC rejects
+    // one torn by a reset
+    h->magic = SNAPSHOT_MAGIC;
+    h->version = SNAPSHOT_VERSION;
+    h->slot = slot;
+    h->nodes = nodes;
+    h->length = (unsigned long)len;
+    h->crc = crc;
+    h->hdr_crc = hdr_crc(h);
+    dcache_clean(h, sizeof(*h));
+
+    uart_puts("Saved ");
+    uart_put_dec(nodes);
+    uart_puts(" nodes, ");
+    put_kb((unsigned long)len);
+    uart_puts(" image in ");
+    uart_put_dec(elapsed_ms(t0));
+    uart_puts(" ms\n");
+    return 0;
+}
+
+long snapshot_restore(void) {
+    snapshot_hdr_t *h = HDR;
+    if (h->magic != SNAPSHOT_MAGIC) return 0;   // Cold boot, or never saved
+    unsigned long t0 = timer_get_ticks();
+
+    if (!hdr_valid(h)) {
+        uart_puts("  snapshot: bad header, ignored\n");
+        return -1;
+    }
+    if (crc32c(0, IMAGE(h->slot), h->length) != h->crc) {
+        uart_puts("  snapshot: checksum mismatch, ignored\n");
+        return -1;
+    }
+    if (fs_restore(IMAGE(h->slot), h->length, h->nodes) < 0)
+        return -1;
+
+    uart_puts("  snapshot: restored ");
+    uart_put_dec(h->nodes);
+    uart_puts(" nodes (");
+    put_kb(h->length);
+    uart_puts(") in ");
+    uart_put_dec(elapsed_ms(t0));
+    uart_puts(" ms\n");
+    return (long)h->nodes;
+}
+
+void snapshot_info(void) {
+    snapshot_hdr_t *h = HDR;
+    if (!hdr_valid(h)) {
+        uart_puts("No snapshot saved\n");
+        return;
+    }
+    uart_puts("Snapshot: ");
+    uart_put_dec(h->nodes);
+    uart_puts(" nodes, ");
+    put_kb(h->length);
+    uart_puts(" of ");
+    uart_put_dec(SNAPSHOT_SIZE / (1024 * 1024));
+    uart_puts(" MB at 0x");
+    uart_put_hex(SNAPSHOT_BASE);
+    uart_puts(crc32c(0, IMAGE(h->slot), h->length) == h->crc ? ", checksum ok\n"
+                                                     : ", checksum BAD\n");
+}
+
+void snapshot_clear(void) {
+    HDR->magic = 0;
+    dcache_clean(HDR, sizeof(snapshot_hdr_t));
+}
+
+void snapshot_reboot(void) {
+    klog_flush();                               // Queued output would be lost
+    unsigned int rstc = *PM_RSTC & ~PM_RSTC_WRCFG_MASK;
+    *PM_WDOG = PM_PASSWORD | 10;                // Expire in ~150 us
+    *PM_RSTC = PM_PASSWORD | rstc | PM_RSTC_FULL_RESET;
+    while (1)
+        asm volatile("wfe");
+}
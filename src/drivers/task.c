@@ -10,10 +10,20 @@
 // For NEW tasks, we build a fake trapframe on their stack so that when
 // vectors.S restores from it and does eret, execution starts at the
 // task's entry point.
+//
+// Blocking: a sleeping task stays in the ready queue (BLOCKED with a
+// wake tick); a task in task_wait() leaves it and sits on a wait queue
+// until wake_up_all() re-enqueues it. Queue changes take scheduler_lock
+// with IRQs off, the same lock the timer IRQ holds while scheduling.
 
 #include "task.h"
 #include "uart.h"
+#include "klog.h"
 #include "timer.h"
+#include "fd.h"
+#include "aio.h"
+#include "mmap.h"
+#include "smp.h"
 
 // Trapframe size: 34 unsigned longs (x0-x30, ELR, SPSR, padding)
 #define TRAPFRAME_SIZE 34
@@ -62,7 +72,7 @@ static task_t *dequeue_ready_task(void) {
     return 0;
 }
 
-// Remove a specific task from the ready queue (used by task_kill)
+// Remove a specific task from the ready queue, if it is there
 static void remove_from_queue(task_t *target) {
     task_t *task = ready_queue_head;
     task_t *prev = 0;
@@ -81,9 +91,28 @@ static void remove_from_queue(task_t *target) {
     }
 }
 
+// ---- Wait queues (caller holds scheduler_lock, IRQs off) ----
+
+static void wait_remove(wait_queue_t *wq, task_t *target) {
+    task_t *prev = 0;
+    for (task_t *t = wq->head; t; prev = t, t = t->wait_next) {
+        if (t != target) continue;
+        if (prev) prev->wait_next = t->wait_next;
+        else wq->head = t->wait_next;
+        if (wq->tail == t) wq->tail = prev;
+        break;
+    }
+    target->wait_next = 0;
+    target->waiting_on = 0;
+}
+
 // ---- Task exit trampoline ----
 static void task_exit_trampoline(void) {
     if (current_task) {
+        fd_close_all(current_task);
+        aio_task_exit(current_task);
+        fs_task_exit(current_task);
+        mmap_task_exit(current_task);
         current_task->state = TASK_DEAD;
     }
     while (1)
@@ -139,9 +168,16 @@ void scheduler_init(void) {
     shell->id = next_task_id++;
     shell->state = TASK_RUNNING;
     shell->sleep_until = 0;
+    shell->ticks = 0;
+    shell->switches = 0;
     shell->next = 0;
     strcpy_local(shell->name, "shell");
     shell->sp = 0;
+    for (int i = 0; i < TASK_MAX_FILES; i++)
+        shell->files[i] = 0;
+    shell->cwd = 0;
+    shell->waiting_on = 0;
+    shell->wait_next = 0;
 
     current_task = shell;
 }
@@ -151,13 +187,14 @@ void task_create(void (*entry_point)(void), const char *name) {
 
     task_t *task = 0;
     for (int i = 0; i < MAX_TASKS; i++) {
-        if (task_pool[i].state == TASK_DEAD) {
+        // Skip slots whose async requests are still running
+        if (task_pool[i].state == TASK_DEAD && !aio_busy(&task_pool[i])) {
             task = &task_pool[i];
             break;
         }
     }
     if (!task) {
-        uart_puts("[sched] ERROR: no free task slots\n");
+        klog("[sched] ERROR: no free task slots");
         asm volatile("msr daifclr, #2");
         return;
     }
@@ -165,11 +202,22 @@ void task_create(void (*entry_point)(void), const char *name) {
     task->id = next_task_id++;
     task->state = TASK_READY;
     task->sleep_until = 0;
+    task->ticks = 0;
+    task->switches = 0;
     task->next = 0;
     strcpy_local(task->name, name);
+    fd_inherit(task, current_task);
+    task->cwd = current_task ? current_task->cwd : 0;  // Inherit creator's cwd
+    if (task->cwd) fs_node_get(task->cwd);
+    task->locks_held = 0;
+    task->kill_pending = 0;
+    task->waiting_on = 0;
+    task->wait_next = 0;
 
     init_task_trapframe(task, entry_point);
+    spin_lock(&scheduler_lock);
     enqueue_task(task);
+    spin_unlock(&scheduler_lock);
 
     asm volatile("msr daifclr, #2");
 }
@@ -191,9 +239,23 @@ int task_kill(unsigned int task_id) {
                 asm volatile("msr daifclr, #2");
                 return -1;
             }
+            // Preempted inside a shared lock: let it finish (task_lock_drop)
+            if (task_pool[i].locks_held) {
+                task_pool[i].kill_pending = 1;
+                asm volatile("msr daifclr, #2");
+                return 0;
+            }
 
-            // Remove from ready queue if queued
+            // Remove from ready queue or wait queue
+            spin_lock(&scheduler_lock);
             remove_from_queue(&task_pool[i]);
+            if (task_pool[i].waiting_on)
+                wait_remove(task_pool[i].waiting_on, &task_pool[i]);
+            spin_unlock(&scheduler_lock);
+            fd_close_all(&task_pool[i]);
+            aio_task_exit(&task_pool[i]);
+            fs_task_exit(&task_pool[i]);
+            mmap_task_exit(&task_pool[i]);
 
             // Mark dead
             task_pool[i].state = TASK_DEAD;
@@ -214,6 +276,7 @@ unsigned long schedule_irq(unsigned long old_sp) {
     current_task->sp = old_sp;
 
     task_t *prev = current_task;
+    prev->ticks++;
 
     if (prev->state == TASK_RUNNING) {
         prev->state = TASK_READY;
@@ -223,11 +286,13 @@ unsigned long schedule_irq(unsigned long old_sp) {
     task_t *next = dequeue_ready_task();
 
     if (!next) {
-        prev->state = TASK_RUNNING;
+        // Nothing runnable: stay on prev. If it's blocked it keeps idling
+        // in its wait loop until a wakeup or its sleep timer.
         current_task = prev;
         return prev->sp;
     }
 
+    if (next != prev) next->switches++;
     current_task = next;
     current_task->state = TASK_RUNNING;
     return current_task->sp;
@@ -244,8 +309,13 @@ void task_sleep(unsigned int ms) {
     unsigned long ticks = (ms + 99) / 100;
     current_task->sleep_until = timer_get_tick_count() + ticks;
     current_task->state = TASK_BLOCKED;
-    // Re-enqueue so dequeue_ready_task can check the sleep timer
+    // Re-enqueue so dequeue_ready_task can check the sleep timer. A task
+    // woken while it was still running is queued already: take it out
+    // first so it is never linked twice.
+    spin_lock(&scheduler_lock);
+    remove_from_queue(current_task);
     enqueue_task(current_task);
+    spin_unlock(&scheduler_lock);
     asm volatile("msr daifclr, #2");
 
     // Spin until the scheduler wakes us (sets state back to RUNNING)
@@ -253,9 +323,71 @@ void task_sleep(unsigned int ms) {
         asm volatile("wfi");
 }
 
+void task_wait(wait_queue_t *wq, spinlock_t *lock, unsigned long flags) {
+    task_t *self = current_task;
+
+    spin_lock(&scheduler_lock);
+    // A wakeup that came while we were still running queued us as READY;
+    // leave the ready queue so wake_up_all() can enqueue us again
+    remove_from_queue(self);
+    self->state = TASK_BLOCKED;
+    self->sleep_until = ~0UL;   // Only wake_up_all() makes it ready
+    self->waiting_on = wq;
+    self->wait_next = 0;
+    if (wq->tail) wq->tail->wait_next = self;
+    else wq->head = self;
+    wq->tail = self;
+    spin_unlock(&scheduler_lock);
+
+    spin_unlock_irqrestore(lock, flags);
+
+    // Not in the ready queue: the scheduler skips us until woken
+    while (self->state == TASK_BLOCKED)
+        asm volatile("wfi");
+}
+
+void wake_up_all(wait_queue_t *wq) {
+    unsigned long irq = spin_lock_irqsave(&scheduler_lock);
+    task_t *t = wq->head;
+    while (t) {
+        task_t *n = t->wait_next;
+        t->wait_next = 0;
+        t->waiting_on = 0;
+        t->sleep_until = 0;
+        t->state = TASK_READY;
+        enqueue_task(t);
+        t = n;
+    }
+    wq->head = 0;
+    wq->tail = 0;
+    spin_unlock_irqrestore(&scheduler_lock, irq);
+}
+
+void task_lock_hold(void) {
+    if (smp_core_id() == 0 && current_task)
+        current_task->locks_held++;
+}
+
+void task_lock_drop(void) {
+    if (smp_core_id() != 0 || !current_task) return;
+    if (--current_task->locks_held || !current_task->kill_pending) return;
+
+    // Exit only with IRQs enabled: masked, we're inside an irqsave
+    // section whose lock task_exit may need. The next drop retries.
+    unsigned long daif;
+    asm volatile("mrs %0, daif" : "=r"(daif));
+    if (daif & (1 << 7)) return;
+    current_task->kill_pending = 0;
+    task_exit();
+}
+
 void task_exit(void) {
     if (!current_task) return;
 
+    fd_close_all(current_task);
+    aio_task_exit(current_task);
+    fs_task_exit(current_task);
+    mmap_task_exit(current_task);
     asm volatile("msr daifset, #2");
     current_task->state = TASK_DEAD;
     asm volatile("msr daifclr, #2");
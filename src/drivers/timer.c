@@ -48,7 +48,7 @@ void timer_handle_irq(void) {
     unsigned long interval = timer_interval;
     if (interval == 0) {
         // Fallback: compute from hardware frequency
-        interval = (timer_get_frequency() / 1000) * 100;
+        interval = (timer_get_frequency() / 1000) * TIMER_TICK_MS;
     }
     asm volatile("msr cntp_tval_el0, %0" :: "r"(interval));
 }
@@ -0,0 +1,297 @@
+// tty.c - Console line discipline
+//
+// The line being edited is buf[0..len) with the terminal cursor over
+// buf[pos]. Every edit changes the buffer first and then redraws from
+// the leftmost changed column, building the echo (text, blanks over
+// what is gone, backspaces to the cursor) into one string for a single
+// uart_puts. Only one task reads the console at a time (the shell, or a
+// command it runs), so there is no lock here.
+
+#include "tty.h"
+#include "uart.h"
+#include "task.h"
+#include "timer.h"
+
+#define KEY_CTRL(c)     ((c) & 0x1F)
+#define KEY_BACKSPACE   0x7F
+#define KEY_ESC         0x1B
+
+// Escape sequences, decoded to codes above the byte range
+#define KEY_UP          0x100
+#define KEY_DOWN        0x101
+#define KEY_RIGHT       0x102
+#define KEY_LEFT        0x103
+#define KEY_HOME        0x104
+#define KEY_END         0x105
+#define KEY_DELETE      0x106
+
+typedef struct {
+    char *buf;
+    int len;
+    int pos;
+    int max;                    // Room including the NUL
+} line_t;
+
+static char history[TTY_HISTORY][TTY_LINE_MAX];
+static int history_count = 0;   // Lines stored
+static int history_write = 0;   // Next slot (circular)
+
+// ---- Input ----
+
+int tty_getc(void) {
+    return uart_getc();
+}
+
+int tty_getc_timeout(unsigned int ms) {
+    unsigned long end = timer_get_tick_count() + (ms + 99) / 100;
+    for (;;) {
+        int c = uart_getc_nonblock();
+        if (c >= 0 || timer_get_tick_count() >= end) return c;
+        task_sleep(100);
+    }
+}
+
+// A key, with CSI / SS3 sequences (ESC [ x, ESC [ n ~, ESC O x) turned
+// into KEY_* codes. Unknown sequences are swallowed.
+static int read_key(void) {
+    int c = tty_getc();
+    if (c != KEY_ESC) return c;
+
+    int c1 = tty_getc();
+    if (c1 != '[' && c1 != 'O') return 0;
+    int c2 = tty_getc();
+    switch (c2) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    }
+    if (c2 < '0' || c2 > '9') return 0;
+    int n = 0;
+    while (c2 >= '0' && c2 <= '9') {
+        n = n * 10 + (c2 - '0');
+        c2 = tty_getc();
+    }
+    if (c2 != '~') return 0;
+    if (n == 1 || n == 7) return KEY_HOME;
+    if (n == 4 || n == 8) return KEY_END;
+    if (n == 3) return KEY_DELETE;
+    return 0;
+}
+
+// ---- Echo ----
+
+// With the terminal cursor at column from, write buf[from..len), blank
+// out erase more columns (text that went away), then back up so the
+// cursor ends over column to
+static void redraw(const line_t *l, int from, int erase, int to) {
+    char out[3 * TTY_LINE_MAX + 1];
+    int n = 0;
+    for (int i = from; i < l->len; i++) out[n++] = l->buf[i];
+    for (int i = 0; i < erase; i++) out[n++] = ' ';
+    for (int i = l->len + erase; i > to; i--) out[n++] = '\b';
+    out[n] = '\0';
+    if (n) uart_puts(out);
+}
+
+static void cursor_to(line_t *l, int to) {
+    if (to < l->pos) {
+        char out[TTY_LINE_MAX + 1];
+        int n = 0;
+        while (n < l->pos - to) out[n++] = '\b';
+        out[n] = '\0';
+        uart_puts(out);
+    } else if (to > l->pos) {
+        int len = l->len;
+        l->len = to;                    // Rewrite the text passed over
+        redraw(l, l->pos, 0, to);
+        l->len = len;
+    }
+    l->pos = to;
+}
+
+// Remove buf[at..at+n) with the cursor left at at
+static void delete_span(line_t *l, int at, int n) {
+    if (n <= 0) return;
+    cursor_to(l, at);
+    for (int i = at; i + n < l->len; i++) l->buf[i] = l->buf[i + n];
+    l->len -= n;
+    redraw(l, at, n, at);
+}
+
+static void insert_char(line_t *l, char c) {
+    if (l->len >= l->max - 1) return;
+    for (int i = l->len; i > l->pos; i--) l->buf[i] = l->buf[i - 1];
+    l->buf[l->pos] = c;
+    l->len++;
+    redraw(l, l->pos, 0, l->pos + 1);
+    l->pos++;
+}
+
+// Replace the whole line (history browsing)
+static void replace_line(line_t *l, const char *text) {
+    int old = l->len;
+    cursor_to(l, 0);
+    int n = 0;
+    while (text[n] && n < l->max - 1) {
+        l->buf[n] = text[n];
+        n++;
+    }
+    l->len = n;
+    redraw(l, 0, old > n ? old - n : 0, n);
+    l->pos = n;
+}
+
+// ---- History ----
+
+static void str_copy(char *dst, const char *src, int max) {
+    int i = 0;
+    while (src[i] && i < max - 1) {
+        dst[i] = src[i];
+        i++;
+    }
+    dst[i] = '\0';
+}
+
+static void history_add(const char *line) {
+    if (line[0] == '\0') return;
+
+    // Not again if it repeats the last one
+    const char *last = tty_history(0);
+    if (last) {
+        int i = 0;
+        while (line[i] && line[i] == last[i]) i++;
+        if (line[i] == last[i]) return;
+    }
+
+    str_copy(history[history_write], line, TTY_LINE_MAX);
+    history_write = (history_write + 1) % TTY_HISTORY;
+    if (history_count < TTY_HISTORY)
+        history_count++;
+}
+
+int tty_history_count(void) {
+    return history_count;
+}
+
+const char *tty_history(int index) {
+    if (index < 0 || index >= history_count) return 0;
+    return history[(history_write - 1 - index + TTY_HISTORY * 2) % TTY_HISTORY];
+}
+
+// ---- Line editor ----
+
+int tty_readline(char *buf, int max, const tty_opts_t *opts) {
+    static const tty_opts_t plain = { 0, 0, 0 };
+    if (!opts) opts = &plain;
+    if (max > TTY_LINE_MAX) max = TTY_LINE_MAX;
+
+    line_t l = { buf, 0, 0, max };
+    int hist = -1;                      // -1 = editing the new line
+    char saved[TTY_LINE_MAX];           // The new line, while browsing
+    buf[0] = '\0';
+
+    while (1) {
+        int c = read_key();
+
+        switch (c) {
+        case '\r':
+        case '\n':
+            cursor_to(&l, l.len);
+            buf[l.len] = '\0';
+            uart_puts("\n");
+            if (opts->history) history_add(buf);
+            return l.len;
+
+        case KEY_CTRL('C'):
+            cursor_to(&l, l.len);
+            uart_puts("^C\n");
+            buf[0] = '\0';
+            return TTY_INTR;
+
+        case KEY_CTRL('D'):
+            if (l.len == 0) {
+                buf[0] = '\0';
+                return TTY_EOF;
+            }
+            if (l.pos < l.len) delete_span(&l, l.pos, 1);
+            break;
+
+        case KEY_BACKSPACE:
+        case KEY_CTRL('H'):
+            if (l.pos > 0) delete_span(&l, l.pos - 1, 1);
+            break;
+
+        case KEY_DELETE:
+            if (l.pos < l.len) delete_span(&l, l.pos, 1);
+            break;
+
+        case KEY_CTRL('W'): {
+            int at = l.pos;
+            while (at > 0 && buf[at - 1] == ' ') at--;
+            while (at > 0 && buf[at - 1] != ' ') at--;
+            delete_span(&l, at, l.pos - at);
+            break;
+        }
+
+        case KEY_CTRL('U'):
+            replace_line(&l, "");
+            break;
+
+        case KEY_LEFT:
+            if (l.pos > 0) cursor_to(&l, l.pos - 1);
+            break;
+
+        case KEY_RIGHT:
+            if (l.pos < l.len) cursor_to(&l, l.pos + 1);
+            break;
+
+        case KEY_HOME:
+        case KEY_CTRL('A'):
+            cursor_to(&l, 0);
+            break;
+
+        case KEY_END:
+        case KEY_CTRL('E'):
+            cursor_to(&l, l.len);
+            break;
+
+        case KEY_CTRL('L'):
+            if (!opts->prompt) break;
+            uart_puts("\033[2J\033[H");
+            opts->prompt();
+            redraw(&l, 0, 0, l.pos);
+            break;
+
+        case '\t':
+            if (!opts->complete) break;
+            cursor_to(&l, l.len);
+            opts->complete(buf, &l.len);
+            if (l.len > max - 1) l.len = max - 1;
+            l.pos = l.len;
+            break;
+
+        case KEY_UP:
+        case KEY_DOWN: {
+            if (!opts->history) break;
+            int want = hist + (c == KEY_UP ? 1 : -1);
+            if (want < -1) break;               // Already on the new line
+            const char *h = want >= 0 ? tty_history(want) : saved;
+            if (!h) break;                      // Past the oldest
+            if (hist == -1) {
+                buf[l.len] = '\0';
+                str_copy(saved, buf, TTY_LINE_MAX);
+            }
+            hist = want;
+            replace_line(&l, h);
+            break;
+        }
+
+        default:
+            if (c >= 32 && c < 127) insert_char(&l, (char)c);
+            break;
+        }
+    }
+}
@@ -1,6 +1,31 @@
 // uart.c - UART driver for Raspberry Pi 4
+//
+// Polled until uart_enable_irq(); after that, output goes through a TX
+// ring that the PL011 TX interrupt feeds into the hardware FIFO, and
+// input arrives through the RX/receive-timeout interrupts into an RX
+// ring. Writers return as soon as their bytes are queued; a writer that
+// finds the ring full feeds the FIFO itself, so output never depends on
+// the IRQ being able to run (IRQs masked, another core). Readers sleep
+// on a wait queue when they can (a task on core 0 with IRQs on) and
+// poll otherwise.
+//
+// A backlog of UART_DMA_MIN bytes or more goes out by DMA instead: the
+// oldest bytes are copied out of the ring, a word per byte (the DMA
+// writes whole words to DR, the PL011 keeps the low byte), and a DMA
+// channel paced by the PL011's TX DREQ feeds them to the FIFO. While a
+// run is in flight it owns DR: the TX interrupt is masked and nothing
+// else writes DR until the channel's interrupt ends the run. Bulk
+// text writers (uart_write) sleep for ring space rather than feed the FIFO.
+//
+// The rings, the DMA run and the interrupt mask are guarded by
+// uart_lock with IRQs masked. Both IRQs are routed to core 0.
 
 #include "uart.h"
+#include "gic.h"
+#include "smp.h"
+#include "task.h"
+#include "kprintf.h"
+#include "dma.h"
 
 // UART0 memory-mapped registers for Raspberry Pi 4
 #define MMIO_BASE       0xFE000000  // Pi 4 peripheral base
@@ -11,7 +36,11 @@
 #define UART0_FBRD      ((volatile unsigned int*)(MMIO_BASE + 0x00201028))
 #define UART0_LCRH      ((volatile unsigned int*)(MMIO_BASE + 0x0020102C))
 #define UART0_CR        ((volatile unsigned int*)(MMIO_BASE + 0x00201030))
+#define UART0_IFLS      ((volatile unsigned int*)(MMIO_BASE + 0x00201034))
+#define UART0_IMSC      ((volatile unsigned int*)(MMIO_BASE + 0x00201038))
+#define UART0_MIS       ((volatile unsigned int*)(MMIO_BASE + 0x00201040))
 #define UART0_ICR       ((volatile unsigned int*)(MMIO_BASE + 0x00201044))
+#define UART0_DMACR     ((volatile unsigned int*)(MMIO_BASE + 0x00201048))
 
 // GPIO registers
 #define GPFSEL1         ((volatile unsigned int*)(MMIO_BASE + 0x00200004))
@@ -21,6 +50,44 @@
 // UART Flag Register bits
 #define UART_FR_RXFE    (1 << 4)    // Receive FIFO empty
 #define UART_FR_TXFF    (1 << 5)    // Transmit FIFO full
+#define UART_FR_BUSY    (1 << 3)    // Still shifting out
+
+// Interrupt bits (IMSC, MIS, ICR)
+#define UART_INT_RX     (1 << 4)    // RX FIFO at trigger level
+#define UART_INT_TX     (1 << 5)    // TX FIFO at or below trigger level
+#define UART_INT_RT     (1 << 6)    // Receive timeout (bytes waiting, line idle)
+
+#define UART_DMACR_TXDMAE (1 << 1)  // Raise TX DREQ while the FIFO has room
+
+#define UART_LCRH_FEN   (1 << 4)    // FIFOs on (off flushes them)
+#define UART_LCRH_8BIT  (3 << 5)    // 8 data bits (no parity, 1 stop bit)
+#define UART_CR_ENABLE  ((1 << 0) | (1 << 8) | (1 << 9))    // UART, TX, RX
+
+#define UART_TX_RING    4096        // Bytes queued for transmit (power of two)
+#define UART_RX_RING    256         // Bytes received, not yet read (power of two)
+#define UART_DMA_MIN    128         // Backlog handed to the DMA rather than the TX IRQ
+#define UART_DMA_MAX    1024        // Bytes per DMA run
+
+_Static_assert(DMA_IRQ(UART_DMA_CH) == UART_DMA_IRQ, "UART_DMA_IRQ");
+
+// Ring indices are free-running; tail - head is the fill level
+static char tx_ring[UART_TX_RING];
+static unsigned int tx_head, tx_tail;
+static char rx_ring[UART_RX_RING];
+static unsigned int rx_head, rx_tail;
+
+static unsigned int dma_words[UART_DMA_MAX] __attribute__((aligned(64)));
+static dma_cb_t dma_cb;
+static int dma_ready;               // Channel set up (cleared after an error)
+static int dma_active;              // A run owns DR until it is finished
+static uart_stats_t stats;
+static unsigned int baud_rate;      // As requested
+static unsigned int baud_div;       // In 64ths: IBRD << 6 | FBRD
+
+static spinlock_t uart_lock = SPINLOCK_INIT;
+static wait_queue_t rx_wait = WAIT_QUEUE_INIT;
+static wait_queue_t tx_wait = WAIT_QUEUE_INIT;
+static volatile int irq_mode = 0;
 
 // Simple delay function
 static void delay(unsigned int count) {
@@ -29,6 +96,24 @@ static void delay(unsigned int count) {
     }
 }
 
+// The baud divisor is UARTCLK / (16 * rate), which the PL011 takes as
+// a 16-bit integer part (IBRD) and 6-bit fraction (FBRD). In 64ths that
+// is UARTCLK * 4 / rate, rounded. Returns 0 if rate can't be made.
+static unsigned int baud_divisor(unsigned long rate) {
+    if (!rate || rate > UART_BAUD_MAX) return 0;
+    unsigned long div = ((unsigned long)UART_CLOCK * 4 + rate / 2) / rate;
+    if (div < 64 || div > 0xFFFFUL << 6) return 0;      // IBRD 1..65535
+    return (unsigned int)div;
+}
+
+// Program the divisor and line format (UART disabled). The PL011
+// latches IBRD/FBRD on the LCRH write that follows them.
+static void set_line(unsigned int div) {
+    *UART0_IBRD = div >> 6;
+    *UART0_FBRD = div & 63;
+    *UART0_LCRH = UART_LCRH_FEN | UART_LCRH_8BIT;
+}
+
 // Initialize UART
 void uart_init(void) {
     // Disable UART0
@@ -52,129 +137,324 @@ void uart_init(void) {
     // Clear pending interrupts
     *UART0_ICR = 0x7FF;
     
-    // Set baud rate to 115200
-    // UART clock = 48MHz on Pi 4, divider = 48000000 / (16 * 115200) = 26.04
-    *UART0_IBRD = 26;
-    *UART0_FBRD = 3;
-    
-    // Enable FIFO, 8-bit data transmission
-    *UART0_LCRH = (1 << 4) | (1 << 5) | (1 << 6);
+    // Baud rate (UART_BAUD, 115200 unless built with BAUD=), 8N1, FIFOs on
+    baud_rate = UART_BAUD;
+    baud_div = baud_divisor(UART_BAUD);
+    if (!baud_div) {
+        baud_rate = 115200;
+        baud_div = baud_divisor(115200);
+    }
+    set_line(baud_div);
     
     // Enable UART0, receive, and transmit
-    *UART0_CR = (1 << 0) | (1 << 8) | (1 << 9);
+    *UART0_CR = UART_CR_ENABLE;
+}
+
+// ---- Rings and DMA runs (caller holds uart_lock) ----
+
+// Hand up to UART_DMA_MAX of the oldest queued bytes to the DMA
+// channel. They are copied out, so their ring space is free at once.
+static void tx_dma_start(void) {
+    unsigned int n = tx_tail - tx_head;
+    if (n > UART_DMA_MAX) n = UART_DMA_MAX;
+    for (unsigned int i = 0; i < n; i++)
+        dma_words[i] = (unsigned char)tx_ring[tx_head++ % UART_TX_RING];
+    dma_clean(dma_words, n * sizeof(dma_words[0]));
+
+    dma_cb.ti = DMA_TI_INTEN | DMA_TI_WAIT_RESP | DMA_TI_DEST_DREQ | DMA_TI_SRC_INC |
+                DMA_TI_PERMAP(DMA_DREQ_UART0_TX) | DMA_TI_NO_WIDE;
+    dma_cb.source_ad = dma_bus_addr(dma_words);
+    dma_cb.dest_ad = dma_periph_addr((unsigned long)UART0_DR);
+    dma_cb.txfr_len = n * sizeof(dma_words[0]);
+    dma_cb.stride = 0;
+    dma_cb.nextconbk = 0;
+
+    *UART0_IMSC &= ~UART_INT_TX;
+    dma_active = 1;
+    dma_start(UART_DMA_CH, &dma_cb);
+    stats.dma_runs++;
+    stats.dma_bytes += n;
+}
+
+// End the run in flight, waiting for the channel if it is still going
+// (a writer that needs DR or ring space now). An error turns DMA off
+// for good: output carries on through the TX interrupt.
+static void tx_dma_finish(void) {
+    while (dma_busy(UART_DMA_CH)) { }
+    if (dma_ack(UART_DMA_CH) < 0) {
+        stats.dma_errors++;
+        dma_ready = 0;
+        *UART0_DMACR = 0;
+    }
+    dma_active = 0;
+}
+
+// Move queued bytes towards the line: a large backlog by DMA, the rest
+// into the TX FIFO while it has room. The TX interrupt stays unmasked
+// exactly while bytes remain queued and no run is in flight.
+static void tx_fill(void) {
+    if (dma_active) return;
+    if (dma_ready && tx_tail - tx_head >= UART_DMA_MIN) {
+        tx_dma_start();
+        return;
+    }
+    while (tx_head != tx_tail && !(*UART0_FR & UART_FR_TXFF))
+        *UART0_DR = tx_ring[tx_head++ % UART_TX_RING];
+    if (tx_head != tx_tail) *UART0_IMSC |= UART_INT_TX;
+    else *UART0_IMSC &= ~UART_INT_TX;
+}
+
+static void tx_put(char c) {
+    while (tx_tail - tx_head >= UART_TX_RING) {
+        // Full: make room now rather than wait for an IRQ
+        if (dma_active) tx_dma_finish();
+        if (dma_ready) {
+            tx_dma_start();
+            continue;
+        }
+        while (*UART0_FR & UART_FR_TXFF) { }
+        *UART0_DR = tx_ring[tx_head++ % UART_TX_RING];
+    }
+    tx_ring[tx_tail++ % UART_TX_RING] = c;
+}
+
+// Move received bytes from the RX FIFO into the ring. Returns how many.
+static int rx_drain(void) {
+    int n = 0;
+    while (!(*UART0_FR & UART_FR_RXFE)) {
+        char c = (char)(*UART0_DR & 0xFF);
+        if (rx_tail - rx_head < UART_RX_RING) {
+            rx_ring[rx_tail++ % UART_RX_RING] = c;
+            n++;
+        } else {
+            stats.rx_dropped++;
+        }
+    }
+    return n;
+}
+
+// Writers asleep for ring space go once half of it is free
+static int tx_wake_due(void) {
+    return tx_wait.head && tx_tail - tx_head <= UART_TX_RING / 2;
+}
+
+// A reader or writer may sleep if it is a task on core 0 (where the
+// IRQs go) and had IRQs enabled before taking uart_lock
+static int can_sleep(unsigned long daif) {
+    return smp_core_id() == 0 && !(daif & (1UL << 7)) && get_current_task();
+}
+
+// ---- Interrupts ----
+
+void uart_enable_irq(void) {
+    unsigned long irq = spin_lock_irqsave(&uart_lock);
+    *UART0_ICR = 0x7FF;
+    *UART0_IMSC = UART_INT_RX | UART_INT_RT;
+    dma_init_channel(UART_DMA_CH);
+    *UART0_DMACR = UART_DMACR_TXDMAE;
+    dma_ready = 1;
+    irq_mode = 1;
+    spin_unlock_irqrestore(&uart_lock, irq);
+    gic_enable_interrupt(UART_IRQ);
+    gic_enable_interrupt(UART_DMA_IRQ);
+}
+
+void uart_handle_irq(void) {
+    spin_lock(&uart_lock);
+    *UART0_ICR = *UART0_MIS;
+    int got = rx_drain();
+    tx_fill();
+    int room = tx_wake_due();
+    spin_unlock(&uart_lock);
+    if (got) wake_up_all(&rx_wait);
+    if (room) wake_up_all(&tx_wait);
+}
+
+void uart_handle_dma_irq(void) {
+    spin_lock(&uart_lock);
+    if (!dma_busy(UART_DMA_CH)) {
+        if (dma_active) {
+            tx_dma_finish();
+            tx_fill();
+        } else {
+            dma_ack(UART_DMA_CH);   // A run tx_dma_finish() already ended
+        }
+    }
+    int room = tx_wake_due();
+    spin_unlock(&uart_lock);
+    if (room) wake_up_all(&tx_wait);
 }
 
+// ---- Output ----
+
 // Send a character via UART
 void uart_putc(unsigned char c) {
-    // Wait for UART to become ready to transmit
-    while(*UART0_FR & UART_FR_TXFF) { }
-    *UART0_DR = c;
+    if (!irq_mode) {
+        // Wait for UART to become ready to transmit
+        while(*UART0_FR & UART_FR_TXFF) { }
+        *UART0_DR = c;
+        return;
+    }
+    unsigned long irq = spin_lock_irqsave(&uart_lock);
+    tx_put((char)c);
+    tx_fill();
+    spin_unlock_irqrestore(&uart_lock, irq);
 }
 
 // Send a string via UART
 void uart_puts(const char* str) {
+    if (!irq_mode) {
+        while(*str) {
+            if(*str == '\n') {
+                uart_putc('\r');  // Add carriage return for newlines
+            }
+            uart_putc(*str++);
+        }
+        return;
+    }
+    // Queue the whole string under one lock hold, so strings from
+    // different cores don't interleave
+    unsigned long irq = spin_lock_irqsave(&uart_lock);
     while(*str) {
-        if(*str == '\n') {
-            uart_putc('\r');  // Add carriage return for newlines
+        if(*str == '\n') tx_put('\r');
+        tx_put(*str++);
+    }
+    tx_fill();
+    spin_unlock_irqrestore(&uart_lock, irq);
+}
+
+// Queue len bytes of text, sleeping while the ring is full when the
+// caller can, so a large write leaves the CPU to other tasks while the
+// DMA drains it. The length ends it, not a NUL, but '\n' still goes out
+// as "\r\n" like uart_puts: terminal text, not a raw byte stream.
+void uart_write(const char *buf, unsigned long len) {
+    if (!irq_mode) {
+        while (len--) {
+            if (*buf == '\n') uart_putc('\r');
+            uart_putc((unsigned char)*buf++);
+        }
+        return;
+    }
+    unsigned long irq = spin_lock_irqsave(&uart_lock);
+    while (len) {
+        if (UART_TX_RING - (tx_tail - tx_head) < 2 && can_sleep(irq)) {
+            tx_fill();
+            task_wait(&tx_wait, &uart_lock, irq);
+            irq = spin_lock_irqsave(&uart_lock);
+            continue;
         }
-        uart_putc(*str++);
+        if (*buf == '\n') tx_put('\r');
+        tx_put(*buf++);
+        len--;
+    }
+    tx_fill();
+    spin_unlock_irqrestore(&uart_lock, irq);
+}
+
+// Send everything queued by hand and wait for the line to go idle
+// (caller holds uart_lock)
+static void tx_drain(void) {
+    if (dma_active) tx_dma_finish();
+    while (tx_head != tx_tail) {
+        while (*UART0_FR & UART_FR_TXFF) { }
+        *UART0_DR = tx_ring[tx_head++ % UART_TX_RING];
     }
+    if (irq_mode) *UART0_IMSC &= ~UART_INT_TX;
+    while (*UART0_FR & UART_FR_BUSY) { }
+}
+
+void uart_flush(void) {
+    unsigned long irq = spin_lock_irqsave(&uart_lock);
+    tx_drain();
+    spin_unlock_irqrestore(&uart_lock, irq);
+}
+
+int uart_set_baud(unsigned long rate) {
+    unsigned int div = baud_divisor(rate);
+    if (!div) return -1;
+
+    unsigned long irq = spin_lock_irqsave(&uart_lock);
+    tx_drain();                     // Queued output goes at the old rate
+    if (irq_mode) rx_drain();       // Disabling the FIFOs drops their contents
+    *UART0_CR = 0;
+    *UART0_LCRH = UART_LCRH_8BIT;   // Flush the FIFOs
+    set_line(div);
+    *UART0_CR = UART_CR_ENABLE;
+    baud_rate = (unsigned int)rate;
+    baud_div = div;
+    spin_unlock_irqrestore(&uart_lock, irq);
+    return 0;
+}
+
+unsigned int uart_get_baud(unsigned int *actual) {
+    if (actual) *actual = (unsigned int)((unsigned long)UART_CLOCK * 4 / baud_div);
+    return baud_rate;
 }
 
 // Print a number in hexadecimal
 void uart_put_hex(unsigned long value) {
-    const char hex_chars[] = "0123456789ABCDEF";
-    uart_puts("0x");
-    for(int i = 60; i >= 0; i -= 4) {
-        uart_putc(hex_chars[(value >> i) & 0xF]);
-    }
+    kprintf("0x%016lX", value);
 }
 
 // Print a number in decimal
 void uart_put_dec(unsigned long value) {
-    if(value == 0) {
-        uart_putc('0');
-        return;
-    }
-    
-    char buffer[20];
-    int i = 0;
-    
-    while(value > 0) {
-        buffer[i++] = '0' + (value % 10);
-        value /= 10;
-    }
-    
-    while(i > 0) {
-        uart_putc(buffer[--i]);
-    }
+    kprintf("%lu", value);
 }
 
+// ---- Input ----
+
 // Check if data is available to read
 int uart_has_data(void) {
-    return !(*UART0_FR & UART_FR_RXFE);
+    if (!irq_mode) return !(*UART0_FR & UART_FR_RXFE);
+    unsigned long irq = spin_lock_irqsave(&uart_lock);
+    rx_drain();
+    int has = rx_head != rx_tail;
+    spin_unlock_irqrestore(&uart_lock, irq);
+    return has;
 }
 
 // Read a character (blocking)
 unsigned char uart_getc(void) {
-    // Wait until data is available
-    while(*UART0_FR & UART_FR_RXFE) { }
-    return (unsigned char)(*UART0_DR & 0xFF);
+    if (!irq_mode) {
+        // Wait until data is available
+        while(*UART0_FR & UART_FR_RXFE) { }
+        return (unsigned char)(*UART0_DR & 0xFF);
+    }
+    unsigned long irq = spin_lock_irqsave(&uart_lock);
+    for (;;) {
+        rx_drain();                 // Bytes the IRQ hasn't collected yet
+        if (rx_head != rx_tail) break;
+        if (can_sleep(irq)) {
+            task_wait(&rx_wait, &uart_lock, irq);
+        } else {
+            spin_unlock_irqrestore(&uart_lock, irq);
+            asm volatile("yield");
+        }
+        irq = spin_lock_irqsave(&uart_lock);
+    }
+    unsigned char c = (unsigned char)rx_ring[rx_head++ % UART_RX_RING];
+    spin_unlock_irqrestore(&uart_lock, irq);
+    return c;
 }
 
 // Read a character (non-blocking)
 // Returns -1 if no data available
 int uart_getc_nonblock(void) {
-    if(*UART0_FR & UART_FR_RXFE) {
-        return -1;
+    if (!irq_mode) {
+        if(*UART0_FR & UART_FR_RXFE) {
+            return -1;
+        }
+        return (int)(*UART0_DR & 0xFF);
     }
-    return (int)(*UART0_DR & 0xFF);
+    unsigned long irq = spin_lock_irqsave(&uart_lock);
+    rx_drain();
+    int c = rx_head != rx_tail ? (unsigned char)rx_ring[rx_head++ % UART_RX_RING] : -1;
+    spin_unlock_irqrestore(&uart_lock, irq);
+    return c;
 }
 
-// Read a line of input with echo
-// Supports backspace and basic line editing
-void uart_gets(char* buffer, int max_len) {
-    int pos = 0;
-    
-    while(1) {
-        unsigned char c = uart_getc();
-        
-        // Handle Enter/Return
-        if(c == '\r' || c == '\n') {
-            buffer[pos] = '\0';
-            uart_puts("\n");
-            return;
-        }
-        
-        // Handle Backspace (0x7F or 0x08)
-        if(c == 0x7F || c == 0x08) {
-            if(pos > 0) {
-                pos--;
-                uart_puts("\b \b");  // Erase character on screen
-            }
-            continue;
-        }
-        
-        // Handle Ctrl+C
-        if(c == 0x03) {
-            uart_puts("^C\n");
-            buffer[0] = '\0';
-            return;
-        }
-        
-        // Handle Ctrl+U (clear line)
-        if(c == 0x15) {
-            while(pos > 0) {
-                uart_puts("\b \b");
-                pos--;
-            }
-            continue;
-        }
-        
-        // Handle printable characters
-        if(c >= 32 && c < 127 && pos < max_len - 1) {
-            buffer[pos++] = c;
-            uart_putc(c);  // Echo character
-        }
-    }
+void uart_stats(uart_stats_t *st) {
+    unsigned long irq = spin_lock_irqsave(&uart_lock);
+    *st = stats;
+    spin_unlock_irqrestore(&uart_lock, irq);
 }
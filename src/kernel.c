@@ -8,6 +8,19 @@
 #include "memory.h"
 #include "mmu.h"
 #include "fs.h"
+#include "fd.h"
+#include "aio.h"
+#include "mmap.h"
+#include "block.h"
+#include "sdhci.h"
+#include "fat.h"
+#include "snapshot.h"
+#include "procfs.h"
+#include "klog.h"
+#include "kprintf.h"
+#include "initramfs.h"
+#include "fdt.h"
+#include "tty.h"
 #include "smp.h"
 
 static volatile int scheduler_enabled = 0;
@@ -16,6 +29,16 @@ static volatile int scheduler_enabled = 0;
 
 unsigned long irq_handler_c(unsigned long sp) {
     unsigned int core = smp_core_id();
+    smp_get_core_info(core)->irqs++;
+
+    // Acknowledge in the GIC (1023 = nothing there: the timer is also
+    // checked directly below)
+    unsigned int id = gic_get_interrupt();
+    if (id == UART_IRQ)
+        uart_handle_irq();
+    else if (id == UART_DMA_IRQ)
+        uart_handle_dma_irq();
+
     unsigned long ctl;
     asm volatile("mrs %0, cntp_ctl_el0" : "=r"(ctl));
 
@@ -33,9 +56,36 @@ unsigned long irq_handler_c(unsigned long sp) {
         }
     }
 
+    if (id < 1020)
+        gic_end_interrupt(id);
     return sp;
 }
 
+// ========== Synchronous Exception Handler ==========
+
+// A fault nothing resolves kills the task that took it; in the shell,
+// or before tasks run, it halts the system
+void sync_handler_c(unsigned long *frame) {
+    unsigned long esr, far;
+    asm volatile("mrs %0, esr_el1" : "=r"(esr));
+    asm volatile("mrs %0, far_el1" : "=r"(far));
+    smp_get_core_info(smp_core_id())->faults++;
+    if (mmap_fault(far, esr) == 0) return;      // Copy-on-write: retry
+
+    kprintf("\n*** Fault: ESR=0x%016lX FAR=0x%016lX ELR=0x%016lX\n", esr, far, frame[31]);
+
+    task_t *task = get_current_task();
+    if (smp_core_id() == 0 && scheduler_enabled && task && task->id != 0) {
+        kprintf("*** Killing task %u (%s)\n", task->id, task->name);
+        frame[31] = (unsigned long)task_exit;   // Return into task_exit
+        frame[32] &= ~(1UL << 7);               // ...with IRQs unmasked
+        return;
+    }
+    uart_puts("*** System halted\n");
+    klog_flush();
+    for (;;) asm volatile("wfe");
+}
+
 // ========== String Utilities ==========
 
 static int str_eq(const char *s1, const char *s2) {
@@ -69,58 +119,113 @@ static unsigned long parse_num(const char *s) {
     return val;
 }
 
-// ========== Shell: Command History ==========
-
-#define HISTORY_SIZE 16
 #define LINE_MAX     128
 
-static char history[HISTORY_SIZE][LINE_MAX];
-static int history_count = 0;    // Total commands stored
-static int history_write = 0;    // Next write position (circular)
-
-static void history_add(const char *cmd) {
-    if (cmd[0] == '\0') return;  // Don't store empty commands
-
-    // Don't store duplicate of last command
-    if (history_count > 0) {
-        int last = (history_write - 1 + HISTORY_SIZE) % HISTORY_SIZE;
-        if (str_eq(history[last], cmd)) return;
-    }
-
-    str_cpy(history[history_write], cmd);
-    history_write = (history_write + 1) % HISTORY_SIZE;
-    if (history_count < HISTORY_SIZE)
-        history_count++;
-}
-
-static const char *history_get(int index) {
-    // index 0 = most recent, 1 = one before that, etc.
-    if (index < 0 || index >= history_count) return 0;
-    int pos = (history_write - 1 - index + HISTORY_SIZE * 2) % HISTORY_SIZE;
-    return history[pos];
-}
-
 // ========== Shell: Tab Completion ==========
 
 // Print the current shell prompt (used by tab complete, Ctrl+L, top)
 static void print_prompt(void) {
     char path[FS_PATH_MAX];
     fs_get_path(fs_get_cwd(), path, FS_PATH_MAX);
-    uart_puts("rpi4:");
-    uart_puts(path);
-    uart_puts("> ");
+    kprintf("rpi4:%s> ", path);
 }
 
 static const char *commands[] = {
-    "help", "time", "info", "clear", "ps", "spawn", "memtest",
+    "help", "time", "info", "clear", "ps", "spawn", "pipedemo", "memtest",
     "mem", "alloc", "pgalloc", "pgfree", "kill", "top", "history", "mmu",
     "ls", "cd", "pwd", "mkdir", "rmdir", "touch", "cat", "write", "rm", "cpus",
-    0
+    "df", "compress", "uncompress", "mkfifo", "aiotest", "blk", "sync",
+    "mount", "snapshot", "reboot", "cksum", "verify", "mmaptest", "maps",
+    "baud", 0
 };
 
+// Insert text at the end of the line being edited, echoing it
+static void line_insert(char *buf, int *pos, const char *text, int n) {
+    for (int i = 0; i < n && *pos < LINE_MAX - 1; i++) {
+        buf[*pos] = text[i];
+        uart_putc(text[i]);
+        (*pos)++;
+    }
+}
+
+// Complete the path in buf[start..*pos) against the entries of its
+// directory: a unique match is filled in (with '/' for directories),
+// several are extended to their common prefix or listed.
+static void path_complete(char *buf, int *pos, int start) {
+    // Split the word into directory part and name prefix
+    int slash = -1;
+    for (int i = start; i < *pos; i++)
+        if (buf[i] == '/') slash = i;
+
+    fs_node_t *dir;
+    if (slash < 0) {
+        dir = fs_get_cwd();
+    } else {
+        char dpath[LINE_MAX];
+        int n = 0;
+        for (int i = start; i <= slash; i++) dpath[n++] = buf[i];
+        dpath[n] = '\0';
+        dir = fs_resolve(dpath);
+    }
+    if (!dir || dir->type != FS_DIR) return;
+
+    const char *prefix = &buf[slash < 0 ? start : slash + 1];
+    int plen = &buf[*pos] - prefix;
+
+    char first[FS_NAME_MAX];
+    fs_node_type_t first_type = FS_FILE;
+    int matches = 0, common = 0;
+
+    fs_dirent_t ents[8];
+    fs_dir_cursor_t cur = {0};
+    int n;
+    while ((n = fs_readdir(dir, &cur, ents, 8)) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (str_neq(ents[i].name, prefix, plen) != 0) continue;
+            if (matches++ == 0) {
+                str_cpy(first, ents[i].name);
+                first_type = ents[i].type;
+                common = str_len(first);
+            } else {
+                int j = plen;
+                while (j < common && first[j] == ents[i].name[j]) j++;
+                common = j;
+            }
+        }
+    }
+
+    if (matches == 1) {
+        line_insert(buf, pos, first + plen, common - plen);
+        line_insert(buf, pos, first_type == FS_DIR ? "/" : " ", 1);
+    } else if (matches > 1 && common > plen) {
+        line_insert(buf, pos, first + plen, common - plen);
+    } else if (matches > 1) {
+        // Nothing more to fill in: show the candidates
+        uart_puts("\n");
+        fs_dir_cursor_t c2 = {0};
+        while ((n = fs_readdir(dir, &c2, ents, 8)) > 0) {
+            for (int i = 0; i < n; i++) {
+                if (str_neq(ents[i].name, prefix, plen) != 0) continue;
+                kprintf("  %s%s\n", ents[i].name, ents[i].type == FS_DIR ? "/" : "");
+            }
+        }
+        print_prompt();
+        kprintf("%.*s", *pos, buf);
+    }
+}
+
 static void tab_complete(char *buf, int *pos) {
     if (*pos == 0) return;
 
+    // Past the command word: complete a path argument instead
+    int arg = -1;
+    for (int i = 0; i < *pos; i++)
+        if (buf[i] == ' ') arg = i + 1;
+    if (arg >= 0) {
+        path_complete(buf, pos, arg);
+        return;
+    }
+
     // Find all matching commands
     const char *match = 0;
     int match_count = 0;
@@ -160,176 +265,143 @@ static void tab_complete(char *buf, int *pos) {
                 if (commands[i][j] != buf[j]) { ok = 0; break; }
                 if (commands[i][j] == '\0') { ok = 0; break; }
             }
-            if (ok) {
-                uart_puts("  ");
-                uart_puts(commands[i]);
-                uart_puts("\n");
-            }
+            if (ok) kprintf("  %s\n", commands[i]);
         }
         // Reprint prompt and current input
         print_prompt();
-        for (int i = 0; i < *pos; i++)
-            uart_putc(buf[i]);
+        kprintf("%.*s", *pos, buf);
     }
 }
 
-// ========== Shell: Line Editor ==========
-
-static void shell_readline(char *buf) {
-    int pos = 0;
-    int hist_idx = -1;  // -1 = not browsing history
-    char saved[LINE_MAX];  // Save current input when browsing history
-    saved[0] = '\0';
+static const tty_opts_t shell_tty = { print_prompt, tab_complete, 1 };
 
-    buf[0] = '\0';
-
-    while (1) {
-        unsigned char c = uart_getc();
-
-        // ---- Enter ----
-        if (c == '\r' || c == '\n') {
-            buf[pos] = '\0';
-            uart_puts("\n");
-            history_add(buf);
-            return;
-        }
-
-        // ---- Backspace ----
-        if (c == 0x7F || c == 0x08) {
-            if (pos > 0) {
-                pos--;
-                uart_puts("\b \b");
-            }
-            continue;
-        }
-
-        // ---- Ctrl+C ----
-        if (c == 0x03) {
-            uart_puts("^C\n");
-            buf[0] = '\0';
-            return;
-        }
+// ========== Demo Tasks ==========
 
-        // ---- Ctrl+U (clear line) ----
-        if (c == 0x15) {
-            while (pos > 0) {
-                uart_puts("\b \b");
-                pos--;
-            }
-            continue;
-        }
+static void task_counter(void) {
+    for (int i = 1; i <= 5; i++) {
+        klogf("[counter] %d/5", i);
+        task_sleep(1000);
+    }
+    klog("[counter] finished");
+}
 
-        // ---- Ctrl+A (home) ----
-        if (c == 0x01) {
-            while (pos > 0) {
-                uart_putc('\b');
-                pos--;
-            }
-            continue;
-        }
+static void task_spinner(void) {
+    const char spin[] = "|/-\\";
+    for (int i = 0; i < 20; i++) {
+        klogf("[spinner] %c", spin[i % 4]);
+        task_sleep(500);
+    }
+    klog("[spinner] finished");
+}
 
-        // ---- Ctrl+E (end - already at end in this simple impl) ----
-        if (c == 0x05) {
-            continue;
-        }
+// Descriptors of the pipedemo pipe. Both tasks inherit the shell's
+// table, so the numbers are the same in each; every task closes the end
+// it doesn't use, or the reader would never see EOF.
+static int pipedemo_fds[2];
 
-        // ---- Ctrl+L (clear screen, reprint prompt) ----
-        if (c == 0x0C) {
-            uart_puts("\033[2J\033[H");
-            print_prompt();
-            for (int i = 0; i < pos; i++)
-                uart_putc(buf[i]);
-            continue;
-        }
+// Writes a few lines into the pipe; the consumer blocks until each arrives
+static void task_producer(void) {
+    fd_close(pipedemo_fds[0]);
+    int fd = pipedemo_fds[1];
+    for (int i = 1; i <= 5; i++) {
+        char line[16];
+        int n = ksnprintf(line, sizeof(line), "message %d\n", i);
+        fd_write(fd, line, n);
+        task_sleep(500);
+    }
+    fd_close(fd);
+    klog("[producer] done");
+}
 
-        // ---- Tab ----
-        if (c == '\t') {
-            tab_complete(buf, &pos);
-            continue;
-        }
+static void task_consumer(void) {
+    fd_close(pipedemo_fds[1]);
+    int fd = pipedemo_fds[0];
+    char buf[64];
+    long n;
+    while ((n = fd_read(fd, buf, sizeof(buf))) > 0)
+        klogf("[consumer] got: %.*s", (int)n, buf);
+    fd_close(fd);
+    klog("[consumer] EOF");
+}
 
-        // ---- Escape sequence (arrows) ----
-        if (c == 0x1B) {
-            // Read next two bytes of escape sequence
-            unsigned char seq1 = uart_getc();
-            if (seq1 != '[') continue;  // Not a CSI sequence
-            unsigned char seq2 = uart_getc();
-
-            if (seq2 == 'A') {
-                // ---- Up arrow: previous command ----
-                int new_idx = hist_idx + 1;
-                const char *h = history_get(new_idx);
-                if (h) {
-                    // Save current input if first time browsing
-                    if (hist_idx == -1) {
-                        for (int i = 0; i < pos; i++) saved[i] = buf[i];
-                        saved[pos] = '\0';
-                    }
-                    hist_idx = new_idx;
-                    // Erase current line
-                    while (pos > 0) { uart_puts("\b \b"); pos--; }
-                    // Copy history entry
-                    str_cpy(buf, h);
-                    pos = str_len(buf);
-                    for (int i = 0; i < pos; i++) uart_putc(buf[i]);
-                }
-            } else if (seq2 == 'B') {
-                // ---- Down arrow: next command ----
-                if (hist_idx > 0) {
-                    hist_idx--;
-                    const char *h = history_get(hist_idx);
-                    while (pos > 0) { uart_puts("\b \b"); pos--; }
-                    if (h) {
-                        str_cpy(buf, h);
-                        pos = str_len(buf);
-                        for (int i = 0; i < pos; i++) uart_putc(buf[i]);
-                    }
-                } else if (hist_idx == 0) {
-                    // Restore saved input
-                    hist_idx = -1;
-                    while (pos > 0) { uart_puts("\b \b"); pos--; }
-                    str_cpy(buf, saved);
-                    pos = str_len(buf);
-                    for (int i = 0; i < pos; i++) uart_putc(buf[i]);
-                }
-            }
-            // Ignore other escape sequences (left/right arrows, etc.)
-            continue;
-        }
+// Two dependent batches through the async rings: create + write, then
+// stat + read back. Each completion reports the core that ran it.
+static void aio_print(const aio_cqe_t *c) {
+    static const char *ops[] = { "?", "read", "write", "create", "unlink", "stat" };
+    const char *op = ops[c->user_data < 6 ? c->user_data : 0];
+    if (c->res < 0) kprintf("  %s -> error (core %u)\n", op, c->core);
+    else kprintf("  %s -> %ld (core %u)\n", op, (long)c->res, c->core);
+}
 
-        // ---- Printable characters ----
-        if (c >= 32 && c < 127 && pos < LINE_MAX - 1) {
-            buf[pos++] = c;
-            uart_putc(c);
+static void cmd_aiotest(void) {
+    static const char msg[] = "written asynchronously\n";
+    char buf[64];
+    fs_dirent_t st;
+    aio_cqe_t cqe[4];
+
+    // A failed prep leaves the ones before it queued: submit and reap
+    // those anyway, so nothing waits for a request that was never made
+    // and no request outlives the stack buffers it points at
+    int queued = (aio_prep(AIO_CREATE, "aio.txt", 0, 0, 0, AIO_CREATE) == 0) +
+                 (aio_prep(AIO_WRITE, "aio.txt", (void *)msg, sizeof(msg) - 1, 0, AIO_WRITE) == 0);
+    if (queued < 2) uart_puts("aiotest: ring full\n");
+    kprintf("batch 1: submitted %d\n", aio_submit());
+    int n = aio_reap(cqe, 4, queued);
+    for (int i = 0; i < n; i++) aio_print(&cqe[i]);
+    if (queued < 2) return;
+
+    queued = (aio_prep(AIO_STAT, "aio.txt", &st, 0, 0, AIO_STAT) == 0) +
+             (aio_prep(AIO_READ, "aio.txt", buf, sizeof(buf) - 1, 0, AIO_READ) == 0);
+    if (queued < 2) uart_puts("aiotest: ring full\n");
+    kprintf("batch 2: submitted %d\n", aio_submit());
+    n = aio_reap(cqe, 4, queued);
+    for (int i = 0; i < n; i++) {
+        aio_print(&cqe[i]);
+        if (cqe[i].user_data == AIO_STAT && cqe[i].res == 0) {
+            kprintf("    size %lu\n", (unsigned long)st.size);
+        } else if (cqe[i].user_data == AIO_READ && cqe[i].res > 0) {
+            buf[cqe[i].res] = '\0';
+            kprintf("    %s", buf);
         }
     }
 }
 
-// ========== Demo Tasks ==========
+// Shared and private mappings of one file, next to descriptor I/O
+static void cmd_mmaptest(void) {
+    static const char msg[] = "mapped file\n";
+    char buf[32];
 
-static void task_counter(void) {
-    for (int i = 1; i <= 5; i++) {
-        uart_puts("[counter] ");
-        uart_put_dec(i);
-        uart_puts("/5\n");
-        task_sleep(1000);
+    int fd = fd_open("mmap.txt", O_CREAT | O_RDWR | O_TRUNC);
+    if (fd < 0 || fd_write(fd, msg, sizeof(msg) - 1) != sizeof(msg) - 1) {
+        uart_puts("mmaptest: can't create mmap.txt\n");
+        if (fd >= 0) fd_close(fd);
+        return;
     }
-    uart_puts("[counter] finished\n");
-}
-
-static void task_spinner(void) {
-    const char spin[] = "|/-\\";
-    for (int i = 0; i < 20; i++) {
-        uart_puts("[spinner] ");
-        uart_putc(spin[i % 4]);
-        uart_puts("\n");
-        task_sleep(500);
+    char *shared = (char *)fs_mmap(fd, 0, sizeof(msg) - 1, PROT_READ | PROT_WRITE, MAP_SHARED);
+    char *priv = (char *)fs_mmap(fd, 0, sizeof(msg) - 1, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+    if (!shared || !priv) {
+        if (shared) fs_munmap(shared, sizeof(msg) - 1);
+        fd_close(fd);
+        return;
     }
-    uart_puts("[spinner] finished\n");
+
+    shared[0] = 'M';                            // A file write
+    priv[0] = 'P';                              // Faults in a private copy
+    fd_lseek(fd, 7, SEEK_SET);
+    fd_write(fd, "F", 1);                       // Seen by the shared mapping
+
+    fd_lseek(fd, 0, SEEK_SET);
+    long n = fd_read(fd, buf, sizeof(buf) - 1);
+    buf[n > 0 ? n : 0] = '\0';
+    kprintf("file:    %sshared:  %sprivate: %s", buf, shared, priv);
+
+    fs_munmap(priv, sizeof(msg) - 1);
+    fs_munmap(shared, sizeof(msg) - 1);
+    fd_close(fd);
 }
 
 static void task_memtest(void) {
-    uart_puts("[memtest] Allocating buffers...\n");
+    klog("[memtest] Allocating buffers...");
 
     volatile char *buf1 = (volatile char *)kmalloc(64);
     volatile char *buf2 = (volatile char *)kmalloc(256);
@@ -340,9 +412,7 @@ static void task_memtest(void) {
         for (int i = 0; i < 256; i++) buf2[i] = 'B';
         for (int i = 0; i < 1024; i++) buf3[i] = 'C';
 
-        uart_puts("[memtest] Verifying: ");
-        uart_putc(buf1[0]); uart_putc(buf2[0]); uart_putc(buf3[0]);
-        uart_puts(" (expect ABC)\n");
+        klogf("[memtest] Verifying: %c%c%c (expect ABC)", buf1[0], buf2[0], buf3[0]);
 
         task_sleep(2000);
 
@@ -354,16 +424,14 @@ static void task_memtest(void) {
         if (page) {
             volatile char *p = (volatile char *)page;
             for (int i = 0; i < 4096; i++) p[i] = 'X';
-            uart_puts("[memtest] Page write OK\n");
+            klog("[memtest] Page write OK");
             page_free(page);
         }
     } else {
-        uart_puts("[memtest] Allocation failed!\n");
+        klog("[memtest] Allocation failed!");
     }
 
-    uart_puts("[memtest] Done. Free: ");
-    uart_put_dec(memory_get_free_pages());
-    uart_puts(" pages\n");
+    klogf("[memtest] Done. Free pages: %lu", memory_get_free_pages());
 }
 
 // ========== Command Processor ==========
@@ -386,6 +454,10 @@ static void cmd_help(void) {
     uart_puts("  clear         Clear screen\n");
     uart_puts("  ps            List all tasks\n");
     uart_puts("  spawn         Launch demo tasks (counter + spinner)\n");
+    uart_puts("  pipedemo      Producer/consumer tasks streaming through a pipe\n");
+    uart_puts("  aiotest       Async fs requests served by the secondary cores\n");
+    uart_puts("  mmaptest      Shared and copy-on-write mappings of a file\n");
+    uart_puts("  maps          List file mappings\n");
     uart_puts("  kill ID       Terminate a task by ID\n");
     uart_puts("  top           Live task monitor (any key to exit)\n");
     uart_puts("  memtest       Launch memory test task\n");
@@ -396,8 +468,10 @@ static void cmd_help(void) {
     uart_puts("  mmu           Show MMU/cache configuration\n");
     uart_puts("  cpus          Show per-core status\n");
     uart_puts("  history       Show command history\n");
+    uart_puts("  baud [RATE]   Show or set the UART baud rate (up to 3000000)\n");
+    uart_puts("  reboot        Warm reset (RAM, and so a snapshot, is kept)\n");
     uart_puts("\nFilesystem:\n");
-    uart_puts("  ls [path]     List directory contents\n");
+    uart_puts("  ls [-l] [path] List directory (-l: memory used, ratio)\n");
     uart_puts("  cd [path]     Change directory (cd .. to go up)\n");
     uart_puts("  pwd           Print working directory\n");
     uart_puts("  mkdir PATH    Create directory\n");
@@ -406,10 +480,22 @@ static void cmd_help(void) {
     uart_puts("  cat PATH      Show file contents\n");
     uart_puts("  write PATH    Write text to file (interactive)\n");
     uart_puts("  rm PATH       Remove file\n");
+    uart_puts("  mkfifo PATH   Create a named pipe\n");
+    uart_puts("  mount DEV PATH  Mount a FAT32 volume (read-only) on an empty dir\n");
+    uart_puts("  df            Filesystem node and storage usage\n");
+    uart_puts("  compress PATH   Store file (or dir's new files) LZ4-compressed\n");
+    uart_puts("  uncompress PATH Store it uncompressed again\n");
+    uart_puts("  cksum PATH    CRC-32C of a file\n");
+    uart_puts("  verify on|off Check chunk checksums on every read\n");
+    uart_puts("  blk           Block devices and buffer cache stats\n");
+    uart_puts("  sync          Write dirty cached blocks to their devices\n");
+    uart_puts("  snapshot [save|clear]  Show, save or drop the image restored at boot\n");
     uart_puts("\nShell features:\n");
     uart_puts("  Up/Down       Browse command history\n");
-    uart_puts("  Tab           Auto-complete commands\n");
+    uart_puts("  Tab           Auto-complete commands and paths\n");
+    uart_puts("  Left/Right    Move within the line (Home/End, Ctrl+A/Ctrl+E)\n");
     uart_puts("  Ctrl+C        Cancel current input\n");
+    uart_puts("  Ctrl+W        Delete the word before the cursor\n");
     uart_puts("  Ctrl+U        Clear current line\n");
     uart_puts("  Ctrl+L        Clear screen\n");
 }
@@ -421,15 +507,8 @@ static void cmd_ps(void) {
     for (int i = 0; i < MAX_TASKS; i++) {
         if (pool[i].state == TASK_DEAD && pool[i].name[0] == '\0') continue;
         if (pool[i].state == TASK_DEAD && i != 0) continue;
-        uart_put_dec(pool[i].id);
-        if (pool[i].id < 10) uart_puts("   ");
-        else uart_puts("  ");
-        uart_puts(pool[i].name);
-        int len = str_len(pool[i].name);
-        for (int j = len; j < 16; j++) uart_putc(' ');
-        uart_puts(state_name(pool[i].state));
-        if (&pool[i] == get_current_task()) uart_puts(" <-- current");
-        uart_puts("\n");
+        kprintf("%-4u%-16s%s%s\n", pool[i].id, pool[i].name, state_name(pool[i].state),
+                &pool[i] == get_current_task() ? " <-- current" : "");
     }
 }
 
@@ -437,9 +516,6 @@ static void cmd_top(void) {
     uart_puts("Live task monitor (press any key to exit)\n\n");
 
     while (1) {
-        // Check for keypress to exit
-        int c = uart_getc_nonblock();
-        if (c >= 0) break;
 
         // Move cursor to top-left of task area
         uart_puts("\033[3;1H");  // Row 3 (after header lines)
@@ -454,59 +530,24 @@ static void cmd_top(void) {
             if (pool[i].state == TASK_DEAD && pool[i].name[0] == '\0') continue;
             if (pool[i].state == TASK_DEAD && i != 0) continue;
 
-            uart_put_dec(pool[i].id);
-            if (pool[i].id < 10) uart_puts("   ");
-            else uart_puts("  ");
-            uart_puts(pool[i].name);
-            int len = str_len(pool[i].name);
-            for (int j = len; j < 16; j++) uart_putc(' ');
-            uart_puts(state_name(pool[i].state));
-
-            // Pad state column
-            int slen = str_len(state_name(pool[i].state));
-            for (int j = slen; j < 12; j++) uart_putc(' ');
-
+            char left[24] = "";
             if (pool[i].state == TASK_BLOCKED) {
                 long remaining = (long)pool[i].sleep_until - (long)timer_get_tick_count();
-                if (remaining > 0) {
-                    uart_put_dec((unsigned long)remaining);
-                    uart_puts(" left");
-                }
+                if (remaining > 0) ksnprintf(left, sizeof(left), "%ld left", remaining);
             }
-
-            if (&pool[i] == get_current_task()) uart_puts(" *");
-            uart_puts("\n");
+            kprintf("%-4u%-16s%-12s%s%s\n", pool[i].id, pool[i].name,
+                    state_name(pool[i].state), left,
+                    &pool[i] == get_current_task() ? " *" : "");
             active++;
         }
 
-        uart_puts("\nUptime: ");
-        uart_put_dec(timer_get_tick_count() / 10);
-        uart_puts("s  Tasks: ");
-        uart_put_dec(active);
-        uart_puts("/");
-        uart_put_dec(MAX_TASKS);
-        uart_puts("  Free mem: ");
-        uart_put_dec(memory_get_free_pages());
-        uart_puts(" pages\n");
-
-        // Wait ~500ms before refresh
-        // (Use a simple polling delay since we don't want task_sleep in shell)
-        unsigned long start;
-        asm volatile("mrs %0, cntpct_el0" : "=r"(start));
-        unsigned long freq;
-        asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
-        unsigned long target = start + freq / 2;  // 500ms
-        while (1) {
-            unsigned long now;
-            asm volatile("mrs %0, cntpct_el0" : "=r"(now));
-            if (now >= target) break;
-            // Check for keypress during wait
-            int k = uart_getc_nonblock();
-            if (k >= 0) goto top_done;
-        }
+        kprintf("\nUptime: %lus  Tasks: %d/%d  Free mem: %lu pages\n",
+                timer_get_tick_count() / 10, active, MAX_TASKS, memory_get_free_pages());
+
+        // Refresh every 500ms; the shell sleeps in between
+        if (tty_getc_timeout(500) >= 0) break;
     }
 
-top_done:
     uart_puts("\033[2J\033[H");  // Clear screen
 }
 
@@ -533,35 +574,21 @@ static void cmd_kill(const char *arg) {
     }
 
     if (task_kill((unsigned int)id) == 0) {
-        uart_puts("Killed task ");
-        uart_put_dec(id);
-        if (name) {
-            uart_puts(" (");
-            uart_puts(name);
-            uart_puts(")");
-        }
-        uart_puts("\n");
+        if (name) kprintf("Killed task %lu (%s)\n", id, name);
+        else kprintf("Killed task %lu\n", id);
     } else {
-        uart_puts("Task ");
-        uart_put_dec(id);
-        uart_puts(" not found or cannot be killed\n");
+        kprintf("Task %lu not found or cannot be killed\n", id);
     }
 }
 
 static void cmd_history_show(void) {
-    if (history_count == 0) {
+    int count = tty_history_count();
+    if (count == 0) {
         uart_puts("No command history\n");
         return;
     }
-    for (int i = history_count - 1; i >= 0; i--) {
-        const char *h = history_get(i);
-        if (h) {
-            uart_put_dec(history_count - i);
-            uart_puts("  ");
-            uart_puts(h);
-            uart_puts("\n");
-        }
-    }
+    for (int i = count - 1; i >= 0; i--)
+        kprintf("%d  %s\n", count - i, tty_history(i));
 }
 
 // Skip leading spaces and return pointer to argument
@@ -571,6 +598,118 @@ static const char *skip_arg(const char *cmd, int cmdlen) {
     return p;
 }
 
+static void cmd_df(void) {
+    fs_data_stats_t st;
+    fs_data_stats(&st);
+    unsigned long zslab_kb = st.zslabs * FS_ZSLAB_PAGES * (PAGE_SIZE / 1024);
+
+    kprintf("Nodes:      %lu used / %lu allocated\n", fs_nodes_used(), fs_nodes_total());
+    kprintf("Raw data:   %lu KB in %lu chunks\n",
+            st.raw_chunks * (FS_CHUNK_SIZE / 1024), st.raw_chunks);
+    kprintf("Compressed: %lu KB in %lu chunks -> %lu KB (%lu KB of slabs)",
+            st.zchunks * (FS_CHUNK_SIZE / 1024), st.zchunks, st.zbytes / 1024, zslab_kb);
+    if (st.zslabs) {
+        unsigned long r = st.zchunks * FS_CHUNK_SIZE * 10 / (zslab_kb * 1024);
+        kprintf(", ratio %lu.%lux", r / 10, r % 10);
+    }
+    if (st.zshared)
+        kprintf("\nDeduped:    %lu more chunks share those slots", st.zshared);
+    kprintf("\nFree:       %lu KB\n", memory_get_free_pages() * (PAGE_SIZE / 1024));
+}
+
+static void cmd_blk(void) {
+    block_dev_t *dev;
+    for (int i = 0; (dev = block_get_index(i)) != 0; i++) {
+        kprintf("%s: %lu MB (%lu sectors)\n", dev->name, dev->nsectors / 2048, dev->nsectors);
+    }
+    if (!block_get_index(0)) {
+        uart_puts("No block devices\n");
+        return;
+    }
+
+    bcache_stats_t st;
+    bcache_stats(&st);
+    kprintf("Cache:      %u / %d buffers, %u dirty\n", st.cached, BCACHE_BUFS, st.dirty);
+    kprintf("Hits:       %lu, misses %lu, read ahead %lu, direct %lu\n",
+            st.hits, st.misses, st.readahead, st.direct);
+    kprintf("Writebacks: %lu buffers; %lu transfers in all\n", st.writebacks, st.xfers);
+}
+
+// baud [RATE]: the console line rate. The terminal has to follow.
+static void cmd_baud(const char *arg) {
+    unsigned int actual;
+    if (*arg == '\0') {
+        unsigned int rate = uart_get_baud(&actual);
+        kprintf("%u baud (actual %u)\n", rate, actual);
+        return;
+    }
+    unsigned long rate = parse_num(arg);
+    if (rate == 0 || rate > UART_BAUD_MAX) {
+        kprintf("Usage: baud <rate>  (1..%d)\n", UART_BAUD_MAX);
+        return;
+    }
+    kprintf("Switching to %lu baud\n", rate);
+    if (uart_set_baud(rate) < 0) {
+        kprintf("baud: %lu is too slow for a %d Hz clock\n", rate, UART_CLOCK);
+        return;
+    }
+    uart_get_baud(&actual);
+    kprintf("Now at %lu baud (actual %u)\n", rate, actual);
+}
+
+// mount DEV PATH: attach a FAT32 volume under an empty directory
+static void cmd_mount(const char *arg) {
+    char name[BLOCK_NAME_MAX];
+    int n = 0;
+    while (arg[n] && arg[n] != ' ' && n < BLOCK_NAME_MAX - 1) {
+        name[n] = arg[n];
+        n++;
+    }
+    name[n] = '\0';
+    const char *path = skip_arg(arg, n);
+    if (!name[0] || !path[0]) {
+        uart_puts("Usage: mount <dev> <path>\n");
+        return;
+    }
+
+    block_dev_t *dev = block_get(name);
+    if (!dev) {
+        kprintf("mount: no such device: %s\n", name);
+        return;
+    }
+    fat_mount(dev, path);
+}
+
+// Stream a file to the UART through a descriptor (path resolved once);
+// large files go out by DMA while the shell sleeps
+static void cmd_cat(const char *path) {
+    int fd = fd_open(path, O_RDONLY);
+    if (fd == FD_EMFILE) {
+        uart_puts("cat: too many open files\n");
+        return;
+    }
+    if (fd < 0) {
+        kprintf("cat: not found: %s\n", path);
+        return;
+    }
+
+    char buf[256];
+    char last = '\n';
+    long n = fd_read(fd, buf, sizeof(buf));
+    if (n < 0) uart_puts("cat: is a directory\n");
+    else if (n == 0) uart_puts("(empty)\n");
+
+    while (n > 0) {
+        uart_write(buf, (unsigned long)n);
+        last = buf[n - 1];
+        n = fd_read(fd, buf, sizeof(buf));
+    }
+    // Add newline if content doesn't end with one
+    if (last != '\n')
+        uart_puts("\n");
+    fd_close(fd);
+}
+
 static void cmd_write_interactive(const char *path) {
     if (!path || path[0] == '\0') {
         uart_puts("Usage: write <filename>\n");
@@ -586,62 +725,46 @@ static void cmd_write_interactive(const char *path) {
 
     uart_puts("Enter text (Ctrl+D on empty line to finish):\n");
 
-    // Read lines into a buffer
-    char content[FS_MAX_DATA];
-    int total = 0;
+    // Each line is written as it is entered, so there is no size cap;
+    // the file is opened (and truncated) once the first line arrives
+    unsigned long total = 0;
+    int fd = -1;
 
-    while (total < FS_MAX_DATA - 2) {
+    while (1) {
         uart_puts("> ");
-        // Read one line
-        char line[256];
-        int lpos = 0;
-        while (1) {
-            unsigned char c = uart_getc();
-            if (c == 0x04) {  // Ctrl+D
-                if (lpos == 0) {
-                    uart_puts("\n");
-                    goto done_writing;
-                }
-                continue;
-            }
-            if (c == '\r' || c == '\n') {
-                line[lpos] = '\0';
-                uart_puts("\n");
-                break;
-            }
-            if ((c == 0x7F || c == 0x08) && lpos > 0) {
-                lpos--;
-                uart_puts("\b \b");
-                continue;
-            }
-            if (c == 0x03) {  // Ctrl+C — abort
-                uart_puts("^C\n");
-                uart_puts("write: aborted\n");
+        // Read one line (with room for its newline)
+        char line[TTY_LINE_MAX + 1];
+        int lpos = tty_readline(line, TTY_LINE_MAX, 0);
+        if (lpos == TTY_EOF) {
+            uart_puts("\n");
+            break;
+        }
+        if (lpos == TTY_INTR) {
+            uart_puts("write: aborted\n");
+            if (fd >= 0) fd_close(fd);
+            return;
+        }
+
+        // Append line + newline to the file
+        if (fd < 0) {
+            fd = fd_open(path, O_WRONLY | O_CREAT | O_TRUNC);
+            if (fd < 0) {
+                uart_puts(fd == FD_EMFILE ? "write: too many open files\n"
+                                          : "write: cannot open file\n");
                 return;
             }
-            if (c >= 32 && c < 127 && lpos < 255) {
-                line[lpos++] = c;
-                uart_putc(c);
-            }
         }
-
-        // Append line + newline to content
-        for (int i = 0; line[i] && total < FS_MAX_DATA - 2; i++)
-            content[total++] = line[i];
-        if (total < FS_MAX_DATA - 2)
-            content[total++] = '\n';
+        line[lpos++] = '\n';
+        if (fd_write(fd, line, lpos) != lpos) {
+            uart_puts("write: out of space\n");
+            break;
+        }
+        total += lpos;
     }
 
-done_writing:
-    content[total] = '\0';
-
+    if (fd >= 0) fd_close(fd);
     if (total > 0) {
-        fs_write(path, content);
-        uart_puts("Wrote ");
-        uart_put_dec(total);
-        uart_puts(" bytes to ");
-        uart_puts(path);
-        uart_puts("\n");
+        kprintf("Wrote %lu bytes to %s\n", total, path);
     } else {
         uart_puts("write: nothing written\n");
     }
@@ -663,48 +786,32 @@ static void process_command(char *cmd) {
         uart_puts("----  ------   -----\n");
         for (int i = 0; i < NUM_CORES; i++) {
             core_info_t *ci = smp_get_core_info(i);
-            uart_puts("  ");
-            uart_put_dec(i);
-            uart_puts("    ");
-            if (ci->online) uart_puts("online   ");
-            else            uart_puts("offline  ");
-            uart_put_dec(ci->ticks);
-            if ((unsigned int)i == smp_core_id()) uart_puts("  <-- you");
-            uart_puts("\n");
+            kprintf("  %d    %-9s%lu%s\n", i, ci->online ? "online" : "offline",
+                    (unsigned long)ci->ticks,
+                    (unsigned int)i == smp_core_id() ? "  <-- you" : "");
         }
         return;
     }
 
     if (str_eq(cmd, "time")) {
         unsigned long ticks = timer_get_tick_count();
-        uart_puts("Uptime: ");
-        uart_put_dec(ticks / 10);
-        uart_puts(" seconds (");
-        uart_put_dec(ticks);
-        uart_puts(" ticks)\n");
+        kprintf("Uptime: %lu seconds (%lu ticks)\n", ticks / 10, ticks);
         return;
     }
 
     if (str_eq(cmd, "info")) {
-        uart_puts("Raspberry Pi 4 Bare Metal OS\n");
-        uart_puts("CPU: ARM Cortex-A72 (ARMv8-A) x ");
         int online = 0;
         for (int i = 0; i < NUM_CORES; i++)
             if (smp_get_core_info(i)->online) online++;
-        uart_put_dec(online);
-        uart_puts(" cores\n");
-        uart_puts("Timer: ");
-        uart_put_dec(timer_get_frequency());
-        uart_puts(" Hz\n");
-        uart_puts("Scheduler: preemptive round-robin (100ms quantum)\n");
-        uart_puts("Max tasks: ");
-        uart_put_dec(MAX_TASKS);
-        uart_puts("\n");
-        uart_puts("Memory: ");
-        uart_put_dec((memory_get_free_pages() * PAGE_SIZE) / (1024 * 1024));
-        uart_puts(" MB free / ");
-        uart_put_dec((memory_get_total_pages() * PAGE_SIZE) / (1024 * 1024));
-        uart_puts(" MB total\n");
+        kprintf("Raspberry Pi 4 Bare Metal OS\n"
+                "CPU: ARM Cortex-A72 (ARMv8-A) x %d cores\n"
+                "Timer: %lu Hz\n"
+                "Scheduler: preemptive round-robin (100ms quantum)\n"
+                "Max tasks: %d\n"
+                "Memory: %lu MB free / %lu MB total\n",
+                online, (unsigned long)timer_get_frequency(), MAX_TASKS,
+                (memory_get_free_pages() * PAGE_SIZE) / (1024 * 1024),
+                (memory_get_total_pages() * PAGE_SIZE) / (1024 * 1024));
         return;
     }
 
@@ -715,6 +822,35 @@ static void process_command(char *cmd) {
         return;
     }
 
+    if (str_eq(cmd, "pipedemo")) {
+        if (fd_pipe(pipedemo_fds) < 0) {
+            uart_puts("pipedemo: can't create pipe\n");
+            return;
+        }
+        uart_puts("Spawning 'consumer' and 'producer' on a pipe...\n");
+        task_create(task_consumer, "consumer");
+        task_create(task_producer, "producer");
+        // The tasks hold their own references now
+        fd_close(pipedemo_fds[0]);
+        fd_close(pipedemo_fds[1]);
+        return;
+    }
+
+    if (str_eq(cmd, "aiotest")) {
+        cmd_aiotest();
+        return;
+    }
+
+    if (str_eq(cmd, "mmaptest")) {
+        cmd_mmaptest();
+        return;
+    }
+
+    if (str_eq(cmd, "maps")) {
+        mmap_dump();
+        return;
+    }
+
     if (str_eq(cmd, "memtest")) {
         uart_puts("Spawning 'memtest'...\n");
         task_create(task_memtest, "memtest");
@@ -722,15 +858,10 @@ static void process_command(char *cmd) {
     }
 
     if (str_eq(cmd, "mem")) {
-        uart_puts("Total: ");
-        uart_put_dec(memory_get_total_pages());
-        uart_puts(" pages (");
-        uart_put_dec((memory_get_total_pages() * PAGE_SIZE) / (1024 * 1024));
-        uart_puts(" MB)  Used: ");
-        uart_put_dec(memory_get_used_pages());
-        uart_puts("  Free: ");
-        uart_put_dec(memory_get_free_pages());
-        uart_puts("\n");
+        kprintf("Total: %lu pages (%lu MB)  Used: %lu  Free: %lu\n",
+                memory_get_total_pages(),
+                (memory_get_total_pages() * PAGE_SIZE) / (1024 * 1024),
+                memory_get_used_pages(), memory_get_free_pages());
         return;
     }
 
@@ -739,11 +870,7 @@ static void process_command(char *cmd) {
         if (size == 0) { uart_puts("Usage: alloc <size>\n"); return; }
         void *ptr = kmalloc(size);
         if (ptr) {
-            uart_puts("Allocated ");
-            uart_put_dec(size);
-            uart_puts(" bytes at ");
-            uart_put_hex((unsigned long)ptr);
-            uart_puts("\n");
+            kprintf("Allocated %lu bytes at %p\n", size, ptr);
         } else {
             uart_puts("Allocation failed!\n");
         }
@@ -753,9 +880,7 @@ static void process_command(char *cmd) {
     if (str_eq(cmd, "pgalloc")) {
         void *page = page_alloc();
         if (page) {
-            uart_puts("Page at ");
-            uart_put_hex((unsigned long)page);
-            uart_puts("\n");
+            kprintf("Page at %p\n", page);
         } else {
             uart_puts("Page allocation failed!\n");
         }
@@ -777,9 +902,7 @@ static void process_command(char *cmd) {
         }
         if (addr == 0) { uart_puts("Usage: pgfree <hex_address>\n"); return; }
         page_free((void *)addr);
-        uart_puts("Freed page at ");
-        uart_put_hex(addr);
-        uart_puts("\n");
+        kprintf("Freed page at %p\n", (void *)addr);
         return;
     }
 
@@ -791,19 +914,76 @@ static void process_command(char *cmd) {
     // ---- Filesystem commands ----
 
     if (str_eq(cmd, "ls")) {
-        fs_ls(0);
+        fs_ls(0, 0);
         return;
     }
     if (str_neq(cmd, "ls ", 3) == 0) {
-        fs_ls(skip_arg(cmd, 2));
+        const char *arg = skip_arg(cmd, 2);
+        int long_fmt = 0;
+        if (arg[0] == '-' && arg[1] == 'l' && (arg[2] == ' ' || arg[2] == '\0')) {
+            long_fmt = 1;
+            arg = skip_arg(arg, 2);
+        }
+        fs_ls(arg, long_fmt);
+        return;
+    }
+
+    if (str_eq(cmd, "df")) {
+        cmd_df();
+        return;
+    }
+
+    if (str_eq(cmd, "blk")) {
+        cmd_blk();
+        return;
+    }
+
+    if (str_eq(cmd, "sync")) {
+        if (bcache_sync(0) < 0) uart_puts("sync: write error\n");
+        return;
+    }
+
+    if (str_eq(cmd, "snapshot")) {
+        snapshot_info();
+        return;
+    }
+
+    if (str_eq(cmd, "snapshot save")) {
+        snapshot_save();
+        return;
+    }
+
+    if (str_eq(cmd, "snapshot clear")) {
+        snapshot_clear();
+        uart_puts("Snapshot dropped\n");
+        return;
+    }
+
+    if (str_eq(cmd, "reboot")) {
+        if (bcache_sync(0) < 0) uart_puts("sync: write error\n");
+        uart_puts("Rebooting...\n");
+        snapshot_reboot();
+        return;
+    }
+
+    if (str_neq(cmd, "compress ", 9) == 0) {
+        const char *arg = skip_arg(cmd, 8);
+        if (arg[0] == '\0') uart_puts("Usage: compress <path>\n");
+        else fs_set_compress(arg, 1);
+        return;
+    }
+
+    if (str_neq(cmd, "uncompress ", 11) == 0) {
+        const char *arg = skip_arg(cmd, 10);
+        if (arg[0] == '\0') uart_puts("Usage: uncompress <path>\n");
+        else fs_set_compress(arg, 0);
         return;
     }
 
     if (str_eq(cmd, "pwd")) {
         char path[FS_PATH_MAX];
         fs_get_path(fs_get_cwd(), path, FS_PATH_MAX);
-        uart_puts(path);
-        uart_puts("\n");
+        kprintf("%s\n", path);
         return;
     }
 
@@ -816,17 +996,15 @@ static void process_command(char *cmd) {
         if (arg[0] == '\0') {
             fs_set_cwd(fs_get_root());
         } else {
-            fs_node_t *dir = fs_resolve(arg);
+            fs_node_t *dir = fs_resolve_get(arg);
             if (!dir) {
-                uart_puts("cd: not found: ");
-                uart_puts(arg);
-                uart_puts("\n");
-            } else if (dir->type != FS_DIR) {
-                uart_puts("cd: not a directory: ");
-                uart_puts(arg);
-                uart_puts("\n");
+                kprintf("cd: not found: %s\n", arg);
             } else {
-                fs_set_cwd(dir);
+                if (dir->type != FS_DIR)
+                    kprintf("cd: not a directory: %s\n", arg);
+                else
+                    fs_set_cwd(dir);
+                fs_node_put(dir);
             }
         }
         return;
@@ -859,25 +1037,7 @@ static void process_command(char *cmd) {
             uart_puts("Usage: cat <filename>\n");
             return;
         }
-        unsigned long size = 0;
-        const char *data = fs_read(arg, &size);
-        if (!data) {
-            fs_node_t *node = fs_resolve(arg);
-            if (node && node->type == FS_DIR) {
-                uart_puts("cat: is a directory\n");
-            } else if (!node) {
-                uart_puts("cat: not found: ");
-                uart_puts(arg);
-                uart_puts("\n");
-            } else {
-                uart_puts("(empty)\n");
-            }
-        } else {
-            uart_puts(data);
-            // Add newline if content doesn't end with one
-            if (size > 0 && data[size - 1] != '\n')
-                uart_puts("\n");
-        }
+        cmd_cat(arg);
         return;
     }
 
@@ -886,6 +1046,39 @@ static void process_command(char *cmd) {
         return;
     }
 
+    if (str_eq(cmd, "baud") || str_neq(cmd, "baud ", 5) == 0) {
+        cmd_baud(skip_arg(cmd, 4));
+        return;
+    }
+
+    if (str_neq(cmd, "mount ", 6) == 0) {
+        cmd_mount(skip_arg(cmd, 5));
+        return;
+    }
+
+    if (str_neq(cmd, "cksum ", 6) == 0) {
+        const char *arg = skip_arg(cmd, 5);
+        unsigned int crc;
+        if (arg[0] == '\0') {
+            uart_puts("Usage: cksum <path>\n");
+        } else if (fs_checksum(arg, &crc) == 0) {
+            kprintf("%08x  %s\n", crc, arg);
+        }
+        return;
+    }
+
+    if (str_eq(cmd, "verify on") || str_eq(cmd, "verify off")) {
+        fs_set_verify(cmd[8] == 'n');
+        return;
+    }
+
+    if (str_neq(cmd, "mkfifo ", 7) == 0) {
+        const char *arg = skip_arg(cmd, 6);
+        if (arg[0] == '\0') uart_puts("Usage: mkfifo <path>\n");
+        else fs_mkfifo(arg);
+        return;
+    }
+
     if (str_neq(cmd, "rm ", 3) == 0) {
         const char *arg = skip_arg(cmd, 2);
         if (arg[0] == '\0') uart_puts("Usage: rm <filename>\n");
@@ -893,21 +1086,24 @@ static void process_command(char *cmd) {
         return;
     }
 
-    uart_puts("Unknown: ");
-    uart_puts(cmd);
-    uart_puts("  (try 'help')\n");
+    kprintf("Unknown: %s  (try 'help')\n", cmd);
 }
 
 // ========== Kernel Entry Point ==========
 
-void kernel_main(void) {
+void kernel_main(unsigned long dtb) {
     uart_init();
 
-    uart_puts("\033[2J\033[H");
-    uart_puts("\n");
-    uart_puts("========================================\n");
-    uart_puts("  Raspberry Pi 4 OS\n");
-    uart_puts("========================================\n\n");
+    // bootargs "baud=N" switches the console before anything is printed
+    unsigned long baud = fdt_bootarg_num(dtb, "baud");
+    int baud_rc = baud ? uart_set_baud(baud) : 0;
+
+    uart_puts("\033[2J\033[H\n"
+              "========================================\n"
+              "  Raspberry Pi 4 OS\n"
+              "========================================\n\n");
+    if (baud_rc < 0)
+        kprintf("baud=%lu: out of range, staying at %u\n", baud, uart_get_baud(0));
 
     uart_puts("Initializing memory...\n");
     memory_init();
@@ -917,26 +1113,38 @@ void kernel_main(void) {
 
     uart_puts("Initializing filesystem...\n");
     fs_init();
+    snapshot_restore();
+    initramfs_init(dtb);
+    if (procfs_init() == 0)
+        uart_puts("  procfs mounted on /proc\n");
+
+    uart_puts("Probing SD card...\n");
+    if (sdhci_init() == 0 && fs_mkdir("/sd")) {
+        if (fat_mount(block_get("sd0"), "/sd") == 0)
+            uart_puts("  FAT32 volume mounted on /sd\n");
+        else
+            fs_rmdir("/sd");
+    }
 
     uart_puts("Setting up GIC...\n");
     gic_init();
 
-    uart_puts("Timer: ");
-    uart_put_dec(timer_get_frequency());
-    uart_puts(" Hz\n");
+    kprintf("Timer: %lu Hz\n", (unsigned long)timer_get_frequency());
 
-    timer_init(100);
+    timer_init(TIMER_TICK_MS);
     gic_enable_interrupt(30);
     gic_enable_timer_irq();
 
     uart_puts("Scheduler init...\n");
     scheduler_init();
     scheduler_enabled = 1;
+    klog_init();
 
     uart_puts("Waking secondary cores...\n");
     smp_init();
 
     uart_puts("Enabling IRQs...\n");
+    uart_enable_irq();
     asm volatile("msr daifclr, #2");
 
     uart_puts("\nReady! Type 'help' for commands.\n");
@@ -945,7 +1153,7 @@ void kernel_main(void) {
     char input_buffer[LINE_MAX];
     while (1) {
         print_prompt();
-        shell_readline(input_buffer);
-        process_command(input_buffer);
+        if (tty_readline(input_buffer, LINE_MAX, &shell_tty) > 0)
+            process_command(input_buffer);
     }
 }